@@ -0,0 +1,106 @@
+//
+//  BufferPool.cpp
+//  usbmuxd2
+//
+
+#include "BufferPool.hpp"
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+
+static const size_t gBufferPoolSizeClasses[] = {
+    0x1000,
+    0x4000,
+    0x10000,
+    0x20000,
+    0x80000,
+};
+
+#pragma mark BufferPool
+BufferPool::BufferPool()
+: _inUse(0), _resident(0), _peakInUse(0), _peakResident(0)
+{
+    for (size_t size : gBufferPoolSizeClasses) {
+        size_t maxFree = BUFFERPOOL_CLASS_CACHE_BYTES/size;
+        if (!maxFree) maxFree = 1;
+        _classes.push_back({
+            .size = size,
+            .maxFree = maxFree,
+            .freelist = {}
+        });
+    }
+}
+
+BufferPool::~BufferPool(){
+    for (auto &c : _classes) {
+        for (void *buf : c.freelist) {
+            free(buf);
+        }
+    }
+}
+
+#pragma mark private
+BufferPool::SizeClass *BufferPool::class_for_size(size_t size){
+    for (auto &c : _classes) {
+        if (size <= c.size) return &c;
+    }
+    return NULL;
+}
+
+void BufferPool::update_peak(std::atomic<size_t> &peak, size_t val){
+    size_t cur = peak.load();
+    while (val > cur && !peak.compare_exchange_weak(cur, val));
+}
+
+#pragma mark members
+void *BufferPool::acquire(size_t size){
+    SizeClass *c = class_for_size(size);
+    void *ret = NULL;
+    if (c) {
+        size = c->size;
+        std::unique_lock<std::mutex> ul(_lck);
+        if (c->freelist.size()) {
+            ret = c->freelist.back();
+            c->freelist.pop_back();
+        }
+    }
+    if (!ret) {
+        retassure(ret = malloc(size), "Failed to alloc buffer of size 0x%zx",size);
+        update_peak(_peakResident, _resident += size);
+    }
+    update_peak(_peakInUse, _inUse += size);
+    return ret;
+}
+
+void BufferPool::release(void *buf, size_t size) noexcept{
+    SizeClass *c = NULL;
+    if (!buf) return;
+    if ((c = class_for_size(size))) {
+        size = c->size;
+        _inUse -= size;
+        std::unique_lock<std::mutex> ul(_lck);
+        if (c->freelist.size() < c->maxFree) {
+            c->freelist.push_back(buf);
+            return;
+        }
+    } else {
+        _inUse -= size;
+    }
+    free(buf);
+    _resident -= size;
+}
+
+plist_t BufferPool::getStatisticsPlist(){
+    plist_t p_ret = NULL;
+    assure(p_ret = plist_new_dict());
+    plist_dict_set_item(p_ret, "InUse", plist_new_uint(_inUse));
+    plist_dict_set_item(p_ret, "Resident", plist_new_uint(_resident));
+    plist_dict_set_item(p_ret, "PeakInUse", plist_new_uint(_peakInUse));
+    plist_dict_set_item(p_ret, "PeakResident", plist_new_uint(_peakResident));
+    return p_ret;
+}
+
+#pragma mark static
+BufferPool *BufferPool::shared(){
+    static BufferPool *gPool = new BufferPool();
+    return gPool;
+}
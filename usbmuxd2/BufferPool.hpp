@@ -0,0 +1,52 @@
+//
+//  BufferPool.hpp
+//  usbmuxd2
+//
+
+#ifndef BufferPool_hpp
+#define BufferPool_hpp
+
+#include <plist/plist.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+
+#define BUFFERPOOL_CLASS_CACHE_BYTES (4*1024*1024) //idle bytes kept around per size class
+
+/*
+    Size-classed slab pool for connection buffers.
+    Buffers are handed out on demand and returned when a connection goes idle,
+    a bounded number of free buffers per class is cached for reuse, the rest goes back to the system.
+ */
+class BufferPool{
+    struct SizeClass{
+        size_t size;
+        size_t maxFree;
+        std::vector<void*> freelist;
+    };
+    std::mutex _lck;
+    std::vector<SizeClass> _classes;
+    std::atomic<size_t> _inUse;
+    std::atomic<size_t> _resident;
+    std::atomic<size_t> _peakInUse;
+    std::atomic<size_t> _peakResident;
+
+private:
+    SizeClass *class_for_size(size_t size);
+    static void update_peak(std::atomic<size_t> &peak, size_t val);
+
+public:
+    BufferPool();
+    ~BufferPool();
+
+#pragma mark members
+    void *acquire(size_t size);
+    void release(void *buf, size_t size) noexcept;
+    plist_t getStatisticsPlist();
+
+#pragma mark static
+    static BufferPool *shared();
+};
+
+#endif /* BufferPool_hpp */
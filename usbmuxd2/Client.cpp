@@ -11,22 +11,30 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
 #include "Muxer.hpp"
+#include "TCP.hpp"
+#include "BufferPool.hpp"
+#include "ShmChannel.hpp"
 #include "MUXException.hpp"
 #include "sysconf/sysconf.hpp"
+#include "Manager/ForwardManager.hpp"
 
 #pragma mark Client
 Client::Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number)
 : _selfref{}, _mux(mux), _parent(parent)
 , _fd(fd), _number(number), _recvbuffer(NULL), _recvBytesCnt(0)
 , _proto_version(0),
-_isListening(false), _info{}
+_isListening(false), _isForwarded(false), _listenFilter{{}, 0, 0, 0xFFFF}, _connectTag(0), _connectCoalesceMs(-1), _connectWeight(0), _connectShmRingSize(0), _info{}
+, _isMultiplex(false), _muxWakePipe{-1,-1}, _muxOutHead(0)
 {
     debug("[Client] initializing Client %d",_fd);
     const int bufsize = Client::bufsize;
     constexpr int yes = 1;
 
-    assure(_recvbuffer = (char*)malloc(bufsize));
 
     if (setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(int)) == -1) {
         warning("Could not set send buffer for client socket");
@@ -53,7 +61,9 @@ Client::~Client(){
     }
     
     safeClose(_fd);
-    safeFree(_recvbuffer);
+    safeClose(_muxWakePipe[0]);
+    safeClose(_muxWakePipe[1]);
+    release_recvbuffer();
 }
 
 #pragma mark inheritance function
@@ -62,13 +72,22 @@ void Client::stopAction() noexcept{
 }
 
 void Client::afterLoop() noexcept{
+    mux_close_streams();
     _mux->delete_client(_selfref.lock());
 }
 
 bool Client::loopEvent(){
-    _recvBytesCnt = 0;
     try {
+        if (_isMultiplex) {
+            mux_loop_event();
+            return true;
+        }
+        _recvBytesCnt = 0;
         recv_data();
+        if (_isListening) {
+            //listeners mostly sit idle, don't keep a receive buffer around for them
+            release_recvbuffer();
+        }
     } catch (tihmstar::MUXException_client_disconnected &e){
         debug("Client disconnected, this is fine");
         throw;
@@ -104,6 +123,86 @@ void Client::update_client_info(const plist_t dict){
     }
 }
 
+Muxer::listen_filter Client::parse_listen_filter(const plist_t dict){
+    plist_t node = NULL;
+    Muxer::listen_filter filter{{}, 0, 0, 0xFFFF};
+
+    if ((node = plist_dict_get_item(dict, "FilterUDIDs")) && (plist_get_node_type(node) == PLIST_ARRAY)) {
+        for (uint32_t i = 0; i < plist_array_get_size(node); i++) {
+            plist_t p_udid = plist_array_get_item(node, i);
+            const char *str = NULL;
+            uint64_t str_len = 0;
+            if (plist_get_node_type(p_udid) != PLIST_STRING) continue;
+            if ((str = plist_get_string_ptr(p_udid, &str_len)) && str_len) {
+                filter.udids.insert(std::string(str,str_len));
+            }
+        }
+    }
+
+    if ((node = plist_dict_get_item(dict, "FilterConnectionType")) && (plist_get_node_type(node) == PLIST_STRING)) {
+        const char *str = NULL;
+        uint64_t str_len = 0;
+        if ((str = plist_get_string_ptr(node, &str_len))) {
+            std::string ctype{str,str_len};
+            if (ctype == "USB") {
+                filter.connTypes = Device::MUXCONN_USB;
+            }else if (ctype == "Network"){
+                filter.connTypes = Device::MUXCONN_WIFI;
+            }else{
+                warning("Client %d requested unknown FilterConnectionType '%s', ignoring",_fd,ctype.c_str());
+            }
+        }
+    }
+
+    if ((node = plist_dict_get_item(dict, "FilterProductIDMin")) && (plist_get_node_type(node) == PLIST_UINT)) {
+        uint64_t val = 0;
+        plist_get_uint_val(node, &val);
+        filter.pidMin = (uint16_t)(val > 0xFFFF ? 0xFFFF : val);
+    }
+
+    if ((node = plist_dict_get_item(dict, "FilterProductIDMax")) && (plist_get_node_type(node) == PLIST_UINT)) {
+        uint64_t val = 0;
+        plist_get_uint_val(node, &val);
+        filter.pidMax = (uint16_t)(val > 0xFFFF ? 0xFFFF : val);
+    }
+
+    return filter;
+}
+
+bool Client::listenFilterMatches(const char *serial, int conntype, int pid) noexcept{
+    if (!_listenFilter.udids.empty() && !_listenFilter.udids.count(serial)) return false;
+    if (_listenFilter.connTypes && !(_listenFilter.connTypes & conntype)) return false;
+    if (_listenFilter.pidMin != 0 || _listenFilter.pidMax != 0xFFFF) {
+        //network devices don't have a product id, a range filter only matches USB devices
+        if (pid < _listenFilter.pidMin || pid > _listenFilter.pidMax) return false;
+    }
+    return true;
+}
+
+bool Client::hasListenFilter() noexcept{
+    return !_listenFilter.udids.empty() || _listenFilter.connTypes || _listenFilter.pidMin != 0 || _listenFilter.pidMax != 0xFFFF;
+}
+
+int Client::peer_uid() noexcept{
+#ifdef SO_PEERCRED
+    struct ucred cred = {};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) return -1;
+    return (int)cred.uid;
+#else
+    uid_t uid = 0;
+    gid_t gid = 0;
+    if (getpeereid(_fd, &uid, &gid)) return -1;
+    return (int)uid;
+#endif //SO_PEERCRED
+}
+
+void Client::release_recvbuffer() noexcept{
+    BufferPool::shared()->release(_recvbuffer, Client::bufsize);
+    _recvbuffer = NULL;
+    _recvBytesCnt = 0;
+}
+
 void Client::readData(){
     ssize_t got = 0;
     size_t readsize = Client::bufsize-_recvBytesCnt;
@@ -117,7 +216,9 @@ void Client::readData(){
 }
 
 void Client::recv_data(){
-    const usbmuxd_header *hdr = (const usbmuxd_header*)_recvbuffer;
+    const usbmuxd_header *hdr = NULL;
+    if (!_recvbuffer) _recvbuffer = (char*)BufferPool::shared()->acquire(Client::bufsize);
+    hdr = (const usbmuxd_header*)_recvbuffer;
     readData();
 
     if (_recvBytesCnt < sizeof(usbmuxd_header)) {
@@ -135,6 +236,7 @@ void Client::recv_data(){
 void Client::processData(const usbmuxd_header *hdr){
     uint16_t portnum = 0;
     uint32_t device_id = 0;
+    Muxer::listen_filter filter{{}, 0, 0, 0xFFFF};
 
     std::string message;
 
@@ -177,6 +279,7 @@ void Client::processData(const usbmuxd_header *hdr){
             update_client_info(p_recieved);
 
             if (message == "Listen") {
+                filter = parse_listen_filter(p_recieved);
                 goto PLIST_CLIENT_LISTEN_LOC;
             } else if (message == "Connect") {
 
@@ -210,10 +313,51 @@ void Client::processData(const usbmuxd_header *hdr){
                     return;
                 }
 
+                // optional: merge small writes for up to CoalesceMs milliseconds
+                {
+                    plist_t p_intval = NULL;
+                    uint64_t tmpCoalesceMs = 0;
+                    if ((p_intval = plist_dict_get_item(p_recieved, "CoalesceMs")) && plist_get_node_type(p_intval) == PLIST_UINT) {
+                        plist_get_uint_val(p_intval, &tmpCoalesceMs);
+                        _connectCoalesceMs = (tmpCoalesceMs > 1000) ? 1000 : (int)tmpCoalesceMs;
+                    }
+                }
+
+                // optional: share of the device's USB bandwidth relative to other connections
+                {
+                    plist_t p_intval = NULL;
+                    uint64_t tmpWeight = 0;
+                    if ((p_intval = plist_dict_get_item(p_recieved, "Weight")) && plist_get_node_type(p_intval) == PLIST_UINT) {
+                        plist_get_uint_val(p_intval, &tmpWeight);
+                        _connectWeight = (tmpWeight > 0xffff) ? 0xffff : (uint32_t)tmpWeight;
+                    }
+                }
+
+                // optional: exchange payload through a shared memory ring pair instead of the socket
+                {
+                    plist_t p_val = NULL;
+                    if ((p_val = plist_dict_get_item(p_recieved, "SharedMemory")) && plist_get_node_type(p_val) == PLIST_BOOLEAN && plist_bool_val_is_true(p_val)) {
+                        uint64_t tmpRingSize = SHMCHANNEL_DEFAULT_RING_SIZE;
+                        if ((p_val = plist_dict_get_item(p_recieved, "SharedMemoryRingSize")) && plist_get_node_type(p_val) == PLIST_UINT) {
+                            plist_get_uint_val(p_val, &tmpRingSize);
+                        }
+                        _connectShmRingSize = (tmpRingSize > SHMCHANNEL_MAX_RING_SIZE) ? SHMCHANNEL_MAX_RING_SIZE : (uint32_t)tmpRingSize;
+                        if (!_connectShmRingSize) _connectShmRingSize = SHMCHANNEL_MIN_RING_SIZE;
+                    }
+                }
+
                 goto PLIST_CLIENT_CONNECTION_LOC;
             } else if (message == "ListDevices") {
                 _mux->send_deviceList(_selfref.lock(), hdr->tag);
                 return;
+            } else if (message == "ListDevicesSince") {
+                plist_t p_intval = NULL;
+                uint64_t generation = 0;
+                if ((p_intval = plist_dict_get_item(p_recieved, "Generation")) && plist_get_node_type(p_intval) == PLIST_UINT) {
+                    plist_get_uint_val(p_intval, &generation);
+                }
+                _mux->send_deviceListSince(_selfref.lock(), hdr->tag, generation);
+                return;
             } else if (message == "ReadBUID") {
                 plist_t p_rsp = NULL;
                 cleanup([&]{
@@ -343,6 +487,67 @@ void Client::processData(const usbmuxd_header *hdr){
             }else if (message == "ListListeners") {
                 _mux->send_listenerList(_selfref.lock(), hdr->tag);
                 return;
+            }else if (message == "ReadStatistics") {
+                _mux->send_statistics(_selfref.lock(), hdr->tag);
+                return;
+            }else if (message == "AddForward" || message == "RemoveForward") {
+                // ports are plain port numbers here, not in network byte order like Connect's PortNumber
+                uint64_t localPort = 0;
+                uint64_t devicePort = 0;
+                int uid = -1;
+                std::string udid;
+                plist_t p_val = NULL;
+                if ((p_val = plist_dict_get_item(p_recieved, "LocalPort")) && plist_get_node_type(p_val) == PLIST_UINT) {
+                    plist_get_uint_val(p_val, &localPort);
+                }
+                if ((p_val = plist_dict_get_item(p_recieved, "DevicePort")) && plist_get_node_type(p_val) == PLIST_UINT) {
+                    plist_get_uint_val(p_val, &devicePort);
+                }
+                if ((p_val = plist_dict_get_item(p_recieved, "UDID")) && plist_get_node_type(p_val) == PLIST_STRING) {
+                    const char *str = NULL;
+                    uint64_t str_len = 0;
+                    if ((str = plist_get_string_ptr(p_val, &str_len))) udid = std::string(str,str_len);
+                }
+                if (!localPort || localPort > 0xffff || devicePort > 0xffff || (message == "AddForward" && !devicePort)) {
+                    send_result(hdr->tag, EINVAL);
+                    return;
+                }
+                /*
+                    The daemon may still be root here, privileged ports can only be forwarded from the config file.
+                    Forwards remember who added them, only that user or root may remove them again.
+                 */
+                if ((uid = peer_uid()) < 0 || (message == "AddForward" && localPort < FORWARD_RUNTIME_PORT_MIN)) {
+                    warning("Client %d (uid %d) is not allowed to %s local port %llu",_fd,uid,message.c_str(),(unsigned long long)localPort);
+                    send_result(hdr->tag, EPERM);
+                    return;
+                }
+                try {
+                    if (message == "AddForward") {
+                        _mux->add_forward(udid, (uint16_t)localPort, (uint16_t)devicePort, uid);
+                    } else {
+                        _mux->remove_forward((uint16_t)localPort, uid);
+                    }
+                } catch (tihmstar::exception &e) {
+                    error("%s of local port %llu failed with error=%s",message.c_str(),(unsigned long long)localPort,e.what());
+                    send_result(hdr->tag, RESULT_BADCOMMAND);
+                    return;
+                }
+                send_result(hdr->tag, RESULT_OK);
+                return;
+            }else if (message == "ListForwards") {
+                _mux->send_forwardList(_selfref.lock(), hdr->tag);
+                return;
+            }else if (message == "Multiplex") {
+                if (_muxWakePipe[0] == -1) {
+                    assure(!pipe(_muxWakePipe));
+                    fcntl(_muxWakePipe[0], F_SETFL, fcntl(_muxWakePipe[0], F_GETFL) | O_NONBLOCK);
+                    fcntl(_muxWakePipe[1], F_SETFL, fcntl(_muxWakePipe[1], F_GETFL) | O_NONBLOCK);
+                }
+                send_result(hdr->tag, RESULT_OK);
+                debug("Client %d now MULTIPLEXING", _fd);
+                _isMultiplex = true;
+                _recvBytesCnt = 0;
+                return;
             }else{
                 error("Unexpected command '%s' received!", message.c_str());
                 send_result(hdr->tag, RESULT_BADCOMMAND);
@@ -381,12 +586,15 @@ PLIST_CLIENT_CONNECTION_LOC:
         send_result(hdr->tag, RESULT_CONNREFUSED);
         return;
     }
+    //the socket belongs to TCP now, we won't read any more requests
+    release_recvbuffer();
     retcustomerror(MUXException_graceful_kill,"graceful kill");
 
 PLIST_CLIENT_LISTEN_LOC:
     send_result(hdr->tag, RESULT_OK);
     debug("Client %d now LISTENING", _fd);
     _isListening = true;
+    _mux->add_listener(_selfref.lock(), std::move(filter));
     _mux->notify_alldevices(_selfref.lock()); //inform client about all connected devices
     return;
 }
@@ -437,6 +645,342 @@ void Client::send_result(uint32_t tag, uint32_t result){
     }
 }
 
+void Client::send_shm_result(uint32_t tag, size_t ringSize, const int *fds, int fdcnt){
+    plist_t dict = NULL;
+    char *xml = NULL;
+    cleanup([&]{
+        safeFree(xml);
+        safeFreeCustom(dict, plist_free);
+    });
+    uint32_t xmlsize = 0;
+    struct usbmuxd_header hdr = {};
+    struct iovec iov[2] = {};
+    struct msghdr msg = {};
+    char cmsgbuf[CMSG_SPACE(sizeof(int)*3)] = {};
+    struct cmsghdr *cmsg = NULL;
+    size_t totalLen = 0;
+    ssize_t didSend = 0;
+
+    retassure(fdcnt <= 3, "too many fds");
+    dict = plist_new_dict();
+    plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
+    plist_dict_set_item(dict, "Number", plist_new_uint(RESULT_OK));
+    plist_dict_set_item(dict, "SharedMemoryRingSize", plist_new_uint(ringSize));
+    plist_to_xml(dict, &xml, &xmlsize);
+
+    hdr.length = (uint32_t)(sizeof(hdr) + xmlsize);
+    hdr.version = _proto_version;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = tag;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = xml;
+    iov[1].iov_len = xmlsize;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    //the fds travel with the first byte of the result
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int)*fdcnt);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int)*fdcnt);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*fdcnt);
+
+    debug("send_shm_result fd %d tag %d ringSize %zu", _fd, tag, ringSize);
+    std::unique_lock<std::mutex> ul(_wlock);
+    totalLen = iov[0].iov_len + iov[1].iov_len;
+    assure((didSend = sendmsg(_fd, &msg, 0)) > 0);
+    if ((size_t)didSend < totalLen) {
+        //fds are already across, the remainder goes out like any other packet
+        size_t skip = didSend;
+        if (skip < sizeof(hdr)) {
+            assure(send(_fd, (char*)&hdr + skip, sizeof(hdr) - skip, 0) == (ssize_t)(sizeof(hdr) - skip));
+            skip = 0;
+        } else {
+            skip -= sizeof(hdr);
+        }
+        assure(send(_fd, xml + skip, xmlsize - skip, 0) == (ssize_t)(xmlsize - skip));
+    }
+}
+
+#pragma mark multiplexed session
+void Client::mux_loop_event(){
+    std::vector<std::shared_ptr<TCP>> streams;
+    int timeout = -1;
+    int err = 0;
+    bool wantWrite = false;
+    size_t off = 0;
+
+    {
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        streams.reserve(_streams.size());
+        for (auto &s : _streams) streams.push_back(s.second);
+    }
+    //streams have no loop of their own, run their delayed ACK timers from here
+    for (auto &s : streams) {
+        int t = s->stream_tick();
+        if (t != -1 && (timeout == -1 || t < timeout)) timeout = t;
+    }
+    streams.clear();
+
+    {
+        std::unique_lock<std::mutex> ul(_wlock);
+        wantWrite = _muxOutHead < _muxOut.size();
+    }
+
+    {
+        struct pollfd pfds[2] = {
+            {
+                .fd = _fd,
+                .events = (short)(POLLIN | (wantWrite ? POLLOUT : 0))
+            },
+            {
+                .fd = _muxWakePipe[0],
+                .events = POLLIN
+            }
+        };
+        retassure((err = poll(pfds,2,timeout)) != -1 || errno == EINTR, "[Client] poll failed on multiplexed client %d",_fd);
+        if (err <= 0) return;
+        if (pfds[1].revents & POLLIN) {
+            char wakebuf[0x40];
+            while (read(_muxWakePipe[0], wakebuf, sizeof(wakebuf)) > 0);
+        }
+        if (pfds[0].revents & POLLOUT) {
+            std::unique_lock<std::mutex> ul(_wlock);
+            retassure(mux_flush_nolock(), "failed to write to multiplexed client %d with error=%d (%s)",_fd,errno,strerror(errno));
+        }
+        if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) return;
+    }
+
+    if (!_recvbuffer) _recvbuffer = (char*)BufferPool::shared()->acquire(Client::bufsize);
+    readData();
+
+    while (_recvBytesCnt - off >= sizeof(usbmuxd_mux_frame)) {
+        const usbmuxd_mux_frame *frame = (const usbmuxd_mux_frame*)(_recvbuffer + off);
+        retassure(frame->length <= Client::bufsize - sizeof(usbmuxd_mux_frame), "frame on multiplexed client %d is too large (%u bytes)",_fd,frame->length);
+        if (_recvBytesCnt - off < sizeof(usbmuxd_mux_frame) + frame->length) break;
+        mux_process_frame(frame);
+        off += sizeof(usbmuxd_mux_frame) + frame->length;
+    }
+    if (off) {
+        memmove(_recvbuffer, _recvbuffer + off, _recvBytesCnt - off);
+        _recvBytesCnt -= off;
+    }
+}
+
+void Client::mux_process_frame(const usbmuxd_mux_frame *frame){
+    const char *payload = (const char*)(frame + 1);
+    std::shared_ptr<TCP> conn = nullptr;
+
+    if (frame->type == MUX_FRAME_OPEN) {
+        if (frame->length < sizeof(usbmuxd_mux_open)) {
+            error("Client %d sent a short OPEN frame for stream %u",_fd,frame->stream);
+            send_stream_refused(frame->stream, RESULT_BADCOMMAND);
+            return;
+        }
+        mux_open_stream(frame->stream, (const usbmuxd_mux_open*)payload);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        auto it = _streams.find(frame->stream);
+        //frames may cross a CLOSE from our side, those are fine to drop
+        if (it == _streams.end()) return;
+        conn = it->second;
+    }
+
+    try {
+        switch (frame->type) {
+            case MUX_FRAME_DATA:
+                conn->stream_input(payload, frame->length);
+                break;
+            case MUX_FRAME_WINDOW:
+            {
+                uint32_t increment = 0;
+                retassure(frame->length >= sizeof(increment), "short WINDOW frame");
+                memcpy(&increment, payload, sizeof(increment));
+                conn->stream_window(increment);
+                break;
+            }
+            case MUX_FRAME_CLOSE:
+                conn->stream_close();
+                break;
+            default:
+                reterror("unknown frame type %u",frame->type);
+        }
+    } catch (tihmstar::exception &e) {
+        //only this stream is broken, the session keeps going
+        error("Stream %u of client %d failed with error=%s code=%d",frame->stream,_fd,e.what(),e.code());
+        conn->kill(__LINE__);
+    }
+}
+
+void Client::mux_open_stream(uint32_t stream, const usbmuxd_mux_open *req){
+    std::shared_ptr<TCP> conn = nullptr;
+    uint16_t portnum = ntohs(req->port);
+
+    debug("Client %d stream %u request to device %d port %d", _fd, stream, req->device_id, portnum);
+    if (!stream) {
+        send_stream_refused(stream, RESULT_BADCOMMAND);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        if (_streams.find(stream) != _streams.end()) {
+            error("Client %d tried to open stream %u twice",_fd,stream);
+            send_stream_refused(stream, RESULT_BADCOMMAND);
+            return;
+        }
+    }
+
+    try {
+        conn = _mux->open_stream(req->device_id, portnum, _selfref.lock());
+    } catch (tihmstar::exception &e) {
+#ifdef DEBUG
+        e.dump();
+#endif
+        send_stream_refused(stream, RESULT_BADDEV);
+        return;
+    }
+
+    {
+        //register before the SYN goes out, the answer may come back right away
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        _streams[stream] = conn;
+    }
+    try {
+        conn->connect_stream(stream, req->window);
+    } catch (tihmstar::exception &e) {
+        error("failed to open stream %u of client %d error=%s code=%d",stream,_fd,e.what(),e.code());
+        conn->kill(__LINE__); //reaping the connection reports the failure to the client
+    }
+}
+
+bool Client::mux_flush_nolock(){
+    while (_muxOutHead < _muxOut.size()) {
+        ssize_t didSend = send(_fd, _muxOut.data() + _muxOutHead, _muxOut.size() - _muxOutHead, MSG_DONTWAIT);
+        if (didSend < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        _muxOutHead += didSend;
+    }
+    _muxOut.clear();
+    _muxOutHead = 0;
+    return true;
+}
+
+void Client::mux_close_streams() noexcept{
+    std::map<uint32_t,std::shared_ptr<TCP>> streams;
+    {
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        streams.swap(_streams);
+    }
+    for (auto &s : streams) {
+        s.second->kill(__LINE__);
+    }
+}
+
+void Client::send_frame(uint16_t type, uint32_t stream, const struct iovec *payload, int payload_cnt, size_t payload_len) noexcept{
+    struct usbmuxd_mux_frame frame{
+        .length = (uint32_t)payload_len,
+        .type = type,
+        .reserved = 0,
+        .stream = stream
+    };
+    std::unique_lock<std::mutex> ul(_wlock);
+    size_t skip = 0;
+    bool wasQueued = _muxOutHead < _muxOut.size();
+
+    if (!wasQueued) {
+        //try to hand it straight to the socket, only queue what it doesn't take
+        struct iovec iov[8] = {};
+        struct msghdr msg = {};
+        size_t left = payload_len;
+        int cnt = 1;
+        ssize_t didSend = 0;
+        iov[0].iov_base = &frame;
+        iov[0].iov_len = sizeof(frame);
+        for (int i=0; i<payload_cnt && left && cnt < 8; i++, cnt++) {
+            iov[cnt].iov_base = payload[i].iov_base;
+            iov[cnt].iov_len = (payload[i].iov_len < left) ? payload[i].iov_len : left;
+            left -= iov[cnt].iov_len;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        if ((didSend = sendmsg(_fd, &msg, MSG_DONTWAIT)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                //the session loop notices the dead socket and tears down all streams
+                debug("failed to send frame to multiplexed client %d with errno=%d (%s)",_fd,errno,strerror(errno));
+                return;
+            }
+            didSend = 0;
+        }
+        skip = didSend;
+        if (skip == sizeof(frame) + payload_len) return;
+    }
+
+    if (skip < sizeof(frame)) {
+        _muxOut.insert(_muxOut.end(), (char*)&frame + skip, (char*)(&frame + 1));
+        skip = 0;
+    } else {
+        skip -= sizeof(frame);
+    }
+    for (int i=0; i<payload_cnt && payload_len; i++) {
+        const char *src = (const char*)payload[i].iov_base;
+        size_t len = (payload[i].iov_len < payload_len) ? payload[i].iov_len : payload_len;
+        payload_len -= len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        _muxOut.insert(_muxOut.end(), src + skip, src + len);
+        skip = 0;
+    }
+    //make the session loop wait for POLLOUT
+    if (!wasQueued) wake_mux();
+}
+
+void Client::send_stream_opened(uint32_t stream, uint32_t window) noexcept{
+    struct usbmuxd_mux_open_result res{
+        .result = RESULT_OK,
+        .window = window
+    };
+    struct iovec iov = {.iov_base = &res, .iov_len = sizeof(res)};
+    send_frame(MUX_FRAME_OPEN, stream, &iov, 1, sizeof(res));
+}
+
+void Client::send_stream_refused(uint32_t stream, uint32_t result) noexcept{
+    struct usbmuxd_mux_open_result res{
+        .result = result,
+        .window = 0
+    };
+    struct iovec iov = {.iov_base = &res, .iov_len = sizeof(res)};
+    send_frame(MUX_FRAME_OPEN, stream, &iov, 1, sizeof(res));
+}
+
+void Client::send_stream_closed(uint32_t stream, bool wasOpen) noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_streamsLck);
+        _streams.erase(stream);
+    }
+    if (wasOpen) {
+        send_frame(MUX_FRAME_CLOSE, stream, NULL, 0, 0);
+    } else {
+        send_stream_refused(stream, RESULT_CONNREFUSED);
+    }
+}
+
+void Client::wake_mux() noexcept{
+    if (_muxWakePipe[1] == -1) return;
+    while (write(_muxWakePipe[1], "", 1) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: the pipe is full, so the mux loop is going to wake up anyway
+        if (errno != EAGAIN) error("[Client] failed to wake mux loop of client %d errno=%d (%s)",_fd,errno,strerror(errno));
+        break;
+    }
+}
+
 #pragma mark public member function
 void Client::kill() noexcept{
     debug("[Client] killing Client %d",_fd);
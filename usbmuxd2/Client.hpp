@@ -9,13 +9,21 @@
 #define Client_hpp
 
 #include "usbmuxd2-proto.h"
+#include "Muxer.hpp"
 #include "Manager/ClientManager.hpp"
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/Event.hpp>
 #include <plist/plist.h>
 #include <memory>
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
 
 class Muxer;
+class TCP;
 class Client : public tihmstar::Manager{
 public:
     static constexpr int bufsize = 0x20000;
@@ -42,10 +50,23 @@ private:
     size_t _recvBytesCnt;
     uint32_t _proto_version;
     bool _isListening;
+    bool _isForwarded; //socket comes from a ForwardManager port, it never speaks the usbmux protocol
+    Muxer::listen_filter _listenFilter; //written by Muxer::add_listener only
     uint32_t _connectTag;
+    int _connectCoalesceMs; //-1 = use the default
+    uint32_t _connectWeight; //0 = pick by destination port
+    uint32_t _connectShmRingSize; //0 = payload goes through the socket
     cinfo _info;
     std::mutex _wlock;
 
+    //multiplexed session, the socket carries usbmuxd_mux_frame from here on
+    bool _isMultiplex;
+    int _muxWakePipe[2];
+    std::map<uint32_t,std::shared_ptr<TCP>> _streams;
+    std::mutex _streamsLck;
+    std::vector<char> _muxOut; //frames the socket didn't take yet (guarded by _wlock)
+    size_t _muxOutHead;
+
 #pragma mark inheritance function
     virtual void stopAction() noexcept override;
     virtual void afterLoop() noexcept override;
@@ -54,7 +75,11 @@ private:
 
 #pragma mark private member function
     void update_client_info(const plist_t dict);
+    Muxer::listen_filter parse_listen_filter(const plist_t dict);
+
+    int peer_uid() noexcept; //-1 if unknown
 
+    void release_recvbuffer() noexcept;
     void readData();
     void recv_data();
 
@@ -64,6 +89,18 @@ private:
     void send_pkt(uint32_t tag, usbmuxd_msgtype msg, void *payload, int payload_length);
     void send_plist_pkt(uint32_t tag, plist_t plist);
     void send_result(uint32_t tag, uint32_t result);
+    void send_shm_result(uint32_t tag, size_t ringSize, const int *fds, int fdcnt);
+
+    void mux_loop_event();
+    void mux_process_frame(const struct usbmuxd_mux_frame *frame);
+    void mux_open_stream(uint32_t stream, const struct usbmuxd_mux_open *req);
+    bool mux_flush_nolock();
+    void mux_close_streams() noexcept;
+    void send_frame(uint16_t type, uint32_t stream, const struct iovec *payload, int payload_cnt, size_t payload_len) noexcept;
+    void send_stream_opened(uint32_t stream, uint32_t window) noexcept;
+    void send_stream_refused(uint32_t stream, uint32_t result) noexcept;
+    void send_stream_closed(uint32_t stream, bool wasOpen) noexcept;
+    void wake_mux() noexcept;
 
 public:
     Client(Muxer *mux, ClientManager *parent, int fd, uint64_t number);
@@ -74,11 +111,16 @@ public:
     void deconstruct() noexcept;
 
     const cinfo &getClientInfo(){return _info;};
+    uint32_t getConnectWeight(){return _connectWeight;};
+    bool listenFilterMatches(const char *serial, int conntype, int pid) noexcept; //pid -1 if the device has none
+    bool hasListenFilter() noexcept;
 
 #pragma mark friends
     friend class ClientManager;
+    friend class ForwardManager;
     friend class Muxer;
     friend class TCP;
+    friend class WIFIDevice;
 };
 
 #endif /* Client_hpp */
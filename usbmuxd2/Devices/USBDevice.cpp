@@ -7,7 +7,9 @@
 
 #include "USBDevice.hpp"
 #include "../Manager/USBDeviceManager.hpp"
+#include "../Manager/USBEventShard.hpp"
 #include "TCP.hpp"
+#include "Client.hpp"
 
 #include <libgeneral/macros.h>
 
@@ -15,9 +17,52 @@
 
 #include <string.h>
 
+#define MIN(a,b) ((a) > (b) ? (b) : (a))
+
+static USBDevice::TxPolicy gUSBTxPolicy = {
+    .aggregate = false,
+    .maxInflight = 0,
+    .maxQueuedPerFlow = 0,
+};
+
+#pragma mark iovec helpers
+static void iov_gather(void *dst, const struct iovec *iov, int iovcnt, size_t off, size_t len){
+    uint8_t *d = (uint8_t*)dst;
+    for (int i=0; i<iovcnt && len; i++) {
+        size_t cpylen = iov[i].iov_len;
+        if (off >= cpylen) {
+            off -= cpylen;
+            continue;
+        }
+        cpylen -= off;
+        if (cpylen > len) cpylen = len;
+        if (d != (uint8_t*)iov[i].iov_base + off) memmove(d, (uint8_t*)iov[i].iov_base + off, cpylen);
+        d += cpylen;
+        len -= cpylen;
+        off = 0;
+    }
+}
+
+static int iov_slice(struct iovec *dst, int dstcnt, const struct iovec *iov, int iovcnt, size_t off){
+    int cnt = 0;
+    for (int i=0; i<iovcnt; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        retassure(cnt < dstcnt, "Too many payload fragments");
+        dst[cnt].iov_base = (uint8_t*)iov[i].iov_base + off;
+        dst[cnt].iov_len = iov[i].iov_len - off;
+        cnt++;
+        off = 0;
+    }
+    return cnt;
+}
+
 #pragma mark libusb_callback implementations
 void tx_callback(struct libusb_transfer *xfer) noexcept{
     std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+    dev->_shard->_txCompletions++;
 
     if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
         switch(xfer->status) {
@@ -56,6 +101,12 @@ void tx_callback(struct libusb_transfer *xfer) noexcept{
         dev->_tx_xfers.erase(xfer);
     }
 
+    if (xfer->length) {
+        dev->_txInflight--;
+        //a transfer slot freed up, send whatever piled up in the meantime
+        if (xfer->status == LIBUSB_TRANSFER_COMPLETED) dev->tx_flush();
+    }
+
     safeFree(xfer->buffer);
     {
         std::shared_ptr<USBDevice> *userarg = (std::shared_ptr<USBDevice> *)xfer->user_data;xfer->user_data = NULL;
@@ -66,7 +117,7 @@ void tx_callback(struct libusb_transfer *xfer) noexcept{
 
 #pragma mark USBDevice
 USBDevice::USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid)
-: Device(mux, MUXCONN_USB), _selfref{}, _parent(parent)
+: Device(mux, MUXCONN_USB), _selfref{}, _parent(parent), _shard(NULL)
 , _pid(pid)
 , _bus(0), _address(0)
 , _interface(0), _ep_in(0), _ep_out(0)
@@ -74,36 +125,38 @@ USBDevice::USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid)
 , _wMaxPacketSize(0), _speed(0)
 , _state{}, _usbdev(NULL), _nextPort(0)
 , _muxdev{}, _usbLck{}
+, _txControl{}, _txFlows{}, _txActiveFlows{}, _txBulkBytes(0), _txMaxInflight(0), _txClosed(false), _txInflight(0)
+, _rxScheduled(false), _rxChainLen(0)
 , _rx_xfers{}, _tx_xfers{}
 {
     retassure(_muxdev.pktbuf = (uint8_t*)malloc(DEV_MRU), "Failed to alloc pktbuf");
-    _conReaperThread = std::thread([this]{
-        reaper_runloop();
-    });
-
+    _reapQueue = std::make_shared<SerialQueue>(_parent->_workers);
 }
 
 USBDevice::~USBDevice(){
-    _arrived_xfer.kill();
-    while (_receivers.size()) {
-        auto r = *_receivers.begin();
-        _receivers.erase(r);
-        delete r;
-    }
     debug("deleting device %s",_serial);
+    if (_shard) {
+        _shard->_devices--;
+        _shard = NULL;
+    }
     {
         std::unique_lock<std::mutex> ul(_parent->_childrenLck);
         _parent->_children.erase(this);
         _parent->_childrenEvent.notifyAll();
         _parent = NULL;
     }
-    
-    assert(_receivers.size() == 0);
-    
-    _reapConnections.kill();
-    _conReaperThread.join();
-    
+
     safeFree(_muxdev.pktbuf);
+    for (auto &pkt : _txControl) {
+        safeFree(pkt.buf);
+    }
+    _txControl.clear();
+    for (auto &f : _txFlows) {
+        for (auto &pkt : f.second.pkts) {
+            safeFree(pkt.buf);
+        }
+    }
+    _txFlows.clear();
     //free resources
     if (_usbdev){
         libusb_release_interface(_usbdev, _interface);
@@ -117,28 +170,109 @@ bool USBDevice::isDeviceReadyForDestruction(){
     return _rx_xfers.size() == 0 && _tx_xfers.size() == 0;
 }
 
-void USBDevice::addReceiver(){
-    _receivers.insert(new USBDevice_receiver(this));
+void USBDevice::reap_connection(uint16_t sport) noexcept{
+    tx_unregister_flow(sport);
+    guardWrite(_conns_Guard);
+    auto cp = _conns.find(sport);
+    if (cp != _conns.end()){
+        cp->second->deconstruct();
+    }
+    _conns.erase(sport);
+    _conns_close_event.notifyAll();
 }
 
-void USBDevice::reaper_runloop(){
-    while (true) {
-        uint16_t conport = 0;
-        try {
-            conport = _reapConnections.wait();
-        } catch (...) {
-            break;
+void USBDevice::rx_drain() noexcept{
+    struct libusb_transfer *xfer = NULL;
+    /*
+        Only one rx_drain per device is ever scheduled (guarded by _rxScheduled),
+        which keeps transfers in completion order without holding a worker while idle
+     */
+    for (int i=0; i<USB_RX_DRAIN_BATCH; i++) {
+        if (!_rxRing.try_pop_spin(xfer)) {
+            _rxScheduled.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            //a transfer may have arrived after the last pop, but before the flag was cleared
+            if (_rxRing.empty() || _rxScheduled.exchange(true)) return;
+            continue;
         }
-        {
-            guardWrite(_conns_Guard);
-            auto cp = _conns.find(conport);
-            if (cp != _conns.end()){
-                cp->second->deconstruct();
-            }
-            _conns.erase(conport);
-            _conns_close_event.notifyAll();
+        device_xfer_input(xfer);
+    }
+    //more work left, get back in line behind the other devices
+    {
+        std::shared_ptr<USBDevice> selfref = _selfref.lock();
+        if (!selfref) {
+            _rxScheduled = false;
+            return;
         }
+        _parent->_workers->post([selfref]{
+            selfref->rx_drain();
+        });
+    }
+}
+
+uint32_t USBDevice::rx_chain_pktlen(const unsigned char *buffer, uint32_t length){
+    mux_header_v1 hdr = {};
+    uint32_t pktlen = 0;
+    uint32_t have = MIN(_rxChainLen, (uint32_t)sizeof(hdr));
+    std::vector<struct iovec> iov;
+
+    if (_rxChainLen + length < sizeof(hdr)) return 0; //not known yet
+    for (auto &f : _rxChain) {
+        iov.push_back({.iov_base = f.data, .iov_len = f.len});
     }
+    iov_gather(&hdr, iov.data(), (int)iov.size(), 0, have);
+    memcpy((uint8_t*)&hdr + have, buffer, sizeof(hdr) - have);
+    pktlen = ntohl(hdr.length);
+    retassure(pktlen >= sizeof(hdr) && pktlen <= DEV_MRU && pktlen >= _rxChainLen, "Incoming split packet has bad size (dev %s, size %u)", _serial, pktlen);
+    return pktlen;
+}
+
+size_t USBDevice::rx_chain_held(){
+    size_t ret = 0;
+    for (auto &f : _rxChain) {
+        if (f.xfer) ret++;
+    }
+    return ret;
+}
+
+void USBDevice::rx_chain_dispatch(uint32_t pktlen, struct libusb_transfer *cur){
+    std::vector<struct iovec> iov;
+    cleanup([&]{
+        rx_chain_release(cur);
+    });
+    for (auto &f : _rxChain) {
+        iov.push_back({.iov_base = f.data, .iov_len = f.len});
+    }
+    device_packet_input(iov.data(), (int)iov.size(), pktlen);
+}
+
+void USBDevice::rx_chain_flatten(struct libusb_transfer *cur){
+    std::vector<struct iovec> iov;
+    uint32_t len = _rxChainLen;
+    for (auto &f : _rxChain) {
+        iov.push_back({.iov_base = f.data, .iov_len = f.len});
+    }
+    iov_gather(_muxdev.pktbuf, iov.data(), (int)iov.size(), 0, len);
+    rx_chain_release(cur);
+    _rxChain.push_back({
+        .xfer = NULL,
+        .data = _muxdev.pktbuf,
+        .len = len
+    });
+    _rxChainLen = len;
+}
+
+void USBDevice::rx_chain_release(struct libusb_transfer *keep) noexcept{
+    for (auto &f : _rxChain) {
+        if (!f.xfer || f.xfer == keep) continue;
+        if (_state == MUXDEV_DEAD) {
+            usb_rx_free(f.xfer);
+        } else {
+            usb_rx_resubmit(f.xfer);
+        }
+    }
+    _rxChain.clear();
+    _rxChainLen = 0;
 }
 
 #pragma mark inheritence provider
@@ -151,15 +285,32 @@ void USBDevice::kill() noexcept{
 void USBDevice::deconstruct() noexcept{
     debug("[Deconstructing] USBDevice %s",_serial);
     std::shared_ptr<USBDevice> selfref = _selfref.lock();
-    _mux->delete_device(selfref);
-    //cancel all rx transfers
     {
-        guardRead(_rx_xfers_Guard);
-        for (auto xfer : _rx_xfers) {
-            debug("cancelling _rx_xfers(%p)",xfer);
-            libusb_cancel_transfer(xfer);
-        }
+        std::unique_lock<std::mutex> ul(_usbLck);
+        _txClosed = true;
     }
+    _txSpaceCond.notify_all();
+    _mux->delete_device(selfref);
+    /*
+        RX transfers held back for split packets are only released on the RX path,
+        so don't block here on a potentially busy receiver.
+        Once the state is dead (under _rxChainLck, like every reader) no transfer gets resubmitted,
+        so cancelling afterwards catches all of them.
+     */
+    _parent->_workers->post([selfref]{
+        std::unique_lock<std::mutex> ul(selfref->_rxChainLck);
+        selfref->_state = MUXDEV_DEAD;
+        selfref->rx_chain_release(NULL);
+        ul.unlock();
+        //cancel all rx transfers
+        {
+            guardRead(selfref->_rx_xfers_Guard);
+            for (auto xfer : selfref->_rx_xfers) {
+                debug("cancelling _rx_xfers(%p)",xfer);
+                libusb_cancel_transfer(xfer);
+            }
+        }
+    });
 
     //cancel all tx transfers
     {
@@ -175,7 +326,7 @@ void USBDevice::deconstruct() noexcept{
         {
             guardRead(_conns_Guard);
             for (auto c : _conns) {
-                _reapConnections.post(c.first);
+                closeConnection(c.first);
             }
         }
         while (true) {
@@ -190,8 +341,9 @@ void USBDevice::deconstruct() noexcept{
     }
 }
 
-void USBDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
+std::shared_ptr<TCP> USBDevice::open_connection(uint16_t dport, std::shared_ptr<Client> cli){
     std::shared_ptr<TCP> conn;
+    uint16_t sport = 0;
     assure(_conns.size() < 0xfff0); //we can't handle more connections than we have ports!
 
     {
@@ -210,7 +362,19 @@ void USBDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
             throw;
         }
         _conns[_nextPort] = conn;
+        sport = _nextPort;
+    }
+
+    {
+        uint32_t weight = cli->getConnectWeight();
+        if (!weight) weight = (dport == 62078) ? USB_TX_WEIGHT_LOCKDOWN : USB_TX_WEIGHT_DEFAULT;
+        tx_register_flow(sport, dport, weight);
     }
+    return conn;
+}
+
+void USBDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
+    std::shared_ptr<TCP> conn = open_connection(dport, cli);
 
     try {
         conn->connect();
@@ -221,7 +385,11 @@ void USBDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
 }
 
 void USBDevice::closeConnection(uint16_t sport){
-    _reapConnections.post(sport);
+    std::shared_ptr<USBDevice> selfref = _selfref.lock();
+    if (!selfref) return; //device is already going away, connections die with it
+    _reapQueue->post([selfref, sport]{
+        selfref->reap_connection(sport);
+    });
 }
 
 
@@ -234,6 +402,41 @@ uint64_t USBDevice::getSpeed(){
     return _speed;
 }
 
+plist_t USBDevice::getStatisticsPlist(){
+    plist_t p_ret = NULL;
+    plist_t p_conns = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_conns, plist_free);
+        safeFreeCustom(p_ret, plist_free);
+    });
+    assure(p_ret = plist_new_dict());
+    assure(p_conns = plist_new_array());
+    plist_dict_set_item(p_ret, "SerialNumber", plist_new_string(_serial));
+    {
+        std::unique_lock<std::mutex> ul(_usbLck);
+        plist_dict_set_item(p_ret, "BulkBytesSent", plist_new_uint(_txBulkBytes));
+        plist_dict_set_item(p_ret, "TXInflight", plist_new_uint(_txInflight));
+        plist_dict_set_item(p_ret, "TXMaxInflight", plist_new_uint(tx_max_inflight()));
+        for (auto &f : _txFlows) {
+            plist_t p_conn = NULL;
+            assure(p_conn = plist_new_dict());
+            plist_dict_set_item(p_conn, "SourcePort", plist_new_uint(f.first));
+            plist_dict_set_item(p_conn, "DestinationPort", plist_new_uint(f.second.dport));
+            plist_dict_set_item(p_conn, "Weight", plist_new_uint(f.second.weight));
+            plist_dict_set_item(p_conn, "BytesSent", plist_new_uint(f.second.bytesSent));
+            plist_dict_set_item(p_conn, "QueuedPackets", plist_new_uint(f.second.pkts.size()));
+            plist_dict_set_item(p_conn, "QueuedBytes", plist_new_uint(f.second.queuedBytes));
+            plist_dict_set_item(p_conn, "Share", plist_new_real(_txBulkBytes ? (double)f.second.bytesSent / _txBulkBytes : 0));
+            plist_array_append_item(p_conns, p_conn);
+        }
+    }
+    plist_dict_set_item(p_ret, "Connections", p_conns); p_conns = NULL; //transfer ownership
+    {
+        plist_t ret = p_ret; p_ret = NULL;
+        return ret;
+    }
+}
+
 uint16_t USBDevice::getPid(){
     return _pid;
 }
@@ -250,7 +453,7 @@ void USBDevice::mux_init(){
 
 void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header){
     /*
-     buf allocated and guaranteed transfered to usb_send without failing in between.
+     buf allocated and guaranteed transfered to usb_send (or the TX queue) without failing in between.
      usb_send will always make sure buf is freed, even in case of failure.
      Don't free buf in this function in any case!
      */
@@ -275,29 +478,40 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
     mhdr->protocol = htonl(proto);
     mhdr->length = htonl(buflen);
 
+    if (header) {
+        memcpy(buf + mux_header_size, header, sizeof(tcphdr));
+        memcpy(buf + mux_header_size + sizeof(tcphdr), data, length);
+    }else{
+        memcpy(buf + mux_header_size, data, length);
+    }
+
     {
         std::unique_lock<std::mutex> ul(_usbLck);
-        if (_muxdev.version >= 2) {
-            mhdr->v2.magic = htonl(0xfeedface);
-            if (proto == MUX_PROTO_SETUP) {
-                _muxdev.tx_seq = 0;
-                _muxdev.rx_seq = 0xffff;
-            }
-            mhdr->v2.tx_seq = htons(_muxdev.tx_seq);
-            mhdr->v2.rx_seq = htons(_muxdev.rx_seq);
-//            debug("----- MUX UPDATE SEND _muxdev.tx_seq=%d _muxdev.rx_seq=%d",_muxdev.tx_seq,_muxdev.rx_seq);
-            _muxdev.tx_seq++;
-        }
-        if (header) {
-            memcpy(buf + mux_header_size, header, sizeof(tcphdr));
-            memcpy(buf + mux_header_size + sizeof(tcphdr), data, length);
-        }else{
-            memcpy(buf + mux_header_size, data, length);
-        }
-
         try {
-            unsigned char *sendbuf = buf; buf = NULL; //freed by usb_send in any case
-            usb_send(sendbuf, buflen);
+            if (_muxdev.version >= 2) {
+                uint16_t sport = header ? ntohs(header->th_sport) : 0;
+                tx_packet pkt = {
+                    .buf = buf,
+                    .len = buflen,
+                    .proto = proto,
+                    .sport = sport
+                };
+                if (tx_lane_for_packet_nolock(proto, length, sport) == TX_LANE_BULK) {
+                    tx_flow &flow = _txFlows.at(sport); //bulk lane is only picked for registered flows
+                    if (!flow.pkts.size()) _txActiveFlows.push_back(sport);
+                    flow.pkts.push_back(pkt);
+                    flow.queuedBytes += pkt.len;
+                } else {
+                    if (_txActiveFlows.size()) _shard->_txPrioritized++;
+                    _txControl.push_back(pkt);
+                }
+                buf = NULL; //owned by the TX queue now
+                if (_txInflight < tx_max_inflight()) tx_flush_nolock();
+            } else {
+                tx_stamp_nolock(buf, proto);
+                unsigned char *sendbuf = buf; buf = NULL; //freed by usb_send in any case
+                usb_send(sendbuf, buflen);
+            }
         } catch (tihmstar::exception &e) {
             debug("failed to send packet to usbdevice(%p) error=%s code=%d",this,e.what(),e.code());
             kill();
@@ -306,6 +520,187 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
     }
 }
 
+void USBDevice::tx_stamp_nolock(unsigned char *buf, enum mux_protocol proto){
+    mux_header *mhdr = (mux_header *)buf;
+    if (_muxdev.version >= 2) {
+        mhdr->v2.magic = htonl(0xfeedface);
+        if (proto == MUX_PROTO_SETUP) {
+            _muxdev.tx_seq = 0;
+            _muxdev.rx_seq = 0xffff;
+        }
+        mhdr->v2.tx_seq = htons(_muxdev.tx_seq);
+        mhdr->v2.rx_seq = htons(_muxdev.rx_seq);
+//            debug("----- MUX UPDATE SEND _muxdev.tx_seq=%d _muxdev.rx_seq=%d",_muxdev.tx_seq,_muxdev.rx_seq);
+        _muxdev.tx_seq++;
+    }
+}
+
+enum USBDevice::tx_lane USBDevice::tx_lane_for_packet_nolock(enum mux_protocol proto, size_t length, uint16_t sport){
+    std::map<uint16_t,tx_flow>::iterator it;
+    if (proto != MUX_PROTO_TCP) return TX_LANE_CONTROL;
+    /*
+        Late packets of a flow that was already unregistered have no queued data to respect,
+        and must not bring the flow entry back
+     */
+    if ((it = _txFlows.find(sport)) == _txFlows.end()) return TX_LANE_CONTROL;
+    /*
+        Small and zero-length segments (ACK, RST, window updates) may only skip ahead
+        if their own connection has no bulk data waiting, otherwise the device would see
+        that connection's payload out of order, or a RST before the end of an upload.
+     */
+    if (length <= USB_TX_SMALL_PAYLOAD && !it->second.pkts.size()) return TX_LANE_CONTROL;
+    return TX_LANE_BULK;
+}
+
+void USBDevice::tx_register_flow(uint16_t sport, uint16_t dport, uint32_t weight){
+    std::unique_lock<std::mutex> ul(_usbLck);
+    tx_flow &flow = _txFlows[sport];
+    if (weight > USB_TX_WEIGHT_MAX) weight = USB_TX_WEIGHT_MAX;
+    flow.dport = dport;
+    flow.weight = weight ? weight : USB_TX_WEIGHT_DEFAULT;
+    flow.isClosed = false;
+}
+
+void USBDevice::tx_unregister_flow(uint16_t sport){
+    std::unique_lock<std::mutex> ul(_usbLck);
+    auto it = _txFlows.find(sport);
+    if (it == _txFlows.end()) return;
+    if (it->second.pkts.size()) {
+        //let queued data go out first
+        it->second.isClosed = true;
+    } else {
+        _txFlows.erase(it);
+    }
+    _txSpaceCond.notify_all();
+}
+
+USBDevice::tx_packet *USBDevice::tx_next_nolock(){
+    if (_txControl.size()) return &_txControl.front();
+    /*
+        Deficit round robin over the bulk flows:
+        each time a flow comes around it earns weight * USB_TX_DRR_QUANTUM bytes of credit,
+        and may send as long as its head packet fits into that credit.
+     */
+    while (_txActiveFlows.size()) {
+        tx_flow &flow = _txFlows[_txActiveFlows.front()];
+        tx_packet &pkt = flow.pkts.front();
+        if (flow.deficit >= (int64_t)pkt.len) return &pkt;
+        flow.deficit += (int64_t)flow.weight * USB_TX_DRR_QUANTUM;
+        _txActiveFlows.push_back(_txActiveFlows.front());
+        _txActiveFlows.pop_front();
+    }
+    return NULL;
+}
+
+void USBDevice::tx_pop_nolock(){
+    uint16_t sport = 0;
+    if (_txControl.size()) {
+        _txControl.pop_front();
+        return;
+    }
+    sport = _txActiveFlows.front();
+    {
+        auto it = _txFlows.find(sport);
+        tx_flow &flow = it->second;
+        size_t len = flow.pkts.front().len;
+        flow.pkts.pop_front();
+        flow.queuedBytes -= len;
+        flow.deficit -= len;
+        flow.bytesSent += len;
+        _txBulkBytes += len;
+        if (!flow.pkts.size()) {
+            //idle flows don't get to hoard credit
+            flow.deficit = 0;
+            _txActiveFlows.pop_front();
+            if (flow.isClosed) _txFlows.erase(it);
+        }
+    }
+    _txSpaceCond.notify_all();
+}
+
+void USBDevice::tx_flush_nolock(){
+    /*
+        Sequence numbers are assigned here, in the order packets leave the queue,
+        so packing and scheduling never reorder what the device sees.
+        The control lane is always served first.
+     */
+    while (_txInflight < tx_max_inflight()) {
+        std::vector<tx_packet> batch;
+        unsigned char *sendbuf = NULL;
+        size_t sendlen = 0;
+        tx_packet *pkt = NULL;
+
+        while ((pkt = tx_next_nolock())) {
+            if (batch.size() && (!gUSBTxPolicy.aggregate || sendlen + pkt->len > USB_MTU)) break;
+            batch.push_back(*pkt);
+            sendlen += pkt->len;
+            tx_pop_nolock();
+        }
+        if (!batch.size()) break;
+
+        if (batch.size() == 1) {
+            tx_stamp_nolock(batch.front().buf, batch.front().proto);
+            sendbuf = batch.front().buf;
+        } else {
+            size_t off = 0;
+            sendbuf = (unsigned char *)malloc(sendlen);
+            if (!sendbuf) {
+                for (auto &p : batch) safeFree(p.buf);
+                reterror("Failed to alloc TX aggregation buffer");
+            }
+            for (auto &p : batch) {
+                memcpy(sendbuf + off, p.buf, p.len);
+                tx_stamp_nolock(sendbuf + off, p.proto);
+                off += p.len;
+                safeFree(p.buf);
+            }
+            _shard->_txAggregated += batch.size();
+        }
+        usb_send(sendbuf, sendlen); //frees sendbuf in any case
+    }
+}
+
+uint32_t USBDevice::tx_max_inflight(){
+    if (!_txMaxInflight) {
+        if (gUSBTxPolicy.maxInflight) {
+            _txMaxInflight = gUSBTxPolicy.maxInflight;
+        } else if (_speed > 480000000) {
+            _txMaxInflight = USB_TX_MAX_INFLIGHT_SS;
+        } else if (_speed == 480000000) {
+            _txMaxInflight = USB_TX_MAX_INFLIGHT_HS;
+        } else {
+            _txMaxInflight = USB_TX_MAX_INFLIGHT_FS;
+        }
+    }
+    return _txMaxInflight;
+}
+
+void USBDevice::tx_wait_for_space(uint16_t sport){
+    /*
+        Backpressure for bulk senders, called before they lock their own TCP state,
+        so a slow device never stalls input processing for that connection.
+        Control packets are never held here.
+     */
+    size_t maxQueued = gUSBTxPolicy.maxQueuedPerFlow ? gUSBTxPolicy.maxQueuedPerFlow : USB_TX_FLOW_MAX_QUEUED;
+    std::unique_lock<std::mutex> ul(_usbLck);
+    while (!_txClosed) {
+        auto it = _txFlows.find(sport);
+        if (it == _txFlows.end() || it->second.isClosed || it->second.queuedBytes < maxQueued) return;
+        _shard->_txBackpressure++;
+        _txSpaceCond.wait_for(ul, std::chrono::seconds(1));
+    }
+}
+
+void USBDevice::tx_flush() noexcept{
+    std::unique_lock<std::mutex> ul(_usbLck);
+    try {
+        tx_flush_nolock();
+    } catch (tihmstar::exception &e) {
+        error("failed to flush TX queue of usbdevice(%p) error=%s code=%d",this,e.what(),e.code());
+        kill();
+    }
+}
+
 /*
  always frees buf
  */
@@ -343,7 +738,9 @@ void USBDevice::usb_send(void *buf, size_t length){
         guardWrite(_tx_xfers_Guard);
         _tx_xfers.insert(xfer);
     }
-    retassure((ret = libusb_submit_transfer(xfer)) >=0, "Failed to submit TX transfer %p len %zu to device %d-%d: %d", buf, length, _bus, _address, ret);
+    _txInflight++;
+    if ((ret = libusb_submit_transfer(xfer)) < 0) _txInflight--;
+    retassure(ret >=0, "Failed to submit TX transfer %p len %zu to device %d-%d: %d", buf, length, _bus, _address, ret);
     xfer = NULL;
     if (length % _wMaxPacketSize == 0 && length >= _wMaxPacketSize) {
         debug("Send ZLP");
@@ -366,79 +763,134 @@ void USBDevice::usb_send(void *buf, size_t length){
     }
 }
 
-void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
+void USBDevice::device_xfer_input(struct libusb_transfer *xfer) noexcept{
+    bool didRetain = false;
+    std::unique_lock<std::mutex> ul(_rxChainLck);
+    if (_state == MUXDEV_DEAD) {
+        usb_rx_free(xfer);
+        return;
+    }
+    try {
+        didRetain = device_data_input(xfer);
+    } catch (tihmstar::exception &e) {
+        error("failed to device_data_input usbdev=%s error=%d (%s)",_serial,e.code(),e.what());
+        rx_chain_release(xfer);
+        didRetain = false;
+        kill();
+    }
+    /*
+        Re-submit transfer unless it is part of a split packet,
+        let USBDeviceManager properly delete it in case something went wrong
+     */
+    if (!didRetain) usb_rx_resubmit(xfer);
+}
+
+bool USBDevice::device_data_input(struct libusb_transfer *xfer){
+    unsigned char *buffer = xfer->buffer;
+    uint32_t length = (uint32_t)xfer->actual_length;
+
+    /*
+        A transfer may carry any number of complete mux packets, possibly followed by the beginning of the next one.
+        Packets spanning multiple transfers are kept as a chain of fragments pointing into the transfer buffers,
+        which are held back until the packet was handled. Returns true if xfer was retained this way.
+     */
+//    debug("Mux data input for device %s: len %u", _serial, length);
+    retassure(length <= USB_RX_XFER_SIZE, "Too much data received from USB (%u), file a bug", length);
+
+    while (length) {
+        uint32_t pktlen = 0;
+        uint32_t fraglen = length;
+
+        if (_rxChainLen) {
+            //continuation of a split packet
+            if ((pktlen = rx_chain_pktlen(buffer, length)) && pktlen - _rxChainLen < fraglen) {
+                fraglen = pktlen - _rxChainLen;
+            }
+        } else if (length >= sizeof(struct mux_header_v1)) {
+            pktlen = ntohl(((mux_header *)buffer)->length);
+            retassure(pktlen >= sizeof(struct mux_header_v1) && pktlen <= DEV_MRU, "Incoming packet has bad size (dev %s, size %u)", _serial, pktlen);
+            if (pktlen <= length) {
+                struct iovec iov = {
+                    .iov_base = buffer,
+                    .iov_len = pktlen
+                };
+                device_packet_input(&iov, 1, pktlen);
+                buffer += pktlen;
+                length -= pktlen;
+                continue;
+            }
+        }
+
+        retassure(_muxdev.version >= 2, "Mux v1 doesn't support broken up transfers!");
+        _rxChain.push_back({
+            .xfer = xfer,
+            .data = buffer,
+            .len = fraglen
+        });
+        _rxChainLen += fraglen;
+        buffer += fraglen;
+        length -= fraglen;
+
+        if (pktlen && _rxChainLen == pktlen) {
+            debug("Gathered mux packet from %zu fragments (total size: %u)", _rxChain.size(), pktlen);
+            rx_chain_dispatch(pktlen, xfer);
+            continue;
+        }
+
+        //packet continues in the next transfer
+        if (rx_chain_held() >= NUM_RX_LOOPS) {
+            //holding back all RX transfers would stall RX, fall back to copying
+            rx_chain_flatten(xfer);
+            debug("Copied mux data to buffer (size: %u)", _rxChainLen);
+            return false;
+        }
+        debug("Holding mux data in chain (%zu fragments, total size: %u)", _rxChain.size(), _rxChainLen);
+        return true;
+    }
+    return false;
+}
+
+void USBDevice::device_packet_input(const struct iovec *iov, int iovcnt, uint32_t length){
+    uint8_t hdrbuf[sizeof(struct mux_header_v2) + sizeof(struct tcphdr)] = {};
     mux_header *mhdr = NULL;
     unsigned char *payload = NULL;
     uint32_t payload_length = 0;
     int mux_header_size = 0;
 
-    if(!length)
-        return;
-
-    // sanity check (should never happen with current USB implementation)
-    retassure((length <= USB_MRU) && (length <= DEV_MRU),"Too much data received from USB (%u), file a bug", length);
-
-//    debug("Mux data input for device %s: len %u", _serial, length);
-    mhdr = (mux_header *)buffer;
+    //make sure the headers are contiguous, the payload may stay fragmented
+    if (iov[0].iov_len >= sizeof(hdrbuf) || iov[0].iov_len == length) {
+        mhdr = (mux_header *)iov[0].iov_base;
+    } else {
+        iov_gather(hdrbuf, iov, iovcnt, 0, MIN(sizeof(hdrbuf), length));
+        mhdr = (mux_header *)hdrbuf;
+    }
 
     {
         std::unique_lock<std::mutex> ul(_usbLck);
         mux_header_size = ((_muxdev.version < 2) ? sizeof(struct mux_header_v1) : sizeof(struct mux_header_v2));
-#ifdef XCODE
-        assert(ntohl(mhdr->length) <= USB_MRU);
-#endif
-        retassure(ntohl(mhdr->length) == length, "Incoming packet size mismatch (dev %s, expected %d, got %u)", _serial, ntohl(mhdr->length), length);
+        retassure(length >= mux_header_size, "Incoming packet is too small (dev %s, size %u)", _serial, length);
         if (_muxdev.version >= 2) {
-            cleanup([&]{
-                _data_in_event.notifyAll();
-            });
+            /*
+                Transfers are processed strictly in completion order on the device's serial queue,
+                so anything that isn't the next seq is either a duplicate or we lost packets
+             */
             uint16_t txseq = ntohs(mhdr->v2.tx_seq);
 //            debug("----- MUX txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
             if ((uint16_t)(_muxdev.rx_seq+1) != txseq) {
-                while ((uint16_t)(_muxdev.rx_seq+1) < txseq || (uint16_t)(_muxdev.rx_seq+1+_rx_xfers.size()) < txseq + _rx_xfers.size()) {
-                    uint64_t wevent = _data_in_event.getNextEvent();
-                    ul.unlock();
-                    _data_in_event.waitForEvent(wevent);
-                    ul.lock();
+                if ((int16_t)(txseq - _muxdev.rx_seq) <= 0){
+                    debug("Discarding duplicated MUX packet txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
+                    return;
                 }
-            }
-            if ((uint16_t)(_muxdev.rx_seq+1) != txseq){
-                debug("Discarding duplicated MUX packet txseq=%d -- _muxdev.tx_seq=%d _muxdev.rx_seq=%d",txseq,_muxdev.tx_seq,_muxdev.rx_seq);
-                return;
+                warning("Lost %d MUX packet(s) from device %s (txseq=%d rx_seq=%d)", (uint16_t)(txseq - _muxdev.rx_seq - 1), _serial, txseq, _muxdev.rx_seq);
             }
             _muxdev.rx_seq = txseq;
         }
-        
-        // handle broken up transfers
-        if(_muxdev.pktlen) {
-            if (_muxdev.version < 2){
-                error("Mux v1 doesn't support broken up transfers!");
-                reterror("Mux v1 doesn't support broken up transfers!");
-            }
-
-            //check rx/tx
-            retassure((length + _muxdev.pktlen) <= DEV_MRU, "Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
-
-            memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
+    }
 
-            if((length < USB_MRU) || (ntohl(mhdr->length) == (length + _muxdev.pktlen))) {
-                buffer = _muxdev.pktbuf;
-                length += _muxdev.pktlen;
-                _muxdev.pktlen = 0;
-                debug("Gathered mux data from buffer (total size: %u)", length);
-            } else {
-                _muxdev.pktlen += (uint32_t)length;
-                debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
-                return;
-            }
-        }else{
-            if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-                memcpy(_muxdev.pktbuf, buffer, length);
-                _muxdev.pktlen = (uint32_t)length;
-                debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
-                return;
-            }
-        }
+    if (iovcnt > 1 && ntohl(mhdr->protocol) != MUX_PROTO_TCP) {
+        //only TCP payload is handled fragmented, everything else is rare enough to be gathered
+        iov_gather(_muxdev.pktbuf, iov, iovcnt, 0, length);
+        mhdr = (mux_header *)_muxdev.pktbuf;
     }
 
     switch(ntohl(mhdr->protocol)) {
@@ -460,8 +912,10 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
             retassure(length >= (mux_header_size + sizeof(struct tcphdr)), "Incoming TCP packet is too small (%u)", length);
         {
             tcphdr *tcp_header = reinterpret_cast<tcphdr*>((uint8_t*)mhdr+mux_header_size);
-            payload = reinterpret_cast<std::uint8_t*>(tcp_header+1);
+            struct iovec payload_iov[NUM_RX_LOOPS+1] = {};
+            int payload_iovcnt = 0;
             payload_length = length - sizeof(tcphdr) - mux_header_size;
+            payload_iovcnt = iov_slice(payload_iov, sizeof(payload_iov)/sizeof(*payload_iov), iov, iovcnt, mux_header_size + sizeof(tcphdr));
             uint16_t dport = htons(tcp_header->th_dport);
             std::shared_ptr<TCP> connect = nullptr;
             {
@@ -480,7 +934,7 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
                 error("no connection found with snum=%d",dport);
             }else{
                try {
-                   connect->handle_input(tcp_header, payload, payload_length);
+                   connect->handle_input(tcp_header, payload_iov, payload_iovcnt, payload_length);
                } catch (tihmstar::exception &e) {
                    error("failed to handle input on snum=%d device(%d)=%s with error=%d (%s)",dport,_id,_serial,e.code(),e.what());
                    throw;
@@ -548,3 +1002,8 @@ void USBDevice::device_control_input(unsigned char *payload, uint32_t payload_le
         }
     }
 }
+
+#pragma mark static
+void USBDevice::setTxPolicy(TxPolicy policy){
+    gUSBTxPolicy = policy;
+}
@@ -9,21 +9,41 @@
 #define USBDevice_hpp
 
 #include "Device.hpp"
-#include "USBDevice_receiver.hpp"
+#include "../WorkerPool.hpp"
+#include "../MPSCRing.hpp"
 #include <libusb.h>
+#include <plist/plist.h>
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/GuardAccess.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
 #include <set>
 #include <map>
+#include <vector>
+#include <deque>
+#include <condition_variable>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 #define DEV_MRU 65535
 
+#define USB_RX_RING_SIZE 16     //needs to hold all RX transfers of a device at once
+#define USB_RX_DRAIN_BATCH 32   //yield the worker after this many transfers
+#define USB_TX_MAX_INFLIGHT_FS 2    //pending TX transfers before further packets get queued, by link speed (0 in config = pick by speed)
+#define USB_TX_MAX_INFLIGHT_HS 4
+#define USB_TX_MAX_INFLIGHT_SS 8
+#define USB_TX_FLOW_MAX_QUEUED (4 * USB_MTU) //bulk senders block once their connection has this much queued
+#define USB_TX_SMALL_PAYLOAD 1024 //TCP segments up to this size count as interactive
+#define USB_TX_DRR_QUANTUM 16384  //bytes a bulk flow of weight 1 may send per round
+#define USB_TX_WEIGHT_DEFAULT 1
+#define USB_TX_WEIGHT_LOCKDOWN 4
+#define USB_TX_WEIGHT_MAX 16
+
 class TCP;
 class USBDeviceManager;
-class USBDevice_receiver;
+void usb_rx_resubmit(struct libusb_transfer *xfer) noexcept;
+void usb_rx_free(struct libusb_transfer *xfer) noexcept;
+class USBEventShard;
 class USBDevice : public Device{
 public:
     enum mux_dev_state {
@@ -60,19 +80,48 @@ public:
     struct mux_device{
         int version;
         uint8_t *pktbuf;
-        uint32_t pktlen;
         uint16_t tx_seq;
         uint16_t rx_seq;
     };
+    struct TxPolicy{
+        bool aggregate;             //pack queued mux packets into shared USB transfers
+        uint32_t maxInflight;       //0 = pick by link speed
+        uint32_t maxQueuedPerFlow;  //0 = USB_TX_FLOW_MAX_QUEUED
+    };
+    struct rx_fragment{
+        struct libusb_transfer *xfer; //NULL if data lives in pktbuf
+        unsigned char *data;
+        uint32_t len;
+    };
     enum mux_protocol {
         MUX_PROTO_VERSION = 0,
         MUX_PROTO_CONTROL = 1,
         MUX_PROTO_SETUP = 2,
         MUX_PROTO_TCP = IPPROTO_TCP,
     };
+    enum tx_lane {
+        TX_LANE_CONTROL = 0,    // handshake, ACK, RST, window updates and small interactive segments
+        TX_LANE_BULK            // scheduled per connection by deficit round robin
+    };
+    struct tx_packet{
+        unsigned char *buf; //complete mux packet, sequence numbers are filled in when it leaves the queue
+        size_t len;
+        enum mux_protocol proto;
+        uint16_t sport;
+    };
+    struct tx_flow{
+        std::deque<tx_packet> pkts;
+        uint16_t dport;
+        uint32_t weight;
+        int64_t deficit;
+        uint64_t bytesSent;
+        size_t queuedBytes;
+        bool isClosed; //connection is gone, drop the flow once it ran empty
+    };
 private:
     std::weak_ptr<USBDevice> _selfref;
     USBDeviceManager *_parent; //not owned
+    USBEventShard *_shard; //not owned
     uint16_t _pid;
     uint8_t _bus, _address;
     uint8_t _interface, _ep_in, _ep_out;
@@ -84,13 +133,25 @@ private:
     libusb_device_handle *_usbdev;
     uint16_t _nextPort;
     
-    mux_dev_state _state;
+    mux_dev_state _state; //guarded by _rxChainLck
     mux_device _muxdev;
     std::mutex _usbLck;
-    tihmstar::Event _data_in_event;
+    std::deque<tx_packet> _txControl; //guarded by _usbLck
+    std::map<uint16_t,tx_flow> _txFlows; //per sport, guarded by _usbLck
+    std::deque<uint16_t> _txActiveFlows; //flows with queued packets in round robin order, guarded by _usbLck
+    uint64_t _txBulkBytes;
+    uint32_t _txMaxInflight;
+    bool _txClosed;
+    std::condition_variable _txSpaceCond;
+    std::atomic<uint32_t> _txInflight;
+
+    MPSCRing<struct libusb_transfer *, USB_RX_RING_SIZE> _rxRing;
+    std::atomic<bool> _rxScheduled;
+    std::vector<rx_fragment> _rxChain;
+    uint32_t _rxChainLen;
+    std::mutex _rxChainLck;
+    std::shared_ptr<SerialQueue> _reapQueue;
 
-    std::set<USBDevice_receiver*> _receivers;
-    
     std::set<struct libusb_transfer *> _rx_xfers;
     tihmstar::GuardAccess _rx_xfers_Guard;
     std::set<struct libusb_transfer *> _tx_xfers;
@@ -99,15 +160,24 @@ private:
     tihmstar::GuardAccess _conns_Guard;
     tihmstar::Event _conns_close_event;
 
-    tihmstar::DeliveryEvent<struct libusb_transfer *> _arrived_xfer;
-
-    std::thread _conReaperThread;
-    tihmstar::DeliveryEvent<uint16_t> _reapConnections;
-
 private:
     bool isDeviceReadyForDestruction();
-    void addReceiver();
-    void reaper_runloop();
+    void reap_connection(uint16_t sport) noexcept;
+    void rx_drain() noexcept;
+    uint32_t rx_chain_pktlen(const unsigned char *buffer, uint32_t length);
+    size_t rx_chain_held();
+    void rx_chain_dispatch(uint32_t pktlen, struct libusb_transfer *cur);
+    void rx_chain_flatten(struct libusb_transfer *cur);
+    void rx_chain_release(struct libusb_transfer *keep) noexcept;
+    void tx_stamp_nolock(unsigned char *buf, enum mux_protocol proto);
+    enum tx_lane tx_lane_for_packet_nolock(enum mux_protocol proto, size_t length, uint16_t sport);
+    void tx_register_flow(uint16_t sport, uint16_t dport, uint32_t weight);
+    void tx_unregister_flow(uint16_t sport);
+    tx_packet *tx_next_nolock();
+    void tx_pop_nolock();
+    void tx_flush_nolock();
+    void tx_flush() noexcept;
+    uint32_t tx_max_inflight();
 
 public:
     USBDevice(Muxer *mux, USBDeviceManager *parent, uint16_t pid);
@@ -117,6 +187,7 @@ public:
     virtual void kill() noexcept override;
     void deconstruct() noexcept;
     virtual void start_connect(uint16_t dport, std::shared_ptr<Client> cli) override;
+    std::shared_ptr<TCP> open_connection(uint16_t dport, std::shared_ptr<Client> cli);
     void closeConnection(uint16_t sport);
 
 #pragma mark members
@@ -125,21 +196,29 @@ public:
     uint16_t getPid();
     
     void mux_init();
+    plist_t getStatisticsPlist();
     void send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header = NULL);
     void usb_send(void *buf, size_t length);
+    void tx_wait_for_space(uint16_t sport);
     
-    void device_data_input(unsigned char *buffer, uint32_t length);
+    void device_xfer_input(struct libusb_transfer *xfer) noexcept;
+    bool device_data_input(struct libusb_transfer *xfer);
+    void device_packet_input(const struct iovec *iov, int iovcnt, uint32_t length);
     void device_version_input(struct mux_version_header *vh);
     void device_control_input(unsigned char *payload, uint32_t payload_length);
+
+#pragma mark static
+    static void setTxPolicy(TxPolicy policy);
     
     
 #pragma mark friends
-    friend USBDevice_receiver;
     friend USBDeviceManager;
     friend void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
     friend void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
     friend void usb_start_rx_loop(std::shared_ptr<USBDevice> dev);
     friend void rx_callback(struct libusb_transfer *xfer) noexcept;
+    friend void usb_rx_resubmit(struct libusb_transfer *xfer) noexcept;
+    friend void usb_rx_free(struct libusb_transfer *xfer) noexcept;
     friend void tx_callback(struct libusb_transfer *xfer) noexcept;
 };
 
@@ -12,22 +12,43 @@
 #include "WIFIDevice.hpp"
 #include "../Muxer.hpp"
 #include "../sysconf/sysconf.hpp"
+#include "../Client.hpp"
+#include "../WIFIConnection.hpp"
+#include "../Manager/WIFIHeartbeatManager.hpp"
 
 #ifdef HAVE_WIFI_AVAHI
 #   include "../Manager/WIFIDeviceManager-avahi.hpp"
 #elif HAVE_WIFI_MDNS
 #   include "../Manager/WIFIDeviceManager-mDNS.hpp"
+#elif HAVE_WIFI_BUILTIN
+#   include "../Manager/WIFIDeviceManager-builtin.hpp"
 #endif //HAVE_AVAHI
 
 #include <plist/plist.h>
 
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#include <algorithm>
+
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
+
+static uint64_t monotonic_ms(){
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
 
 WIFIDevice::WIFIDevice(Muxer *mux, WIFIDeviceManager *parent, std::string uuid, std::vector<std::string> ipaddr, std::string serviceName, uint32_t interfaceIndex)
-: Device(mux,Device::MUXCONN_WIFI), _parent(parent), _ipaddr(ipaddr), _serviceName(serviceName), _interfaceIndex(interfaceIndex), _hbclient(NULL), _hbrsp(NULL),
+: Device(mux,Device::MUXCONN_WIFI), _parent(parent), _ipaddr(ipaddr), _serviceName(serviceName), _interfaceIndex(interfaceIndex), _hbconn(NULL), _hbfd(-1), _hbssl(false), _hbDetached(false),
     _idev(NULL)
 {
     strncpy(_serial, uuid.c_str(), sizeof(_serial));
@@ -38,38 +59,243 @@ WIFIDevice::~WIFIDevice() {
     {
         std::unique_lock<std::mutex> ul(_parent->_childrenLck);
         _parent->_children.erase(this);
+        _parent->_heartbeats->remove(this);
         _parent->_childrenEvent.notifyAll();
         _parent = NULL;
     }
 #ifdef HAVE_LIBIMOBILEDEVICE
-    safeFreeCustom(_hbclient, heartbeat_client_free);
+    safeFreeCustom(_hbconn, idevice_disconnect);
     safeFreeCustom(_idev, idevice_free);
 #endif //HAVE_LIBIMOBILEDEVICE
-    safeFreeCustom(_hbrsp, plist_free);
 }
 
-bool WIFIDevice::loopEvent(){
-#ifndef HAVE_LIBIMOBILEDEVICE
-    reterror("Compiled without libimobiledevice");
-#else
-    plist_t hbeat = NULL;
+#pragma mark private
+int WIFIDevice::connect_heartbeat(){
+    lockdownd_client_t lockdown = NULL;
+    lockdownd_service_descriptor_t service = NULL;
+    plist_t p_rsp = NULL;
+    char *xml = NULL;
     cleanup([&]{
-        safeFreeCustom(hbeat, plist_free);
+        safeFree(xml);
+        safeFreeCustom(p_rsp, plist_free);
+        safeFreeCustom(service, lockdownd_service_descriptor_free);
+        safeFreeCustom(lockdown, lockdownd_client_free);
     });
-    heartbeat_error_t hret = HEARTBEAT_E_SUCCESS;
+    lockdownd_error_t lret = LOCKDOWN_E_SUCCESS;
+    uint32_t xmlsize = 0;
+    uint32_t belen = 0;
+    int hbfd = -1;
 
-    retassure((hret = heartbeat_receive_with_timeout(_hbclient,&hbeat,15000)) == HEARTBEAT_E_SUCCESS, "[WIFIDevice] failed to recv heartbeat with error=%d",hret);
-    retassure((hret = heartbeat_send(_hbclient,_hbrsp)) == HEARTBEAT_E_SUCCESS,"[WIFIDevice] failed to send heartbeat");
-    return true;
-#endif //HAVE_LIBIMOBILEDEVICE
+    assure(p_rsp = plist_new_dict());
+    plist_dict_set_item(p_rsp, "Command", plist_new_string("Polo"));
+    plist_to_xml(p_rsp, &xml, &xmlsize);
+    belen = htonl(xmlsize);
+    _hbrsp.assign((const char*)&belen, sizeof(belen));
+    _hbrsp.append(xml, xmlsize);
+
+    assure(!idevice_new_with_options(&_idev,_serial, IDEVICE_LOOKUP_NETWORK));
+
+    //same as heartbeat_client_start_service, but we need the connection to get at the fd
+    retassure(!(lret = lockdownd_client_new_with_handshake(_idev, &lockdown, "usbmuxd2")), "[WIFIDevice] Failed to connect to lockdownd with error=%d",lret);
+    retassure(!(lret = lockdownd_start_service(lockdown, HEARTBEAT_SERVICE_NAME, &service)), "[WIFIDevice] Failed to start heartbeat service with error=%d",lret);
+    retassure(!idevice_connect(_idev, service->port, &_hbconn), "[WIFIDevice] Failed to connect to heartbeat service");
+    if ((_hbssl = service->ssl_enabled)) {
+        retassure(!idevice_connection_enable_ssl(_hbconn), "[WIFIDevice] Failed to enable SSL on heartbeat connection");
+    }
+    retassure(!idevice_connection_get_fd(_hbconn, &hbfd), "[WIFIDevice] Failed to get heartbeat connection fd");
+    return hbfd;
 }
 
-void WIFIDevice::beforeLoop(){
-    retassure(_hbclient, "Not starting loop, because we don't have a _hbclient");
+/*
+    Called by the heartbeat loop whenever the connection may have data.
+    Reads what is there without waiting for more, frames messages out of _hbrecv and answers every Marco with Polo.
+    Reading only stops once nothing is left, so data already decrypted inside the SSL layer
+    (which poll can't see) is picked up too. Returns true if a message was handled.
+ */
+bool WIFIDevice::heartbeat_receive(){
+    bool didHandle = false;
+
+    while (true) {
+        size_t want = sizeof(uint32_t);
+        uint32_t msglen = 0;
+        if (_hbrecv.size() >= sizeof(msglen)) {
+            memcpy(&msglen, _hbrecv.data(), sizeof(msglen));
+            msglen = ntohl(msglen);
+            retassure(msglen && msglen <= WIFI_HEARTBEAT_MAX_MSG_SIZE, "[WIFIDevice] bad heartbeat message size %u",msglen);
+            want += msglen;
+        }
+
+        if (_hbrecv.size() < want) {
+            //never read past the current message, an SSL read waits until it got everything it asked for
+            char buf[0x1000];
+            size_t ask = std::min(want - _hbrecv.size(), sizeof(buf));
+            uint32_t didRecv = 0;
+            if (_hbssl) {
+                idevice_error_t err = idevice_connection_receive_timeout(_hbconn, buf, (uint32_t)ask, &didRecv, WIFI_HEARTBEAT_SSL_RECV_TIMEOUT_MS);
+                retassure(err == IDEVICE_E_SUCCESS || err == IDEVICE_E_TIMEOUT, "[WIFIDevice] failed to recv heartbeat with error=%d",err);
+            } else {
+                ssize_t got = recv(_hbfd, buf, ask, MSG_DONTWAIT);
+                retassure(got != 0, "[WIFIDevice] heartbeat connection closed by device");
+                retassure(got > 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR, "[WIFIDevice] failed to recv heartbeat errno=%d (%s)",errno,strerror(errno));
+                if (got > 0) didRecv = (uint32_t)got;
+            }
+            if (!didRecv) return didHandle; //nothing more for now
+            _hbrecv.append(buf, didRecv);
+            continue;
+        }
+
+        {
+            plist_t p_msg = NULL;
+            cleanup([&]{
+                safeFreeCustom(p_msg, plist_free);
+            });
+            plist_t p_cmd = NULL;
+            const char *cmd = NULL;
+            uint32_t didSend = 0;
+
+            plist_from_memory(_hbrecv.data() + sizeof(msglen), msglen, &p_msg, NULL);
+            _hbrecv.erase(0, want);
+            retassure(p_msg, "[WIFIDevice] failed to parse heartbeat message");
+            didHandle = true;
+
+            if ((p_cmd = plist_dict_get_item(p_msg, "Command")) && plist_get_node_type(p_cmd) == PLIST_STRING) {
+                cmd = plist_get_string_ptr(p_cmd, NULL);
+            }
+            if (!cmd || strcmp(cmd, "Marco")) {
+                debug("[WIFIDevice] %s: ignoring heartbeat command '%s'",_serial,cmd ? cmd : "(null)");
+                continue;
+            }
+            retassure(!idevice_connection_send(_hbconn, _hbrsp.data(), (uint32_t)_hbrsp.size(), &didSend) && didSend == _hbrsp.size(), "[WIFIDevice] failed to send heartbeat");
+        }
+    }
+}
+
+int WIFIDevice::dial(uint16_t dport){
+    struct attempt{
+        int fd;
+        std::string addr;
+    };
+    std::vector<struct sockaddr_storage> v6;
+    std::vector<struct sockaddr_storage> v4;
+    std::vector<struct sockaddr_storage> order;
+    std::vector<attempt> pending;
+    size_t next = 0;
+    int winner = -1;
+    cleanup([&]{
+        for (auto &a : pending) {
+            safeClose(a.fd);
+        }
+    });
+
+    for (auto &ip : _ipaddr) {
+        struct sockaddr_storage ss = {};
+        if (ip.find(":") != std::string::npos) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+            if (inet_pton(AF_INET6, ip.c_str(), &sin6->sin6_addr) != 1) continue;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(dport);
+            //fe80:: is meaningless without the interface it was seen on
+            if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr)) sin6->sin6_scope_id = _interfaceIndex;
+            v6.push_back(ss);
+        } else {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+            if (inet_pton(AF_INET, ip.c_str(), &sin->sin_addr) != 1) continue;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(dport);
+            v4.push_back(ss);
+        }
+    }
+    //interleave families, IPv6 first (RFC 8305)
+    for (size_t i=0; i<v6.size() || i<v4.size(); i++) {
+        if (i<v6.size()) order.push_back(v6[i]);
+        if (i<v4.size()) order.push_back(v4[i]);
+    }
+    retassure(order.size(), "[WIFIDevice] %s has no usable address",_serial);
+
+    {
+        uint64_t deadline = monotonic_ms() + WIFI_CONNECT_TIMEOUT_MS;
+        uint64_t nextStart = 0;
+        while (winner == -1) {
+            uint64_t now = monotonic_ms();
+            retassure(now < deadline, "[WIFIDevice] connecting to %s port %d timed out",_serial,dport);
+
+            if (next < order.size() && now >= nextStart) {
+                struct sockaddr_storage *ss = &order[next++];
+                char addrstr[INET6_ADDRSTRLEN] = {};
+                socklen_t sslen = (ss->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+                int fd = -1;
+                inet_ntop(ss->ss_family, (ss->ss_family == AF_INET6) ? (void*)&((struct sockaddr_in6*)ss)->sin6_addr : (void*)&((struct sockaddr_in*)ss)->sin_addr, addrstr, sizeof(addrstr));
+                if ((fd = socket(ss->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+                    debug("[WIFIDevice] socket() for %s failed errno=%d (%s)",addrstr,errno,strerror(errno));
+                    nextStart = now;
+                    continue;
+                }
+                if (connect(fd, (struct sockaddr*)ss, sslen) == 0) {
+                    winner = fd;
+                    debug("[WIFIDevice] connected to %s port %d via %s",_serial,dport,addrstr);
+                    break;
+                } else if (errno == EINPROGRESS) {
+                    pending.push_back({fd, addrstr});
+                    nextStart = now + WIFI_CONNECT_ATTEMPT_DELAY_MS;
+                } else {
+                    debug("[WIFIDevice] connect to %s failed errno=%d (%s)",addrstr,errno,strerror(errno));
+                    safeClose(fd);
+                    nextStart = now; //don't wait for the delay if the attempt failed right away
+                    continue;
+                }
+            }
+
+            retassure(pending.size() || next < order.size(), "[WIFIDevice] failed to connect to %s port %d",_serial,dport);
+
+            {
+                std::vector<struct pollfd> pfds;
+                uint64_t wakeup = deadline;
+                int err = 0;
+                if (next < order.size() && nextStart < wakeup) wakeup = nextStart;
+                for (auto &a : pending) pfds.push_back({.fd = a.fd, .events = POLLOUT});
+                now = monotonic_ms();
+                if ((err = poll(pfds.data(), pfds.size(), (wakeup > now) ? (int)(wakeup - now) : 0)) <= 0) {
+                    retassure(err == 0 || errno == EINTR, "[WIFIDevice] poll failed errno=%d (%s)",errno,strerror(errno));
+                    continue;
+                }
+                for (ssize_t i = pfds.size()-1; i >= 0; i--) {
+                    int soerr = 0;
+                    socklen_t soerrlen = sizeof(soerr);
+                    if (!pfds[i].revents) continue;
+                    if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen) == 0 && soerr == 0) {
+                        if (winner == -1) {
+                            winner = pending[i].fd;
+                            debug("[WIFIDevice] connected to %s port %d via %s",_serial,dport,pending[i].addr.c_str());
+                            pending.erase(pending.begin()+i);
+                        }
+                    } else {
+                        debug("[WIFIDevice] connect to %s failed errno=%d (%s)",pending[i].addr.c_str(),soerr,strerror(soerr));
+                        safeClose(pending[i].fd);
+                        pending.erase(pending.begin()+i);
+                        nextStart = 0; //next attempt right away
+                    }
+                }
+            }
+        }
+    }
+
+    {
+        int one = 1;
+        setsockopt(winner, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(winner, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    }
+    return winner;
 }
 
-void WIFIDevice::afterLoop() noexcept{
-    kill();
+void WIFIDevice::sweep_connections() noexcept{
+    std::unique_lock<std::mutex> ul(_connectionsLck);
+    for (auto it = _connections.begin(); it != _connections.end();) {
+        if ((*it)->isDone()) {
+            it = _connections.erase(it);
+        } else {
+            it++;
+        }
+    }
 }
 
 void WIFIDevice::kill() noexcept{
@@ -81,33 +307,55 @@ void WIFIDevice::kill() noexcept{
 void WIFIDevice::deconstruct() noexcept{
     debug("[Deconstructing] WIFIDevice %s",_serial);
     std::shared_ptr<WIFIDevice> selfref = _selfref.lock();
-    stopLoop();
+    _parent->_heartbeats->remove(this);
+    {
+        std::set<std::shared_ptr<WIFIConnection>> conns;
+        {
+            std::unique_lock<std::mutex> ul(_connectionsLck);
+            conns = std::move(_connections);
+            _connections.clear();
+        }
+        conns.clear(); //stops the forwarding loops
+    }
     _mux->delete_device(selfref);
 }
 
-void WIFIDevice::startLoop(){
+void WIFIDevice::start_heartbeat(){
 #ifndef HAVE_LIBIMOBILEDEVICE
     reterror("Compiled without libimobiledevice");
 #else
-    heartbeat_error_t hret = HEARTBEAT_E_SUCCESS;
-    _loopState = tihmstar::LOOP_STOPPED;
-    
-    assure(_hbrsp = plist_new_dict());
-    plist_dict_set_item(_hbrsp, "Command", plist_new_string("Polo"));
-    
-    assure(!idevice_new_with_options(&_idev,_serial, IDEVICE_LOOKUP_NETWORK));
-
-    retassure((hret = heartbeat_client_start_service(_idev, &_hbclient, "usbmuxd2")) == HEARTBEAT_E_SUCCESS,"[WIFIDevice] Failed to start heartbeat service with error=%d",hret);
-
-    _loopState = tihmstar::LOOP_UNINITIALISED;
-    Manager::startLoop();
+    std::shared_ptr<WIFIDevice> selfref = _selfref.lock();
+    assure(selfref);
+    _parent->_heartbeats->add(selfref);
 #endif //HAVE_LIBIMOBILEDEVICE
 }
 
-
 void WIFIDevice::start_connect(uint16_t dport, std::shared_ptr<Client> cli){
-    reterror("Legacy connection proxying is currently not implemented");
+    int dfd = -1;
+    cleanup([&]{
+        safeClose(dfd);
+    });
+    std::shared_ptr<WIFIConnection> conn;
+
+    sweep_connections();
+
+    try {
+        dfd = dial(dport);
+    } catch (tihmstar::exception &e) {
+        error("failed to connect client dport=%d error=%s code=%d",dport,e.what(),e.code());
+        throw;
+    }
+
+    if (!cli->_isForwarded) {
+        cli->send_result(cli->_connectTag, RESULT_OK);
+    }
+    conn = std::make_shared<WIFIConnection>(cli->_fd, dfd); cli->_fd = -1; dfd = -1; //disown client, the connection takes care of both fds now
+    {
+        std::unique_lock<std::mutex> ul(_connectionsLck);
+        _connections.insert(conn);
+    }
+    conn->startLoop();
 }
 
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
 #endif //HAVE_LIBIMOBILEDEVICE
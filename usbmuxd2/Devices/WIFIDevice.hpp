@@ -9,7 +9,6 @@
 #define WIFIDevice_hpp
 
 #include "Device.hpp"
-#include <libgeneral/Manager.hpp>
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/heartbeat.h>
 #include <libimobiledevice/lockdown.h>
@@ -17,21 +16,38 @@
 
 #include <iostream>
 #include <vector>
+#include <set>
+#include <mutex>
+#include <memory>
+
+#define WIFI_CONNECT_ATTEMPT_DELAY_MS 250 //RFC 8305 "Connection Attempt Delay"
+#define WIFI_CONNECT_TIMEOUT_MS 5000
+#define WIFI_HEARTBEAT_SSL_RECV_TIMEOUT_MS 1 //libimobiledevice has no non-blocking SSL read, 0 would mean forever
+#define WIFI_HEARTBEAT_MAX_MSG_SIZE 0x10000
 
 class WIFIDeviceManager;
-class WIFIDevice : public Device, tihmstar::Manager {
+class WIFIConnection;
+class WIFIHeartbeatManager;
+class WIFIDevice : public Device {
     WIFIDeviceManager *_parent;
     std::weak_ptr<WIFIDevice> _selfref;
     std::vector<std::string> _ipaddr;
     std::string _serviceName;
     uint32_t _interfaceIndex;
-    heartbeat_client_t _hbclient;
-    plist_t _hbrsp;
+    idevice_connection_t _hbconn;
+    int _hbfd; //protected by WIFIHeartbeatManager::_sessionsLck
+    bool _hbssl;
+    bool _hbDetached; //protected by WIFIHeartbeatManager::_sessionsLck
+    std::string _hbrsp; //length prefixed Polo message
+    std::string _hbrecv; //received, not yet complete heartbeat messages, heartbeat loop only
     idevice_t _idev;
+    std::mutex _connectionsLck;
+    std::set<std::shared_ptr<WIFIConnection>> _connections;
 
-    virtual bool loopEvent() override;
-    virtual void beforeLoop() override;
-    virtual void afterLoop() noexcept override;
+    int connect_heartbeat(); //returns the heartbeat connection fd
+    bool heartbeat_receive();
+    int dial(uint16_t dport);
+    void sweep_connections() noexcept;
 
 public:
     WIFIDevice(Muxer *mux, WIFIDeviceManager *parent, std::string uuid, std::vector<std::string> ipaddr, std::string serviceName, uint32_t interfaceIndex = 0);
@@ -41,11 +57,12 @@ public:
 
     virtual void kill() noexcept override;
     void deconstruct() noexcept;
-    void startLoop();
+    void start_heartbeat();
     virtual void start_connect(uint16_t dport, std::shared_ptr<Client> cli) override;
 
     friend class Muxer;
     friend class WIFIDeviceManager;
+    friend class WIFIHeartbeatManager;
 };
 
 #endif /* WIFIDevice_hpp */
@@ -0,0 +1,101 @@
+//
+//  MPSCRing.hpp
+//  usbmuxd2
+//
+
+#ifndef MPSCRing_hpp
+#define MPSCRing_hpp
+
+#include <atomic>
+#include <stddef.h>
+
+#define MPSCRING_SPIN_MIN 16
+#define MPSCRING_SPIN_MAX 1024
+
+static inline void mpscring_cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+    Bounded lock-free multi-producer single-consumer ring (Vyukov style, one sequence number per slot).
+    Size must be a power of two.
+    Producers never block, try_push fails if the ring is full.
+    The consumer spins for a while on an empty ring before giving up (see try_pop_spin),
+    the spin budget grows when spinning paid off and shrinks when it didn't.
+ */
+template <typename T, size_t Size>
+class MPSCRing{
+    static_assert(Size >= 2 && (Size & (Size-1)) == 0, "MPSCRing size must be a power of two");
+
+    struct slot{
+        std::atomic<size_t> seq;
+        T val;
+    };
+    slot _slots[Size];
+    alignas(64) std::atomic<size_t> _head; //producers
+    alignas(64) size_t _tail; //consumer only
+    unsigned _spinBudget; //consumer only
+
+public:
+    MPSCRing()
+    : _head(0), _tail(0), _spinBudget(MPSCRING_SPIN_MIN)
+    {
+        for (size_t i=0; i<Size; i++) {
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+#pragma mark producer
+    bool try_push(T val) noexcept{
+        size_t pos = _head.load(std::memory_order_relaxed);
+        while (true) {
+            slot *s = &_slots[pos & (Size-1)];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+                    s->val = val;
+                    s->seq.store(pos+1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; //full
+            } else {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+#pragma mark consumer
+    bool try_pop(T &val) noexcept{
+        slot *s = &_slots[_tail & (Size-1)];
+        if (s->seq.load(std::memory_order_acquire) != _tail+1) return false; //empty
+        val = s->val;
+        s->seq.store(_tail+Size, std::memory_order_release);
+        _tail++;
+        return true;
+    }
+
+    bool try_pop_spin(T &val) noexcept{
+        if (try_pop(val)) return true;
+        for (unsigned i=0; i<_spinBudget; i++) {
+            mpscring_cpu_relax();
+            if (try_pop(val)) {
+                if ((_spinBudget <<= 1) > MPSCRING_SPIN_MAX) _spinBudget = MPSCRING_SPIN_MAX;
+                return true;
+            }
+        }
+        if ((_spinBudget >>= 1) < MPSCRING_SPIN_MIN) _spinBudget = MPSCRING_SPIN_MIN;
+        return false;
+    }
+
+    bool empty() noexcept{
+        return _slots[_tail & (Size-1)].seq.load(std::memory_order_acquire) != _tail+1;
+    }
+};
+
+#endif /* MPSCRing_hpp */
@@ -142,6 +142,18 @@ int ClientManager::accept_client(){
     return cfd;
 }
 
+std::shared_ptr<Client> ClientManager::make_client(int client_fd){
+    std::shared_ptr<Client> client = nullptr;
+    client = std::make_shared<Client>(_mux,this, client_fd,_clientNumber++);
+    client->_selfref = client;
+
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        _children.insert(client.get());
+    }
+    return client;
+}
+
 void ClientManager::handle_client(int client_fd){
     std::shared_ptr<Client> client = nullptr;
     cleanup([&]{
@@ -151,16 +163,10 @@ void ClientManager::handle_client(int client_fd){
     });
     
     try {
-        client = std::make_shared<Client>(_mux,this, client_fd,_clientNumber++); client_fd = 0;
-        client->_selfref = client;
+        client = make_client(client_fd); client_fd = 0;
     } catch (tihmstar::exception &e) {
         reterror("failed to handle client with error=%d",e.code());
     }
-
-    {
-        std::unique_lock<std::mutex> ul(_childrenLck);
-        _children.insert(client.get());
-    }
     
     //transfer ownership to muxer
     _mux->add_client(client); client = NULL;
@@ -11,10 +11,11 @@
 #include "Muxer.hpp"
 #include <libgeneral/Manager.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
+#include <atomic>
 
 class ClientManager : public tihmstar::Manager{
     Muxer *_mux; //not owned
-    uint64_t _clientNumber;
+    std::atomic<uint64_t> _clientNumber; //also handed out for ForwardManager connections
     int _listenfd;
     int _wakePipe[2];
     std::set<Client *> _children; //raw ptr to shared objec
@@ -32,6 +33,8 @@ class ClientManager : public tihmstar::Manager{
     int accept_client();
     void handle_client(int client_fd);    
 public:
+    std::shared_ptr<Client> make_client(int client_fd);
+
     ClientManager(Muxer *mux);
     virtual ~ClientManager() override;
 
@@ -0,0 +1,237 @@
+//
+//  ForwardManager.cpp
+//  usbmuxd2
+//
+
+#include "ForwardManager.hpp"
+#include "ClientManager.hpp"
+#include "MUXException.hpp"
+#include "Client.hpp"
+#include <libgeneral/macros.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#pragma mark ForwardManager
+ForwardManager::ForwardManager(Muxer *mux, ClientManager *climgr)
+: _mux(mux), _climgr(climgr)
+, _wakePipe{-1,-1}
+, _connectPool(WORKERPOOL_MIN_THREADS)
+{
+    assure(!pipe(_wakePipe));
+    fcntl(_wakePipe[0], F_SETFL, fcntl(_wakePipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(_wakePipe[1], F_SETFL, fcntl(_wakePipe[1], F_GETFL) | O_NONBLOCK);
+}
+
+ForwardManager::~ForwardManager(){
+    info("[destroying] ForwardManager");
+    stopLoop();
+
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+    for (auto &f : _forwards) {
+        safeClose(f.second.listenfd);
+    }
+    for (int fd : _closingFDs) {
+        close(fd);
+    }
+}
+
+void ForwardManager::stopAction() noexcept{
+    safeClose(_wakePipe[1]);
+}
+
+bool ForwardManager::loopEvent(){
+    std::vector<struct pollfd> pfds;
+    std::vector<forward_rule> rules;
+    int err = 0;
+
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        for (int fd : _closingFDs) {
+            close(fd);
+        }
+        _closingFDs.clear();
+        for (auto &f : _forwards) {
+            pfds.push_back({
+                .fd = f.second.listenfd,
+                .events = POLLIN
+            });
+            rules.push_back(f.second.rule);
+        }
+    }
+    pfds.push_back({
+        .fd = _wakePipe[0],
+        .events = POLLIN
+    });
+
+    if ((err = poll(pfds.data(),(nfds_t)pfds.size(),-1)) == -1){
+        retassure(errno == EINTR, "[FORWARDMANAGER] poll failed errno=%d (%s)",errno,strerror(errno));
+        return true;
+    }
+    retcustomassure(MUXException_graceful_kill,!(pfds.back().revents & POLLHUP), "graceful kill requested");
+    if (pfds.back().revents & POLLIN) {
+        //forwards changed, pick up the new set of listeners
+        char wakebuf[0x40];
+        while (read(_wakePipe[0], wakebuf, sizeof(wakebuf)) > 0);
+        return true;
+    }
+
+    for (size_t i=0; i<rules.size(); i++) {
+        int cfd = -1;
+        if (!(pfds[i].revents & POLLIN)) continue;
+        if ((cfd = accept(pfds[i].fd, NULL, NULL)) < 0) {
+            warning("[FORWARDMANAGER] accept() on local port %u failed (%s)",rules[i].localPort,strerror(errno));
+            continue;
+        }
+        {
+            forward_rule rule = rules[i];
+            _connectPool.post([this, rule, cfd]{
+                handle_connection(rule, cfd);
+            });
+        }
+    }
+    return true;
+}
+
+void ForwardManager::afterLoop() noexcept{
+    std::unique_lock<std::mutex> ul(_forwardsLck);
+    for (auto &f : _forwards) {
+        safeClose(f.second.listenfd);
+    }
+    _forwards.clear();
+}
+
+void ForwardManager::handle_connection(forward_rule rule, int cfd) noexcept{
+    std::shared_ptr<Client> cli = nullptr;
+    cleanup([&]{
+        if (cfd > 0) {
+            close(cfd); cfd = -1;
+        }
+    });
+    bool didConnect = false;
+    int device_id = 0;
+
+    if (!(device_id = _mux->id_for_serial(rule.udid.size() ? rule.udid.c_str() : NULL))) {
+        warning("[FORWARDMANAGER] no device %s for local port %u",rule.udid.size() ? rule.udid.c_str() : "(any)",rule.localPort);
+    } else {
+        try {
+            cli = _climgr->make_client(cfd); cfd = -1;
+            cli->_isForwarded = true;
+            //on success TCP takes over the socket, the Client object only lives for the handshake
+            _mux->start_connect(device_id, rule.devicePort, cli);
+            didConnect = true;
+        } catch (tihmstar::exception &e) {
+            warning("[FORWARDMANAGER] failed to connect local port %u to device %d port %u with error=%s code=%d",
+                    rule.localPort,device_id,rule.devicePort,e.what(),e.code());
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        auto it = _forwards.find(rule.localPort);
+        if (it != _forwards.end()) {
+            if (didConnect) it->second.connections++;
+            else it->second.failures++;
+        }
+    }
+}
+
+void ForwardManager::wake_loop() noexcept{
+    while (write(_wakePipe[1], "", 1) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: pipe is full, the loop is already going to rebuild its poll set
+        if (errno != EAGAIN) error("[FORWARDMANAGER] failed to wake loop errno=%d (%s)",errno,strerror(errno));
+        break;
+    }
+}
+
+#pragma mark public
+void ForwardManager::addForward(forward_rule rule){
+    int lfd = -1;
+    cleanup([&]{
+        safeClose(lfd);
+    });
+    struct sockaddr_in addr = {};
+    constexpr int yes = 1;
+
+    retassure(rule.localPort && rule.devicePort, "invalid forward %u -> %u",rule.localPort,rule.devicePort);
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        retassure(_forwards.find(rule.localPort) == _forwards.end(), "local port %u is already forwarded",rule.localPort);
+    }
+
+    retassure((lfd = socket(AF_INET, SOCK_STREAM, 0))>=0, "socket() failed: %s", strerror(errno));
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int));
+
+    //only ever exposed on loopback, same as iproxy's default
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(rule.localPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    retassure(!bind(lfd, (struct sockaddr*)&addr, sizeof(addr)), "bind() on local port %u failed: %s", rule.localPort, strerror(errno));
+    retassure(!listen(lfd, 16), "listen() on local port %u failed: %s", rule.localPort, strerror(errno));
+
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        retassure(_forwards.find(rule.localPort) == _forwards.end(), "local port %u is already forwarded",rule.localPort);
+        _forwards[rule.localPort] = {
+            .rule = rule,
+            .listenfd = lfd,
+            .connections = 0,
+            .failures = 0
+        };
+        lfd = -1;
+    }
+    info("Forwarding local port %u to %s port %u",rule.localPort,rule.udid.size() ? rule.udid.c_str() : "first device",rule.devicePort);
+    wake_loop();
+}
+
+void ForwardManager::removeForward(uint16_t localPort, int requester){
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        auto it = _forwards.find(localPort);
+        retassure(it != _forwards.end(), "local port %u is not forwarded",localPort);
+        //forwards from the config file can only be removed by root
+        retassure(requester <= 0 || requester == it->second.rule.owner, "uid %d may not remove the forward of local port %u",requester,localPort);
+        _closingFDs.push_back(it->second.listenfd);
+        _forwards.erase(it);
+    }
+    info("Removed forward of local port %u",localPort);
+    wake_loop();
+}
+
+plist_t ForwardManager::getForwardsPlist(){
+    plist_t p_ret = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_ret, plist_free);
+    });
+    assure(p_ret = plist_new_array());
+
+    {
+        std::unique_lock<std::mutex> ul(_forwardsLck);
+        for (auto &f : _forwards) {
+            plist_t p_fwd = plist_new_dict();
+            plist_dict_set_item(p_fwd, "LocalPort", plist_new_uint(f.second.rule.localPort));
+            plist_dict_set_item(p_fwd, "DevicePort", plist_new_uint(f.second.rule.devicePort));
+            if (f.second.rule.udid.size()) {
+                plist_dict_set_item(p_fwd, "UDID", plist_new_string(f.second.rule.udid.c_str()));
+            }
+            if (f.second.rule.owner >= 0) {
+                plist_dict_set_item(p_fwd, "Owner", plist_new_uint(f.second.rule.owner));
+            }
+            plist_dict_set_item(p_fwd, "Connections", plist_new_uint(f.second.connections));
+            plist_dict_set_item(p_fwd, "Failures", plist_new_uint(f.second.failures));
+            plist_array_append_item(p_ret, p_fwd);
+        }
+    }
+
+    {
+        plist_t ret = p_ret; p_ret = NULL;
+        return ret;
+    }
+}
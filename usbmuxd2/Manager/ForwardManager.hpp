@@ -0,0 +1,64 @@
+//
+//  ForwardManager.hpp
+//  usbmuxd2
+//
+
+#ifndef ForwardManager_hpp
+#define ForwardManager_hpp
+
+#include "Muxer.hpp"
+#include "../WorkerPool.hpp"
+#include <libgeneral/Manager.hpp>
+#include <plist/plist.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#define FORWARD_RUNTIME_PORT_MIN 1024 //lower ports can only be forwarded from the config file
+
+class ClientManager;
+
+/*
+    Daemon side port forwarding (like iproxy), a local TCP port is tunneled straight
+    into a device port, without the extra hop through a usbmux client process.
+ */
+class ForwardManager : public tihmstar::Manager{
+public:
+    struct forward_rule{
+        std::string udid;   //empty = first available device
+        uint16_t localPort;
+        uint16_t devicePort;
+        int owner;          //uid of the client that added it, -1 = config file
+    };
+private:
+    struct forward_entry{
+        forward_rule rule;
+        int listenfd;
+        uint64_t connections;
+        uint64_t failures;
+    };
+    Muxer *_mux; //not owned
+    ClientManager *_climgr; //not owned
+    int _wakePipe[2];
+    std::map<uint16_t,forward_entry> _forwards; //by local port
+    std::vector<int> _closingFDs; //listeners of removed forwards, closed by the loop once it doesn't poll them anymore
+    std::mutex _forwardsLck;
+    WorkerPool _connectPool; //device handshakes must not hold up accepting, destroyed first
+
+    virtual void stopAction() noexcept override;
+    virtual bool loopEvent() override;
+    virtual void afterLoop() noexcept override;
+
+    void handle_connection(forward_rule rule, int cfd) noexcept;
+    void wake_loop() noexcept;
+public:
+    ForwardManager(Muxer *mux, ClientManager *climgr);
+    virtual ~ForwardManager() override;
+
+    void addForward(forward_rule rule);
+    void removeForward(uint16_t localPort, int requester); //requester uid, -1 = daemon itself
+    plist_t getForwardsPlist();
+};
+
+#endif /* ForwardManager_hpp */
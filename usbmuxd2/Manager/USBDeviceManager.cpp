@@ -6,6 +6,8 @@
 //
 
 #include "USBDeviceManager.hpp"
+#include "USBEventShard.hpp"
+#include "../WorkerPool.hpp"
 #include "../Devices/USBDevice.hpp"
 #include "../MUXException.hpp"
 
@@ -17,19 +19,27 @@ int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_ev
 void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
 void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
 void rx_callback(struct libusb_transfer *xfer) noexcept;
+void usb_rx_resubmit(struct libusb_transfer *xfer) noexcept;
+void usb_rx_free(struct libusb_transfer *xfer) noexcept;
 void usb_start_rx_loop(std::shared_ptr<USBDevice> dev);
 
+static_assert(USB_RX_RING_SIZE >= NUM_RX_LOOPS, "RX ring must be able to hold all RX transfers");
+
 #pragma mark libusb_callback implementations
 
 int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept{
     int err = 0;
     USBDeviceManager *devmgr = (USBDeviceManager*)user_data;
-    
+    USBEventShard *shard = devmgr->shard_for_ctx(ctx);
+
+    //every shard sees every device, only the one it belongs to handles it
+    if (devmgr->shard_for_device(device) != shard) return 0;
+
     switch (event) {
         case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED:
             try {
                 debug("Adding device");
-                devmgr->device_add(device);
+                devmgr->device_add(device, shard);
             } catch (tihmstar::exception &e) {
                 uint8_t bus = libusb_get_bus_number(device);
                 uint8_t address = libusb_get_device_address(device);
@@ -190,12 +200,12 @@ void usb_start_rx_loop(std::shared_ptr<USBDevice> dev){
     });
     int ret = 0;
 
-    assure(buf = malloc(USB_MRU));
+    assure(buf = malloc(USB_RX_XFER_SIZE));
     assure(xfer = libusb_alloc_transfer(0));
     xfer->user_data = NULL;
 
     devrefarg = new std::shared_ptr<USBDevice>{dev};
-    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, USB_MRU, rx_callback, devrefarg, 0);
+    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, USB_RX_XFER_SIZE, rx_callback, devrefarg, 0);
     buf = NULL; //owned by xfer now
     devrefarg = nullptr; //owned by xfer now
 
@@ -205,14 +215,24 @@ void usb_start_rx_loop(std::shared_ptr<USBDevice> dev){
     }
     retassure(!((ret = libusb_submit_transfer(xfer)),ret),"Failed to submit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, ret);
     xfer = NULL;
-    dev->addReceiver();
 }
 
 void rx_callback(struct libusb_transfer *xfer) noexcept{
     std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
 //    debug("RX callback dev %d-%d len %d status %d", dev->_bus, dev->_address, xfer->actual_length, xfer->status);
+    dev->_shard->_rxCompletions++;
     if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        dev->_arrived_xfer.post(xfer);
+        if (!dev->_rxRing.try_push(xfer)) {
+            //can't happen as long as the ring can hold all RX transfers
+            error("RX ring overflow for device %d-%d", dev->_bus, dev->_address);
+            goto error;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!dev->_rxScheduled.exchange(true)) {
+            dev->_parent->_workers->post([dev]{
+                dev->rx_drain();
+            });
+        }
         return;
     }
     switch(xfer->status) {
@@ -242,6 +262,22 @@ void rx_callback(struct libusb_transfer *xfer) noexcept{
             break;
     }
 error:
+    usb_rx_free(xfer);
+    dev->kill();
+}
+
+void usb_rx_resubmit(struct libusb_transfer *xfer) noexcept{
+    int err = 0;
+    if ((err = libusb_submit_transfer(xfer))) {
+        std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
+        error("Failed to re-submit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, err);
+        usb_rx_free(xfer);
+        dev->kill();
+    }
+}
+
+void usb_rx_free(struct libusb_transfer *xfer) noexcept{
+    std::shared_ptr<USBDevice> dev = *(std::shared_ptr<USBDevice> *)xfer->user_data;
     //remove transfer
     {
         guardWrite(dev->_rx_xfers_Guard);
@@ -255,14 +291,12 @@ error:
         safeDelete(cbargref);
     }
     libusb_free_transfer(xfer);
-
-    dev->kill();
 }
 
 #pragma mark USBDeviceManager
-USBDeviceManager::USBDeviceManager(Muxer *parent)
+USBDeviceManager::USBDeviceManager(Muxer *parent, int eventShards)
 : DeviceManager(parent)
-, _ctx(NULL), _usb_hotplug_cb_handle(0)
+, _ctx(NULL), _usb_hotplug_cb_handle(0), _workers(NULL)
 {
     bool didInit = false;
     cleanup([&]{
@@ -273,9 +307,30 @@ USBDeviceManager::USBDeviceManager(Muxer *parent)
     retassure(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG), "libusb does not support hotplug events");
 
     assure(!libusb_init(&_ctx));
+
+    /*
+        Shard 0 is driven by our own loop on the hotplug context,
+        all further shards get their own context and event thread
+     */
+    if (eventShards < 1) eventShards = 1;
+    _shards.push_back(new USBEventShard(0, _ctx));
+    for (int i=1; i<eventShards; i++) {
+        USBEventShard *shard = new USBEventShard(i);
+        _shards.push_back(shard);
+        shard->startLoop();
+    }
+    info("Handling USB events on %zu shard(s)",_shards.size());
+
+    _workers = new WorkerPool();
+
     info("Registering for libusb hotplug events");
 
     retassure(!(err = libusb_hotplug_register_callback(NULL, static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT), LIBUSB_HOTPLUG_ENUMERATE, VID_APPLE, LIBUSB_HOTPLUG_MATCH_ANY, 0, usb_hotplug_cb, this, &_usb_hotplug_cb_handle)),"ERROR: Could not register for libusb hotplug events (%d)", err);
+    for (size_t i=1; i<_shards.size(); i++) {
+        libusb_hotplug_callback_handle handle = 0;
+        retassure(!(err = libusb_hotplug_register_callback(_shards[i]->ctx(), static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT), LIBUSB_HOTPLUG_ENUMERATE, VID_APPLE, LIBUSB_HOTPLUG_MATCH_ANY, 0, usb_hotplug_cb, this, &handle)),"ERROR: Could not register for libusb hotplug events on event shard %zu (%d)", i, err);
+        _shard_hotplug_cb_handles.push_back(handle);
+    }
     didInit = true;
     _devReaperThread = std::thread([this]{
         reaper_runloop();
@@ -286,6 +341,10 @@ USBDeviceManager::~USBDeviceManager(){
     if (_usb_hotplug_cb_handle) {
         libusb_hotplug_deregister_callback(_ctx, _usb_hotplug_cb_handle); _usb_hotplug_cb_handle = 0;
     }
+    for (size_t i=0; i<_shard_hotplug_cb_handles.size(); i++) {
+        libusb_hotplug_deregister_callback(_shards[i+1]->ctx(), _shard_hotplug_cb_handles[i]);
+    }
+    _shard_hotplug_cb_handles.clear();
     if (_children.size()) {
         debug("waiting for usb children to die...");
         std::unique_lock<std::mutex> ul(_childrenLck);
@@ -301,15 +360,19 @@ USBDeviceManager::~USBDeviceManager(){
     _reapDevices.kill();
     _devReaperThread.join();
 
+    safeDelete(_workers);
     stopLoop();
+    while (_shards.size()) {
+        USBEventShard *shard = _shards.back();
+        _shards.pop_back();
+        delete shard;
+    }
     safeFreeCustom(_ctx, libusb_exit);
 }
 
 #pragma mark inheritance override
 bool USBDeviceManager::loopEvent(){
-    int err = 0;
-    retassure(!(err = libusb_handle_events(_ctx)), "libusb_handle_events_completed failed: %d", err);
-    return true;
+    return _shards.front()->handle_events();
 }
 
 void USBDeviceManager::stopAction() noexcept{
@@ -351,7 +414,34 @@ bool USBDeviceManager::is_constructing(uint8_t bus, uint8_t addr){
     return ret;
 }
 
-void USBDeviceManager::device_add(libusb_device *dev){
+USBEventShard *USBDeviceManager::shard_for_device(libusb_device *dev){
+    uint8_t ports[8] = {};
+    int portsCnt = 0;
+    uint32_t location = libusb_get_bus_number(dev);
+
+    if (_shards.size() == 1) return _shards.front();
+
+    /*
+        Shard by physical location (bus and port path) rather than by address,
+        so a device always ends up on the same shard, even when re-enumerated
+     */
+    if ((portsCnt = libusb_get_port_numbers(dev, ports, sizeof(ports))) < 0) portsCnt = 0;
+    for (int i=0; i<portsCnt; i++) {
+        location = location * 31 + ports[i];
+    }
+    return _shards.at(location % _shards.size());
+}
+
+USBEventShard *USBDeviceManager::shard_for_ctx(libusb_context *ctx){
+    //hotplug callbacks registered on the default context report it as NULL
+    if (!ctx) return _shards.front();
+    for (auto shard : _shards) {
+        if (shard->ctx() == ctx) return shard;
+    }
+    return _shards.front();
+}
+
+void USBDeviceManager::device_add(libusb_device *dev, USBEventShard *shard){
     libusb_device_handle *handle = NULL;
     struct libusb_config_descriptor *config = NULL;
     std::shared_ptr<USBDevice> *transferdevref = nullptr;
@@ -386,6 +476,8 @@ void USBDeviceManager::device_add(libusb_device *dev){
 
     info("Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
 
+    debug("Assigning device %d-%d to event shard %d", bus, address, shard->index());
+
     // No blocking operation can follow: it may be run in the libusb hotplug callback and libusb will refuse any
     // blocking call
     retassure(!(err = libusb_open(dev, &handle)),"Could not open device %d-%d: %d", bus, address, err);
@@ -468,6 +560,8 @@ found_device:;
     newDevice->_devdesc = devdesc;
     newDevice->_speed = 480000000;
     newDevice->_usbdev = handle; handle = NULL; //transfering ownership here!
+    newDevice->_shard = shard;
+    shard->_devices++;
     newDevice->_wMaxPacketSize = libusb_get_max_packet_size(dev, newDevice->_ep_out);
 
     if (newDevice->_wMaxPacketSize <= 0) {
@@ -533,6 +627,34 @@ void USBDeviceManager::reaper_runloop(){
 }
 
 
-#pragma mark public
+#pragma mark members
+plist_t USBDeviceManager::getStatisticsPlist(){
+    plist_t p_ret = NULL;
+    plist_t p_shards = NULL;
+    plist_t p_devices = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_devices, plist_free);
+        safeFreeCustom(p_shards, plist_free);
+        safeFreeCustom(p_ret, plist_free);
+    });
+    assure(p_ret = plist_new_dict());
+    assure(p_shards = plist_new_array());
+    for (auto shard : _shards) {
+        plist_array_append_item(p_shards, shard->getStatisticsPlist());
+    }
+    plist_dict_set_item(p_ret, "EventShards", p_shards); p_shards = NULL; //transfer ownership
+    assure(p_devices = plist_new_array());
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        for (auto dev : _children) {
+            plist_array_append_item(p_devices, dev->getStatisticsPlist());
+        }
+    }
+    plist_dict_set_item(p_ret, "Devices", p_devices); p_devices = NULL; //transfer ownership
+    {
+        plist_t ret = p_ret; p_ret = NULL;
+        return ret;
+    }
+}
 
 
@@ -12,9 +12,12 @@
 #include <libgeneral/Event.hpp>
 #include <libgeneral/DeliveryEvent.hpp>
 #include <libusb.h>
+#include <plist/plist.h>
 #include <set>
+#include <vector>
 #include <memory>
 #include <mutex>
+#include <atomic>
 
 #define INTERFACE_CLASS 255
 #define INTERFACE_SUBCLASS 254
@@ -29,6 +32,10 @@
 #define USB_MTU (3 * 16384)
 #define USB_MRU USB_MTU
 
+// RX transfers may be larger than a single mux packet,
+// device_data_input splits them back into packets
+#define USB_RX_XFER_SIZE (4 * USB_MRU)
+
 #define USB_PACKET_SIZE 512
 
 #define VID_APPLE 0x5ac
@@ -37,11 +44,15 @@
 
 #define NUM_RX_LOOPS 3
 
-class USBDevice_receiver;
 class USBDevice;
+class USBEventShard;
+class WorkerPool;
 class USBDeviceManager : public DeviceManager{
     libusb_context *_ctx;
     libusb_hotplug_callback_handle _usb_hotplug_cb_handle;
+    std::vector<USBEventShard*> _shards;
+    std::vector<libusb_hotplug_callback_handle> _shard_hotplug_cb_handles; //shards other than 0
+    WorkerPool *_workers;
     
     std::set<uint16_t> _constructing;
     tihmstar::GuardAccess _constructingGuard;
@@ -61,20 +72,25 @@ private:
     void del_constructing(uint8_t bus, uint8_t addr);
     bool is_constructing(uint8_t bus, uint8_t addr);
 
-    void device_add(libusb_device *dev);
+    USBEventShard *shard_for_device(libusb_device *dev);
+    USBEventShard *shard_for_ctx(libusb_context *ctx);
+    void device_add(libusb_device *dev, USBEventShard *shard);
 
     void reaper_runloop();
     
 public:
-    USBDeviceManager(Muxer *parent);
+    USBDeviceManager(Muxer *parent, int eventShards = 1);
     virtual ~USBDeviceManager() override;
+
+#pragma mark members
+    plist_t getStatisticsPlist();
     
 #pragma mark friends
-    friend USBDevice_receiver;
     friend USBDevice;
     friend int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept;
     friend void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
     friend void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
+    friend void rx_callback(struct libusb_transfer *xfer) noexcept;
 };
 
 #endif /* USBDeviceManager_hpp */
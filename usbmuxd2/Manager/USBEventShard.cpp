@@ -0,0 +1,65 @@
+//
+//  USBEventShard.cpp
+//  usbmuxd2
+//
+
+#include "USBEventShard.hpp"
+#include <libgeneral/macros.h>
+
+#pragma mark USBEventShard
+USBEventShard::USBEventShard(int index, libusb_context *ctx)
+: _index(index), _ctx(ctx), _ownsCtx(false)
+, _devices(0), _rxCompletions(0), _txCompletions(0), _txAggregated(0), _txPrioritized(0), _txBackpressure(0), _eventIterations(0)
+{
+    if (!_ctx) {
+        int err = 0;
+        retassure(!(err = libusb_init(&_ctx)), "Failed to init libusb context for event shard %d (%d)", _index, err);
+        _ownsCtx = true;
+    }
+}
+
+USBEventShard::~USBEventShard(){
+    stopLoop();
+    if (_ownsCtx) {
+        safeFreeCustom(_ctx, libusb_exit);
+    }
+}
+
+#pragma mark inheritance override
+bool USBEventShard::loopEvent(){
+    return handle_events();
+}
+
+void USBEventShard::stopAction() noexcept{
+    libusb_interrupt_event_handler(_ctx);
+}
+
+#pragma mark members
+int USBEventShard::index(){
+    return _index;
+}
+
+libusb_context *USBEventShard::ctx(){
+    return _ctx;
+}
+
+bool USBEventShard::handle_events(){
+    int err = 0;
+    retassure(!(err = libusb_handle_events(_ctx)) || err == LIBUSB_ERROR_INTERRUPTED, "libusb_handle_events on shard %d failed: %d", _index, err);
+    _eventIterations++;
+    return true;
+}
+
+plist_t USBEventShard::getStatisticsPlist(){
+    plist_t p_ret = NULL;
+    assure(p_ret = plist_new_dict());
+    plist_dict_set_item(p_ret, "Index", plist_new_uint(_index));
+    plist_dict_set_item(p_ret, "Devices", plist_new_uint(_devices));
+    plist_dict_set_item(p_ret, "RXCompletions", plist_new_uint(_rxCompletions));
+    plist_dict_set_item(p_ret, "TXCompletions", plist_new_uint(_txCompletions));
+    plist_dict_set_item(p_ret, "TXAggregated", plist_new_uint(_txAggregated));
+    plist_dict_set_item(p_ret, "TXPrioritized", plist_new_uint(_txPrioritized));
+    plist_dict_set_item(p_ret, "TXBackpressure", plist_new_uint(_txBackpressure));
+    plist_dict_set_item(p_ret, "EventIterations", plist_new_uint(_eventIterations));
+    return p_ret;
+}
@@ -0,0 +1,50 @@
+//
+//  USBEventShard.hpp
+//  usbmuxd2
+//
+
+#ifndef USBEventShard_hpp
+#define USBEventShard_hpp
+
+#include <libgeneral/Manager.hpp>
+#include <libusb.h>
+#include <plist/plist.h>
+#include <atomic>
+
+/*
+    A shard owns a libusb context with its own event handling thread.
+    Devices are opened on exactly one shard, so all transfer completions of a device land on the same thread.
+    Every shard gets hotplug events on its own context and only picks up the devices that belong to it.
+    Shard 0 wraps the context of USBDeviceManager, which drives its event loop itself.
+ */
+class USBEventShard : public tihmstar::Manager{
+    int _index;
+    libusb_context *_ctx;
+    bool _ownsCtx;
+
+public:
+    std::atomic<uint64_t> _devices;
+    std::atomic<uint64_t> _rxCompletions;
+    std::atomic<uint64_t> _txCompletions;
+    std::atomic<uint64_t> _txAggregated; //mux packets that shared a USB transfer with others
+    std::atomic<uint64_t> _txPrioritized; //control lane packets that skipped queued bulk data
+    std::atomic<uint64_t> _txBackpressure; //times a bulk sender had to wait for queue space
+    std::atomic<uint64_t> _eventIterations;
+
+private:
+#pragma mark inheritance override
+    virtual bool loopEvent() override;
+    virtual void stopAction() noexcept override;
+
+public:
+    USBEventShard(int index, libusb_context *ctx = NULL);
+    ~USBEventShard();
+
+#pragma mark members
+    int index();
+    libusb_context *ctx();
+    bool handle_events();
+    plist_t getStatisticsPlist();
+};
+
+#endif /* USBEventShard_hpp */
@@ -17,6 +17,7 @@
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/address.h>
+#include <avahi-common/timeval.h>
 
 #include <string.h>
 
@@ -27,13 +28,15 @@ void avahi_browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avahi
 void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol,
        AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name,
        const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) noexcept;
+void avahi_sweep_callback(AvahiTimeout *t, void *userdata) noexcept;
 
 #pragma mark WIFIDeviceManager
 
 WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
-: DeviceManager(mux)
+: DeviceManager(mux), _heartbeats(NULL), _sweepTimeout(NULL)
 {
    int err = 0;
+   struct timeval tv = {};
    debug("WIFIDeviceManager avahi-client");
 
    assure(_simple_poll = avahi_simple_poll_new());
@@ -46,6 +49,14 @@ WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
    assure(_avahi_sb2 = avahi_service_browser_new(_avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_remotepairing-manual-pairing._tcp", NULL, (AvahiLookupFlags)0, avahi_browse_callback, this));
    debug("WIFIDeviceManager created avahi service_browser");
 
+   {
+       const AvahiPoll *api = avahi_simple_poll_get(_simple_poll);
+       assure(_sweepTimeout = api->timeout_new(api, avahi_elapse_time(&tv, WIFISERVICECACHE_SWEEP_INTERVAL_SEC*1000, 0), avahi_sweep_callback, this));
+   }
+
+    _heartbeats = new WIFIHeartbeatManager();
+    _heartbeats->startLoop();
+
     _devReaperThread = std::thread([this]{
         reaper_runloop();
     });
@@ -67,7 +78,11 @@ WIFIDeviceManager::~WIFIDeviceManager(){
     }
     _reapDevices.kill();
     _devReaperThread.join();
+    safeDelete(_heartbeats);
 
+    if (_sweepTimeout) {
+        avahi_simple_poll_get(_simple_poll)->timeout_free(_sweepTimeout); _sweepTimeout = NULL;
+    }
     safeFreeCustom(_avahi_sb,avahi_service_browser_free);
     safeFreeCustom(_avahi_sb2,avahi_service_browser_free);
     safeFreeCustom(_avahi_client,avahi_client_free);
@@ -80,6 +95,36 @@ void WIFIDeviceManager::device_add(std::shared_ptr<WIFIDevice> dev, bool notify)
     _mux->add_device(dev, notify);
 }
 
+void WIFIDeviceManager::device_evict(const std::string &uuid) noexcept{
+    std::vector<std::shared_ptr<WIFIDevice>> devs;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        for (auto c : _children) {
+            if (uuid != c->_serial) continue;
+            if (std::shared_ptr<WIFIDevice> dev = c->_selfref.lock()) devs.push_back(std::move(dev));
+        }
+    }
+    //these may be the last references, ~WIFIDevice takes _childrenLck
+    for (auto &dev : devs) {
+        debug("evicting WIFIDevice %s, service went away",dev->_serial);
+        dev->kill();
+    }
+}
+
+void WIFIDeviceManager::sweep_services() noexcept{
+    std::vector<WIFIServiceCache::service_ref> refresh;
+    std::vector<std::string> evict;
+    _services.sweep(refresh, evict);
+    for (auto &ref : refresh) {
+        if (!avahi_service_resolver_new(_avahi_client, ref.interface, ref.protocol, ref.name.c_str(), ref.type.c_str(), ref.domain.c_str(), AVAHI_PROTO_UNSPEC, (AvahiLookupFlags)0, avahi_resolve_callback, this)){
+            debug("Failed to resolve service '%s' again: %s\n", ref.name.c_str(), avahi_strerror(avahi_client_errno(_avahi_client)));
+            _services.resolveFailed(WIFIServiceCache::key(ref.name.c_str(), ref.type.c_str()));
+        }
+    }
+    for (auto &uuid : evict) {
+        device_evict(uuid);
+    }
+}
 
 bool WIFIDeviceManager::loopEvent(){
     int err = avahi_simple_poll_loop(_simple_poll); //it's fine if this is blocking
@@ -130,12 +175,19 @@ void avahi_browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avahi
           function we free it. If the server is terminated before
           the callback function is called the server will free
           the resolver for us. */
-       if (!(avahi_service_resolver_new(devmgr->_avahi_client, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, (AvahiLookupFlags)0, avahi_resolve_callback, userdata)))
+       if (!devmgr->_services.shouldResolve(WIFIServiceCache::key(name, type), {name, type, domain, interface, protocol})) break;
+       if (!(avahi_service_resolver_new(devmgr->_avahi_client, interface, protocol, name, type, domain, AVAHI_PROTO_UNSPEC, (AvahiLookupFlags)0, avahi_resolve_callback, userdata))){
            debug("Failed to resolve service '%s': %s\n", name, avahi_strerror(avahi_client_errno(devmgr->_avahi_client)));
+           devmgr->_services.resolveFailed(WIFIServiceCache::key(name, type));
+       }
        break;
    case AVAHI_BROWSER_REMOVE:
+   {
        debug("(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
+       std::string uuid = devmgr->_services.remove(WIFIServiceCache::key(name, type));
+       if (uuid.size()) devmgr->device_evict(uuid);
        break;
+   }
    case AVAHI_BROWSER_ALL_FOR_NOW:
    case AVAHI_BROWSER_CACHE_EXHAUSTED:
        debug("(Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
@@ -156,9 +208,9 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
     switch (event) {
         case AVAHI_RESOLVER_FAILURE:
             debug("(Resolver) Failed to resolve service '%s' of type '%s' in domain '%s': %s\n", name, type, domain, avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
+            devmgr->_services.resolveFailed(WIFIServiceCache::key(name, type));
             break;
         case AVAHI_RESOLVER_FOUND: {
-            // TODO: inform muxer about devices leaving
             debug("Service '%s' of type '%s' in domain '%s':\n", name, type, domain);
             avahi_address_snprint(addr, sizeof(addr), address);
             t = avahi_string_list_to_string(txt);
@@ -174,6 +226,7 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
             if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
                 uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
                 macAddr = {};
+                devmgr->_services.resolved(WIFIServiceCache::key(name, type), uuid);
                 if (devmgr->_mux->have_wifi_device_with_ip(addrs)) goto error;
                 notifyadd = false;
             }else{
@@ -181,8 +234,10 @@ void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, Ava
                     uuid = sysconf_udid_for_macaddr(macAddr);
                 }catch (tihmstar::exception &e){
                     debug("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
+                    devmgr->_services.resolved(WIFIServiceCache::key(name, type), {}); //not one of ours, don't resolve it again right away
                     break;
                 }
+                devmgr->_services.resolved(WIFIServiceCache::key(name, type), uuid);
 
                 if (devmgr->_mux->have_wifi_device_with_mac(macAddr)) goto error;
                 devmgr->_mux->delete_wifi_pairing_device_with_ip(addrs);
@@ -216,4 +271,11 @@ error:
     }
 }
 
+void avahi_sweep_callback(AvahiTimeout *t, void *userdata) noexcept{
+    WIFIDeviceManager *devmgr = (WIFIDeviceManager*)userdata;
+    struct timeval tv = {};
+    devmgr->sweep_services();
+    avahi_simple_poll_get(devmgr->_simple_poll)->timeout_update(t, avahi_elapse_time(&tv, WIFISERVICECACHE_SWEEP_INTERVAL_SEC*1000, 0));
+}
+
 #endif //HAVE_WIFI_SUPPORT
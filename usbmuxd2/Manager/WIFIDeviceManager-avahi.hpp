@@ -13,6 +13,8 @@
 #include "../Muxer.hpp"
 #include "DeviceManager.hpp"
 #include "../Devices/WIFIDevice.hpp"
+#include "WIFIHeartbeatManager.hpp"
+#include "WIFIServiceCache.hpp"
 
 #include <libgeneral/DeliveryEvent.hpp>
 
@@ -27,21 +29,26 @@ private:
     tihmstar::Event _childrenEvent;
     std::thread _devReaperThread;
     tihmstar::DeliveryEvent<std::shared_ptr<WIFIDevice>> _reapDevices;
+    WIFIHeartbeatManager *_heartbeats;
+    WIFIServiceCache _services;
 
     AvahiSimplePoll *_simple_poll;
     AvahiClient *_avahi_client;
     AvahiServiceBrowser *_avahi_sb;
     AvahiServiceBrowser *_avahi_sb2;
+    AvahiTimeout *_sweepTimeout;
 
     virtual bool loopEvent() override;
     virtual void stopAction() noexcept override;
 
     void reaper_runloop();
+    void sweep_services() noexcept;
 public:
     WIFIDeviceManager(Muxer *mux);
     virtual ~WIFIDeviceManager() override;
 
     void device_add(std::shared_ptr<WIFIDevice> dev, bool notify = true);
+    void device_evict(const std::string &uuid) noexcept;
 
     friend WIFIDevice;
     friend void avahi_client_callback(AvahiClient *c, AvahiClientState state, void* userdata) noexcept;
@@ -50,6 +57,7 @@ public:
     friend void avahi_resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol,
         AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name,
         const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void* userdata) noexcept;
+    friend void avahi_sweep_callback(AvahiTimeout *t, void *userdata) noexcept;
 };
 
 
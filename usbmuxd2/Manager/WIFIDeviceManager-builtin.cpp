@@ -0,0 +1,772 @@
+//
+//  WIFIDeviceManager-builtin.cpp
+//  usbmuxd2
+//
+
+#include <libgeneral/macros.h>
+
+#ifdef HAVE_WIFI_BUILTIN
+#include "WIFIDeviceManager-builtin.hpp"
+#include "../sysconf/sysconf.hpp"
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#pragma mark definitions
+
+#define DNS_TYPE_A      1
+#define DNS_TYPE_PTR    12
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_SRV    33
+#define DNS_CLASS_IN    1
+#define DNS_CLASS_FLUSH 0x8000  //cache-flush bit in mDNS answers
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_TC     0x0200
+#define DNS_RCODE_MASK  0x000F
+#define DNS_HEADER_SIZE 12
+
+static const char *gBrowseTypes[] = {
+    "_apple-mobdev2._tcp",
+    "_remotepairing-manual-pairing._tcp",
+};
+
+struct dns_rr{
+    std::vector<std::string> owner;
+    uint16_t type;
+    uint16_t cls;
+    uint32_t ttl;
+    size_t rdoff;
+    uint16_t rdlen;
+};
+
+#pragma mark helpers
+static std::string lowercase(std::string s){
+    for (auto &c : s) c = tolower((unsigned char)c);
+    return s;
+}
+
+static std::vector<std::string> split_name(const std::string &name){
+    std::vector<std::string> ret;
+    size_t pos = 0;
+    while (pos < name.size()) {
+        size_t dot = name.find('.', pos);
+        if (dot == std::string::npos) dot = name.size();
+        if (dot > pos) ret.push_back(name.substr(pos, dot-pos));
+        pos = dot+1;
+    }
+    return ret;
+}
+
+static std::string join_labels(const std::vector<std::string> &labels, size_t start = 0){
+    std::string ret;
+    for (size_t i=start; i<labels.size(); i++) {
+        if (i != start) ret += ".";
+        ret += labels[i];
+    }
+    return ret;
+}
+
+static std::vector<std::string> type_labels(const std::string &type){
+    std::vector<std::string> ret = split_name(type);
+    ret.push_back("local");
+    return ret;
+}
+
+static uint16_t rd16(const uint8_t *p){
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t rd32(const uint8_t *p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put16(std::vector<uint8_t> &pkt, uint16_t v){
+    pkt.push_back(v >> 8);
+    pkt.push_back(v & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &pkt, uint32_t v){
+    put16(pkt, v >> 16);
+    put16(pkt, v & 0xffff);
+}
+
+/*
+    Writes a name, pointing at an earlier occurrence of any of its suffixes.
+    offsets maps lowercase suffixes already in the packet to their position.
+ */
+static void put_name(std::vector<uint8_t> &pkt, const std::vector<std::string> &labels, std::map<std::string,uint16_t> &offsets){
+    for (size_t i=0; i<labels.size(); i++) {
+        std::string suffix = lowercase(join_labels(labels, i));
+        auto it = offsets.find(suffix);
+        if (it != offsets.end()) {
+            put16(pkt, 0xC000 | it->second);
+            return;
+        }
+        if (pkt.size() < 0x3FFF) offsets[suffix] = (uint16_t)pkt.size();
+        pkt.push_back((uint8_t)labels[i].size());
+        pkt.insert(pkt.end(), labels[i].begin(), labels[i].end());
+    }
+    pkt.push_back(0);
+}
+
+static bool read_name(const uint8_t *pkt, size_t len, size_t &off, std::vector<std::string> &labels){
+    size_t pos = off;
+    bool didJump = false;
+    int hops = 0;
+    labels.clear();
+    while (true) {
+        uint8_t l = 0;
+        if (pos >= len) return false;
+        l = pkt[pos];
+        if ((l & 0xC0) == 0xC0) {
+            if (pos+1 >= len || ++hops > 16) return false; //pointer loops
+            if (!didJump) off = pos+2;
+            didJump = true;
+            pos = ((l & 0x3F) << 8) | pkt[pos+1];
+            continue;
+        }
+        if (l & 0xC0) return false;
+        pos++;
+        if (!l) break;
+        if (pos+l > len || labels.size() >= 127) return false;
+        labels.emplace_back((const char*)&pkt[pos], l);
+        pos += l;
+    }
+    if (!didJump) off = pos;
+    return true;
+}
+
+#pragma mark WIFIDeviceManager
+WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
+: DeviceManager(mux), _heartbeats(NULL), _fd(-1), _wakePipe{-1,-1}, _dst{}, _isMulticast(false)
+, _queryInterval(WIFIBUILTIN_QUERY_INTERVAL_MIN_MS), _nextQuery(clock::now()), _nextSweep(clock::now())
+{
+    const char *envaddr = getenv("USBMUXD_MDNS_ADDR");
+    const char *envport = getenv("USBMUXD_MDNS_PORT");
+    struct sockaddr_in local = {};
+    int one = 1;
+    debug("WIFIDeviceManager builtin mDNS");
+
+    _dst.sin_family = AF_INET;
+    _dst.sin_port = htons(envport ? (uint16_t)atoi(envport) : WIFIBUILTIN_MDNS_PORT);
+    retassure(inet_pton(AF_INET, envaddr ? envaddr : WIFIBUILTIN_MDNS_GROUP, &_dst.sin_addr) == 1, "Invalid mDNS address '%s'",envaddr);
+    _isMulticast = IN_MULTICAST(ntohl(_dst.sin_addr.s_addr));
+
+    assure((_fd = socket(AF_INET, SOCK_DGRAM, 0)) != -1);
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(_fd, F_SETFD, FD_CLOEXEC);
+    //other responders on this host own port 5353 too
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif //SO_REUSEPORT
+#ifdef IP_PKTINFO
+    setsockopt(_fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+#endif //IP_PKTINFO
+
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (_isMulticast) {
+        unsigned char mttl = 255;
+        unsigned char mloop = 1;
+        local.sin_port = _dst.sin_port;
+        retassure(!bind(_fd, (struct sockaddr*)&local, sizeof(local)), "Failed to bind mDNS socket to port %d errno=%d (%s)",ntohs(local.sin_port),errno,strerror(errno));
+        setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl));
+        setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &mloop, sizeof(mloop));
+        refresh_interfaces();
+    } else {
+        //unicast target, it answers to whatever port we send from
+        local.sin_port = 0;
+        retassure(!bind(_fd, (struct sockaddr*)&local, sizeof(local)), "Failed to bind mDNS socket errno=%d (%s)",errno,strerror(errno));
+        info("WIFIDeviceManager builtin mDNS: querying %s:%d directly",envaddr,ntohs(_dst.sin_port));
+    }
+
+    assure(!pipe(_wakePipe));
+
+    _heartbeats = new WIFIHeartbeatManager();
+    _heartbeats->startLoop();
+
+    _devReaperThread = std::thread([this]{
+        reaper_runloop();
+    });
+}
+
+WIFIDeviceManager::~WIFIDeviceManager(){
+    stopLoop();
+    if (_children.size()) {
+        debug("waiting for wifi children to die...");
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        while (size_t s = _children.size()) {
+            for (auto c : _children) c->kill();
+            uint64_t wevent = _childrenEvent.getNextEvent();
+            ul.unlock();
+            debug("Need to kill %zu more wifi children",s);
+            _childrenEvent.waitForEvent(wevent);
+            ul.lock();
+        }
+    }
+    _reapDevices.kill();
+    _devReaperThread.join();
+    safeDelete(_heartbeats);
+    safeClose(_fd);
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+}
+
+void WIFIDeviceManager::device_add(std::shared_ptr<WIFIDevice> dev, bool notify){
+    dev->_selfref = dev;
+    _children.insert(dev.get());
+    _mux->add_device(dev, notify);
+}
+
+void WIFIDeviceManager::device_evict(const std::string &uuid) noexcept{
+    std::vector<std::shared_ptr<WIFIDevice>> devs;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        for (auto c : _children) {
+            if (uuid != c->_serial) continue;
+            if (std::shared_ptr<WIFIDevice> dev = c->_selfref.lock()) devs.push_back(std::move(dev));
+        }
+    }
+    //these may be the last references, ~WIFIDevice takes _childrenLck
+    for (auto &dev : devs) {
+        debug("evicting WIFIDevice %s, service went away",dev->_serial);
+        dev->kill();
+    }
+}
+
+bool WIFIDeviceManager::loopEvent(){
+    struct pollfd pfds[2] = {
+        {
+            .fd = _fd,
+            .events = POLLIN
+        },
+        {
+            .fd = _wakePipe[0],
+            .events = POLLIN
+        }
+    };
+    clock::time_point now = clock::now();
+    int timeout = WIFIBUILTIN_TICK_MS;
+    int res = 0;
+
+    if (_nextQuery <= now) {
+        timeout = 0;
+    } else {
+        int64_t untilQuery = std::chrono::duration_cast<std::chrono::milliseconds>(_nextQuery - now).count();
+        if (untilQuery < timeout) timeout = (int)untilQuery;
+    }
+
+    retassure((res = poll(pfds, 2, timeout)) != -1 || errno == EINTR, "poll() failed with errno=%d (%s)",errno,strerror(errno));
+    if (res > 0) {
+        if (pfds[1].revents) {
+            char buf[0x100];
+            ssize_t didRead = 0;
+            while ((didRead = read(_wakePipe[0], buf, sizeof(buf))) == -1 && errno == EINTR);
+            retassure(didRead != -1, "Failed to drain wake pipe errno=%d (%s)",errno,strerror(errno));
+        }
+        if (pfds[0].revents & POLLIN) {
+            //bounded, so a flood of packets can't keep us from sending queries
+            for (int i=0; i<64 && receive_packet(); i++);
+        }
+    }
+
+    now = clock::now();
+    expire_records(now);
+    if (now >= _nextSweep) {
+        sweep_services(now);
+        _nextSweep = now + std::chrono::seconds(WIFISERVICECACHE_SWEEP_INTERVAL_SEC);
+    }
+    for (auto &p : _ptrs) {
+        ptr_record &ptr = p.second;
+        if (!ptr.isResolved) try_resolve(p.first, ptr, now);
+        //RFC 6762 5.2: ask again before the record runs out
+        if (!ptr.didRefreshQuery && now >= ptr.received + std::chrono::milliseconds((uint64_t)ptr.ttl * 800)) {
+            ptr.didRefreshQuery = true;
+            if (_nextQuery > now) _nextQuery = now;
+        }
+    }
+    if (now >= _nextQuery) {
+        send_browse_query(now);
+        _nextQuery = now + std::chrono::milliseconds(_queryInterval);
+        _queryInterval = (_queryInterval*2 > WIFIBUILTIN_QUERY_INTERVAL_MAX_MS) ? WIFIBUILTIN_QUERY_INTERVAL_MAX_MS : _queryInterval*2;
+    }
+    return true;
+}
+
+void WIFIDeviceManager::stopAction() noexcept{
+    char c = 0;
+    while (write(_wakePipe[1], &c, 1) == -1) {
+        if (errno == EINTR) continue;
+        error("Failed to wake WIFIDeviceManager loop errno=%d (%s)",errno,strerror(errno));
+        break;
+    }
+}
+
+void WIFIDeviceManager::reaper_runloop(){
+    while (true) {
+        std::shared_ptr<WIFIDevice>dev;
+        try {
+            dev = _reapDevices.wait();
+        } catch (...) {
+            break;
+        }
+        //make device go out of scope so it can die in piece
+        dev->deconstruct();
+    }
+}
+
+#pragma mark mdns
+void WIFIDeviceManager::refresh_interfaces() noexcept{
+    struct ifaddrs *ifas = NULL;
+    cleanup([&]{
+        safeFreeCustom(ifas, freeifaddrs);
+    });
+    std::vector<struct in_addr> ifaddrs;
+
+    if (getifaddrs(&ifas)) {
+        error("getifaddrs failed with errno=%d (%s)",errno,strerror(errno));
+        return;
+    }
+    for (struct ifaddrs *ifa = ifas; ifa; ifa = ifa->ifa_next) {
+        struct ip_mreq mreq = {};
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET) continue;
+        if (!(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_MULTICAST) || (ifa->ifa_flags & IFF_LOOPBACK)) continue;
+        mreq.imr_multiaddr = _dst.sin_addr;
+        mreq.imr_interface = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        ifaddrs.push_back(mreq.imr_interface);
+        if (std::find_if(_ifaddrs.begin(), _ifaddrs.end(), [&](const struct in_addr &a){return a.s_addr == mreq.imr_interface.s_addr;}) != _ifaddrs.end()) continue;
+        if (setsockopt(_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) && errno != EADDRINUSE) {
+            debug("failed to join mDNS group on %s errno=%d (%s)",ifa->ifa_name,errno,strerror(errno));
+            ifaddrs.pop_back();
+            continue;
+        }
+        debug("joined mDNS group on %s",ifa->ifa_name);
+    }
+    _ifaddrs = ifaddrs;
+}
+
+void WIFIDeviceManager::send_packet(const std::vector<uint8_t> &pkt) noexcept{
+    if (!_isMulticast || !_ifaddrs.size()) {
+        if (sendto(_fd, pkt.data(), pkt.size(), 0, (struct sockaddr*)&_dst, sizeof(_dst)) == -1) {
+            debug("failed to send mDNS packet errno=%d (%s)",errno,strerror(errno));
+        }
+        return;
+    }
+    for (auto &ifaddr : _ifaddrs) {
+        setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+        if (sendto(_fd, pkt.data(), pkt.size(), 0, (struct sockaddr*)&_dst, sizeof(_dst)) == -1) {
+            debug("failed to send mDNS packet errno=%d (%s)",errno,strerror(errno));
+        }
+    }
+}
+
+void WIFIDeviceManager::send_browse_query(clock::time_point now) noexcept{
+    std::vector<std::pair<const ptr_record*,uint32_t>> knownAnswers;
+    size_t nextAnswer = 0;
+    bool isFirst = true;
+
+    if (_isMulticast) refresh_interfaces();
+
+    //RFC 6762 7.1: list answers we already have, unless they are past half their lifetime
+    for (auto &p : _ptrs) {
+        uint32_t remaining = (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(p.second.expires - now).count();
+        if (remaining*2 > p.second.ttl) knownAnswers.push_back({&p.second, remaining});
+    }
+
+    while (isFirst || nextAnswer < knownAnswers.size()) {
+        std::vector<uint8_t> pkt(DNS_HEADER_SIZE);
+        std::map<std::string,uint16_t> offsets;
+        uint16_t qdcount = 0;
+        uint16_t ancount = 0;
+
+        if (isFirst) {
+            for (auto type : gBrowseTypes) {
+                put_name(pkt, type_labels(type), offsets);
+                put16(pkt, DNS_TYPE_PTR);
+                put16(pkt, DNS_CLASS_IN);
+                qdcount++;
+            }
+        }
+        while (nextAnswer < knownAnswers.size()) {
+            const ptr_record *ptr = knownAnswers[nextAnswer].first;
+            std::vector<std::string> rdata = type_labels(ptr->type);
+            size_t mark = pkt.size();
+            size_t rdlenPos = 0;
+            rdata.insert(rdata.begin(), ptr->instance);
+            put_name(pkt, type_labels(ptr->type), offsets);
+            put16(pkt, DNS_TYPE_PTR);
+            put16(pkt, DNS_CLASS_IN);
+            put32(pkt, knownAnswers[nextAnswer].second);
+            rdlenPos = pkt.size();
+            put16(pkt, 0);
+            put_name(pkt, rdata, offsets);
+            pkt[rdlenPos] = (pkt.size() - rdlenPos - 2) >> 8;
+            pkt[rdlenPos+1] = (pkt.size() - rdlenPos - 2) & 0xff;
+            if (pkt.size() > WIFIBUILTIN_MAX_PACKET && (ancount || qdcount)) {
+                pkt.resize(mark); //doesn't fit anymore, goes into the next packet
+                break;
+            }
+            ancount++;
+            nextAnswer++;
+        }
+
+        //header: id 0, more known answers follow if TC is set
+        pkt[2] = (nextAnswer < knownAnswers.size()) ? (DNS_FLAG_TC >> 8) : 0;
+        pkt[4] = qdcount >> 8; pkt[5] = qdcount & 0xff;
+        pkt[6] = ancount >> 8; pkt[7] = ancount & 0xff;
+        send_packet(pkt);
+        isFirst = false;
+    }
+}
+
+void WIFIDeviceManager::send_resolve_query(const std::string &name, const ptr_record &ptr) noexcept{
+    std::vector<uint8_t> pkt(DNS_HEADER_SIZE);
+    std::map<std::string,uint16_t> offsets;
+    std::vector<std::string> instance = type_labels(ptr.type);
+    uint16_t qdcount = 0;
+
+    instance.insert(instance.begin(), ptr.instance);
+    put_name(pkt, instance, offsets);
+    put16(pkt, DNS_TYPE_SRV);
+    put16(pkt, DNS_CLASS_IN);
+    qdcount++;
+
+    {
+        auto srv = _srvs.find(name);
+        if (srv != _srvs.end()) {
+            for (uint16_t type : {DNS_TYPE_A, DNS_TYPE_AAAA}) {
+                put_name(pkt, split_name(srv->second.target), offsets);
+                put16(pkt, type);
+                put16(pkt, DNS_CLASS_IN);
+                qdcount++;
+            }
+        }
+    }
+    pkt[4] = qdcount >> 8; pkt[5] = qdcount & 0xff;
+    debug("resolving '%s'",name.c_str());
+    send_packet(pkt);
+}
+
+bool WIFIDeviceManager::receive_packet() noexcept{
+    uint8_t buf[9000]; //max mDNS message size (RFC 6762 17)
+    struct sockaddr_in src = {};
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = sizeof(buf)
+    };
+    char cbuf[0x100] = {};
+    struct msghdr msg = {};
+    ssize_t got = 0;
+    uint32_t interfaceIndex = 0;
+
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if ((got = recvmsg(_fd, &msg, 0)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            error("failed to receive mDNS packet errno=%d (%s)",errno,strerror(errno));
+        }
+        return false;
+    }
+#ifdef IP_PKTINFO
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            interfaceIndex = ((struct in_pktinfo*)CMSG_DATA(cmsg))->ipi_ifindex;
+        }
+    }
+#endif //IP_PKTINFO
+    //RFC 6762 6: responses come from the mDNS port, anything else is a legacy query or spoofed
+    if (src.sin_port != _dst.sin_port) return true;
+    process_packet(buf, (size_t)got, interfaceIndex);
+    return true;
+}
+
+void WIFIDeviceManager::process_packet(const uint8_t *buf, size_t len, uint32_t interfaceIndex) noexcept{
+    clock::time_point now = clock::now();
+    std::vector<dns_rr> rrs;
+    std::vector<std::string> labels;
+    size_t off = DNS_HEADER_SIZE;
+    uint16_t flags = 0;
+    uint32_t rrcount = 0;
+
+    if (len < DNS_HEADER_SIZE) return;
+    flags = rd16(&buf[2]);
+    if (!(flags & DNS_FLAG_QR) || (flags & DNS_RCODE_MASK)) return; //queries (including our own) and errors
+
+    for (uint16_t i=0, qdcount = rd16(&buf[4]); i<qdcount; i++) {
+        if (!read_name(buf, len, off, labels) || off+4 > len) return;
+        off += 4;
+    }
+    rrcount = (uint32_t)rd16(&buf[6]) + rd16(&buf[8]) + rd16(&buf[10]);
+    for (uint32_t i=0; i<rrcount; i++) {
+        dns_rr rr = {};
+        if (!read_name(buf, len, off, rr.owner) || off+10 > len) return;
+        rr.type = rd16(&buf[off]);
+        rr.cls = rd16(&buf[off+2]);
+        rr.ttl = rd32(&buf[off+4]);
+        rr.rdlen = rd16(&buf[off+8]);
+        off += 10;
+        if (off+rr.rdlen > len) return;
+        rr.rdoff = off;
+        off += rr.rdlen;
+        if ((rr.cls & ~DNS_CLASS_FLUSH) != DNS_CLASS_IN) continue;
+        rrs.push_back(rr);
+    }
+
+    //services first, addresses are only kept for hosts a service points to
+    for (auto &rr : rrs) {
+        std::string owner = lowercase(join_labels(rr.owner));
+        size_t rdoff = rr.rdoff;
+        if (rr.type == DNS_TYPE_PTR) {
+            for (auto type : gBrowseTypes) {
+                if (owner != lowercase(type) + ".local") continue;
+                if (!read_name(buf, len, rdoff, labels)) break;
+                ptr_received(labels, type, rr.ttl, interfaceIndex, now);
+                break;
+            }
+        } else if (rr.type == DNS_TYPE_SRV && rr.rdlen > 6) {
+            bool isBrowsed = false;
+            for (auto type : gBrowseTypes) {
+                std::string suffix = "." + lowercase(type) + ".local";
+                if (owner.size() > suffix.size() && !owner.compare(owner.size()-suffix.size(), suffix.size(), suffix)) isBrowsed = true;
+            }
+            if (!isBrowsed) continue;
+            rdoff += 6; //priority, weight, port
+            if (!read_name(buf, len, rdoff, labels)) continue;
+            if (!rr.ttl) {
+                _srvs.erase(owner);
+            } else {
+                _srvs[owner] = {lowercase(join_labels(labels)), now + std::chrono::seconds(rr.ttl)};
+            }
+        }
+    }
+    for (auto &rr : rrs) {
+        char addr[INET6_ADDRSTRLEN] = {};
+        std::string owner;
+        bool isTarget = false;
+        if (rr.type == DNS_TYPE_A && rr.rdlen == 4) {
+            inet_ntop(AF_INET, &buf[rr.rdoff], addr, sizeof(addr));
+        } else if (rr.type == DNS_TYPE_AAAA && rr.rdlen == 16) {
+            inet_ntop(AF_INET6, &buf[rr.rdoff], addr, sizeof(addr));
+        } else {
+            continue;
+        }
+        owner = lowercase(join_labels(rr.owner));
+        for (auto &s : _srvs) {
+            if (s.second.target == owner) {
+                isTarget = true;
+                break;
+            }
+        }
+        if (!isTarget) continue;
+        addr_received(owner, addr, rr.ttl, rr.cls & DNS_CLASS_FLUSH, now);
+    }
+
+    for (auto &p : _ptrs) {
+        if (!p.second.isResolved) try_resolve(p.first, p.second, now);
+    }
+}
+
+void WIFIDeviceManager::ptr_received(const std::vector<std::string> &rdata, const std::string &type, uint32_t ttl, uint32_t interfaceIndex, clock::time_point now) noexcept{
+    std::string name = lowercase(join_labels(rdata));
+    if (rdata.size() < 2 || name != lowercase(rdata[0] + "." + type + ".local")) return; //not an instance of this type
+    auto it = _ptrs.find(name);
+
+    if (!ttl) {
+        //goodbye
+        if (it != _ptrs.end()) {
+            debug("service '%s' said goodbye",name.c_str());
+            service_lost(it->second);
+            _ptrs.erase(it);
+        }
+        return;
+    }
+    if (it != _ptrs.end()) {
+        ptr_record &ptr = it->second;
+        ptr.ttl = ttl;
+        ptr.interfaceIndex = interfaceIndex;
+        ptr.received = now;
+        ptr.expires = now + std::chrono::seconds(ttl);
+        ptr.didRefreshQuery = false;
+        if (!ptr.isResolved) {
+            ptr.resolveTries = 0;
+            ptr.nextResolve = now;
+        }
+        return;
+    }
+
+    {
+        ptr_record ptr = {
+            .type = type,
+            .instance = rdata[0],
+            .ttl = ttl,
+            .interfaceIndex = interfaceIndex,
+            .received = now,
+            .expires = now + std::chrono::seconds(ttl),
+            .didRefreshQuery = false,
+            .isResolved = false,
+            .resolveTries = 0,
+            .nextResolve = now
+        };
+        debug("found service '%s'",name.c_str());
+        if (!_services.shouldResolve(WIFIServiceCache::key(ptr.instance.c_str(), ptr.type.c_str()), {ptr.instance, ptr.type, "local", (int32_t)interfaceIndex, 0})) ptr.isResolved = true;
+        _ptrs[name] = ptr;
+    }
+}
+
+void WIFIDeviceManager::addr_received(const std::string &host, const std::string &addr, uint32_t ttl, bool cacheFlush, clock::time_point now) noexcept{
+    std::vector<addr_record> &addrs = _addrs[host];
+    if (cacheFlush) {
+        //RFC 6762 10.2: the sender has the full set, drop what we've had for more than a second
+        addrs.erase(std::remove_if(addrs.begin(), addrs.end(), [&](const addr_record &a){
+            return a.addr != addr && now - a.received > std::chrono::seconds(1);
+        }), addrs.end());
+    }
+    {
+        auto it = std::find_if(addrs.begin(), addrs.end(), [&](const addr_record &a){return a.addr == addr;});
+        if (!ttl) {
+            if (it != addrs.end()) addrs.erase(it);
+        } else if (it != addrs.end()) {
+            it->received = now;
+            it->expires = now + std::chrono::seconds(ttl);
+        } else {
+            addrs.push_back({addr, now, now + std::chrono::seconds(ttl)});
+        }
+    }
+    if (!addrs.size()) _addrs.erase(host);
+}
+
+void WIFIDeviceManager::expire_records(clock::time_point now) noexcept{
+    for (auto it = _ptrs.begin(); it != _ptrs.end();) {
+        if (it->second.expires <= now) {
+            debug("service '%s' expired",it->first.c_str());
+            service_lost(it->second);
+            it = _ptrs.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (auto it = _srvs.begin(); it != _srvs.end();) {
+        if (it->second.expires <= now) {
+            it = _srvs.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (auto it = _addrs.begin(); it != _addrs.end();) {
+        auto &addrs = it->second;
+        addrs.erase(std::remove_if(addrs.begin(), addrs.end(), [&](const addr_record &a){return a.expires <= now;}), addrs.end());
+        if (!addrs.size()) {
+            it = _addrs.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void WIFIDeviceManager::sweep_services(clock::time_point now) noexcept{
+    std::vector<WIFIServiceCache::service_ref> refresh;
+    std::vector<std::string> evict;
+    _services.sweep(refresh, evict);
+    for (auto &ref : refresh) {
+        auto it = std::find_if(_ptrs.begin(), _ptrs.end(), [&](const std::pair<const std::string,ptr_record> &p){
+            return p.second.instance == ref.name && p.second.type == ref.type;
+        });
+        if (it == _ptrs.end()) {
+            _services.resolveFailed(WIFIServiceCache::key(ref.name.c_str(), ref.type.c_str()));
+            continue;
+        }
+        //picked up by try_resolve in the same loop iteration
+        it->second.isResolved = false;
+        it->second.resolveTries = 0;
+        it->second.nextResolve = now;
+    }
+    for (auto &uuid : evict) {
+        device_evict(uuid);
+    }
+}
+
+void WIFIDeviceManager::try_resolve(const std::string &name, ptr_record &ptr, clock::time_point now) noexcept{
+    {
+        auto srv = _srvs.find(name);
+        auto addrs = (srv != _srvs.end()) ? _addrs.find(srv->second.target) : _addrs.end();
+        if (addrs != _addrs.end()) {
+            std::vector<std::string> ips;
+            for (auto &a : addrs->second) {
+                ips.push_back(a.addr);
+            }
+            ptr.isResolved = true;
+            service_found(ptr, ips);
+            return;
+        }
+    }
+    if (now < ptr.nextResolve) return;
+    if (ptr.resolveTries >= WIFIBUILTIN_RESOLVE_TRIES) {
+        debug("failed to resolve '%s'",name.c_str());
+        _services.resolveFailed(WIFIServiceCache::key(ptr.instance.c_str(), ptr.type.c_str()));
+        ptr.nextResolve = clock::time_point::max(); //until it is announced again
+        return;
+    }
+    ptr.resolveTries++;
+    ptr.nextResolve = now + std::chrono::milliseconds(WIFIBUILTIN_RESOLVE_RETRY_MS);
+    send_resolve_query(name, ptr);
+}
+
+void WIFIDeviceManager::service_found(const ptr_record &ptr, const std::vector<std::string> &addrs) noexcept{
+    std::string serviceName = WIFIServiceCache::key(ptr.instance.c_str(), ptr.type.c_str());
+    std::string macAddr{serviceName.substr(0,serviceName.find("@"))};
+    std::string uuid;
+    bool notifyadd = true;
+
+    debug("Service '%s' resolved",serviceName.c_str());
+    if (ptr.type == "_remotepairing-manual-pairing._tcp") {
+        uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
+        macAddr = {};
+        _services.resolved(serviceName, uuid);
+        if (_mux->have_wifi_device_with_ip(addrs)) return;
+        notifyadd = false;
+    }else{
+        try{
+            uuid = sysconf_udid_for_macaddr(macAddr);
+        }catch (tihmstar::exception &e){
+            debug("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
+            _services.resolved(serviceName, {}); //not one of ours, don't resolve it again right away
+            return;
+        }
+        _services.resolved(serviceName, uuid);
+        if (_mux->have_wifi_device_with_mac(macAddr)) return;
+        _mux->delete_wifi_pairing_device_with_ip(addrs);
+        notifyadd = true;
+    }
+
+    {
+        std::shared_ptr<WIFIDevice> dev = nullptr;
+        try{
+            dev = std::make_shared<WIFIDevice>(_mux, this, uuid, addrs, serviceName, ptr.interfaceIndex);
+            device_add(dev, notifyadd); dev = NULL;
+        } catch (tihmstar::exception &e){
+            error("failed to construct device with error=%d (%s)",e.code(),e.what());
+        }
+    }
+}
+
+void WIFIDeviceManager::service_lost(const ptr_record &ptr) noexcept{
+    std::string uuid = _services.remove(WIFIServiceCache::key(ptr.instance.c_str(), ptr.type.c_str()));
+    if (uuid.size()) device_evict(uuid);
+}
+
+#endif //HAVE_WIFI_BUILTIN
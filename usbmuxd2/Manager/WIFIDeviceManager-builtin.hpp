@@ -0,0 +1,109 @@
+//
+//  WIFIDeviceManager-builtin.hpp
+//  usbmuxd2
+//
+
+#ifndef WIFIDeviceManager_builtin_hpp
+#define WIFIDeviceManager_builtin_hpp
+
+#include "../Muxer.hpp"
+#include "DeviceManager.hpp"
+#include "../Devices/WIFIDevice.hpp"
+#include "WIFIHeartbeatManager.hpp"
+#include "WIFIServiceCache.hpp"
+
+#include <libgeneral/DeliveryEvent.hpp>
+
+#include <netinet/in.h>
+#include <chrono>
+#include <map>
+
+#define WIFIBUILTIN_MDNS_GROUP "224.0.0.251"
+#define WIFIBUILTIN_MDNS_PORT 5353
+#define WIFIBUILTIN_QUERY_INTERVAL_MIN_MS 1000              //RFC 6762 5.2: start at one second,
+#define WIFIBUILTIN_QUERY_INTERVAL_MAX_MS (60*60*1000)      //double every time, up to one hour
+#define WIFIBUILTIN_RESOLVE_RETRY_MS 1000
+#define WIFIBUILTIN_RESOLVE_TRIES 3
+#define WIFIBUILTIN_MAX_PACKET 1440                         //stay below a single ethernet frame
+#define WIFIBUILTIN_TICK_MS 1000                            //upper bound for how long the loop sleeps
+
+/*
+    Browses for devices by speaking multicast DNS directly, no avahi-daemon or dns_sd required.
+    The group and port can be overridden with USBMUXD_MDNS_ADDR and USBMUXD_MDNS_PORT.
+    A unicast address there makes us query that host directly, which is meant for a local fake responder.
+ */
+class WIFIDeviceManager : public DeviceManager{
+    typedef std::chrono::steady_clock clock;
+    struct ptr_record{
+        std::string type;       //e.g. "_apple-mobdev2._tcp"
+        std::string instance;   //instance label as advertised
+        uint32_t ttl;
+        uint32_t interfaceIndex;
+        clock::time_point received;
+        clock::time_point expires;
+        bool didRefreshQuery;   //asked again at 80% of ttl
+        bool isResolved;
+        int resolveTries;
+        clock::time_point nextResolve;
+    };
+    struct srv_record{
+        std::string target;     //lowercase host name
+        clock::time_point expires;
+    };
+    struct addr_record{
+        std::string addr;
+        clock::time_point received;
+        clock::time_point expires;
+    };
+private:
+    std::set<WIFIDevice *> _children;  //raw ptr to shared objec
+    std::mutex _childrenLck;
+    tihmstar::Event _childrenEvent;
+    std::thread _devReaperThread;
+    tihmstar::DeliveryEvent<std::shared_ptr<WIFIDevice>> _reapDevices;
+    WIFIHeartbeatManager *_heartbeats;
+    WIFIServiceCache _services;
+
+    int _fd;
+    int _wakePipe[2];
+    struct sockaddr_in _dst;
+    bool _isMulticast;
+    std::vector<struct in_addr> _ifaddrs; //interfaces we joined the group on
+    uint32_t _queryInterval; //ms
+    clock::time_point _nextQuery;
+    clock::time_point _nextSweep;
+    std::map<std::string,ptr_record> _ptrs;                 //lowercase instance name -> record
+    std::map<std::string,srv_record> _srvs;                 //lowercase instance name -> record
+    std::map<std::string,std::vector<addr_record>> _addrs;  //lowercase host name -> records
+
+    virtual bool loopEvent() override;
+    virtual void stopAction() noexcept override;
+
+    void reaper_runloop();
+
+#pragma mark mdns
+    void refresh_interfaces() noexcept;
+    void send_packet(const std::vector<uint8_t> &pkt) noexcept;
+    void send_browse_query(clock::time_point now) noexcept;
+    void send_resolve_query(const std::string &name, const ptr_record &ptr) noexcept;
+    bool receive_packet() noexcept;
+    void process_packet(const uint8_t *buf, size_t len, uint32_t interfaceIndex) noexcept;
+    void ptr_received(const std::vector<std::string> &rdata, const std::string &type, uint32_t ttl, uint32_t interfaceIndex, clock::time_point now) noexcept;
+    void addr_received(const std::string &host, const std::string &addr, uint32_t ttl, bool cacheFlush, clock::time_point now) noexcept;
+    void expire_records(clock::time_point now) noexcept;
+    void sweep_services(clock::time_point now) noexcept;
+    void try_resolve(const std::string &name, ptr_record &ptr, clock::time_point now) noexcept;
+    void service_found(const ptr_record &ptr, const std::vector<std::string> &addrs) noexcept;
+    void service_lost(const ptr_record &ptr) noexcept;
+
+public:
+    WIFIDeviceManager(Muxer *mux);
+    virtual ~WIFIDeviceManager() override;
+
+    void device_add(std::shared_ptr<WIFIDevice> dev, bool notify = true);
+    void device_evict(const std::string &uuid) noexcept;
+
+    friend WIFIDevice;
+};
+
+#endif /* WIFIDeviceManager_builtin_hpp */
@@ -42,6 +42,11 @@ void getaddr_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfac
     WIFIDeviceManager *devmgr = (WIFIDeviceManager *)context;
     
     std::vector<std::string> &addrs = devmgr->_clientAddrs[sdRef];
+    std::string service;
+    {
+        auto it = devmgr->_serviceKeys.find(devmgr->_linkedClients[sdRef]);
+        if (it != devmgr->_serviceKeys.end()) service = it->second;
+    }
 
     std::string ipaddr;
     ipaddr.resize(INET6_ADDRSTRLEN+1);
@@ -63,14 +68,17 @@ void getaddr_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfac
         if (strstr(serviceName.c_str(), "_remotepairing-manual-pairing._tcp")) {
             uuid = "WIFIPAIR-"+serviceName.substr(0,serviceName.find("."));
             macAddr = {};
+            devmgr->_services.resolved(service, uuid, ttl);
             if (devmgr->_mux->have_wifi_device_with_ip(addrs)) goto error;
             notifyadd = false;
         }else{
             try{
                 uuid = sysconf_udid_for_macaddr(macAddr);
             }catch (tihmstar::exception &e){
+                devmgr->_services.resolved(service, {}, ttl); //not one of ours, don't resolve it again right away
                 creterror("failed to find uuid for mac=%s with error=%d (%s)",macAddr.c_str(),e.code(),e.what());
             }
+            devmgr->_services.resolved(service, uuid, ttl);
             if (devmgr->_mux->have_wifi_device_with_mac(macAddr)) goto error;
             devmgr->_mux->delete_wifi_pairing_device_with_ip(addrs);
             notifyadd = true;
@@ -92,6 +100,7 @@ error:
         devmgr->_clientAddrs.erase(sdRef);
         DNSServiceRef sdResolv = devmgr->_linkedClients[sdRef];
         devmgr->_linkedClients.erase(sdRef);
+        devmgr->_serviceKeys.erase(sdResolv);
         devmgr->_removeClients.push_back(sdRef); //idk why, but order is important!
         devmgr->_removeClients.push_back(sdResolv);
     }
@@ -123,6 +132,8 @@ void resolve_reply(DNSServiceRef sdRef, DNSServiceFlags flags, uint32_t interfac
 error:
     if (err) {
         error("resolve_reply failed with error=%d",err);
+        auto it = devmgr->_serviceKeys.find(sdRef);
+        if (it != devmgr->_serviceKeys.end()) devmgr->_services.resolveFailed(it->second);
     }
 }
 
@@ -133,15 +144,19 @@ void browse_reply(DNSServiceRef sdref, const DNSServiceFlags flags, uint32_t ifI
     DNSServiceRef resolvClient = NULL;
     int resolvfd = -1;
 
-    if (!(flags & kDNSServiceFlagsAdd)) {
-//        debug("ignoring event=%d. We only care about Add events at the moment",flags);
-        return;
-    }
-    
+    std::string service = WIFIServiceCache::key(replyName, replyType);
+
     const char *op = (flags & kDNSServiceFlagsAdd) ? "Add" : "Rmv";
     debug("%s %8X %3d %-20s %-20s %s",
            op, flags, ifIndex, replyDomain, replyType, replyName);
-    
+
+    if (!(flags & kDNSServiceFlagsAdd)) {
+        std::string uuid = devmgr->_services.remove(service);
+        if (uuid.size()) devmgr->device_evict(uuid);
+        return;
+    }
+    if (!devmgr->_services.shouldResolve(service, {replyName, replyType, replyDomain, (int32_t)ifIndex, 0})) return;
+
     cassure(!(res = DNSServiceResolve(&resolvClient, 0, kDNSServiceInterfaceIndexAny, replyName, replyType, replyDomain, resolve_reply, context)));
 
     cassure((resolvfd = DNSServiceRefSockFD(resolvClient))>0);
@@ -153,9 +168,11 @@ void browse_reply(DNSServiceRef sdref, const DNSServiceFlags flags, uint32_t ifI
 error:
     if (resolvClient){
         devmgr->_resolveClients.push_back(resolvClient);
+        devmgr->_serviceKeys[resolvClient] = service;
     }
     if (err) {
         error("browse_reply failed with error=%d",err);
+        devmgr->_services.resolveFailed(service);
     }
 }
 
@@ -163,7 +180,7 @@ error:
 #pragma mark WIFIDevice
 
 WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
-: DeviceManager(mux), _client(NULL), _clientPairing(NULL), _dns_sd_fd(-1), _dns_sd_pairing_fd(-1), _wakePipe{}
+: DeviceManager(mux), _heartbeats(NULL), _client(NULL), _clientPairing(NULL), _dns_sd_fd(-1), _dns_sd_pairing_fd(-1), _wakePipe{}
 {
     int err = 0;
     debug("WIFIDeviceManager mDNS-client");
@@ -178,7 +195,10 @@ WIFIDeviceManager::WIFIDeviceManager(Muxer *mux)
 
     assure(!pipe(_wakePipe));
     _pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
-    
+
+    _heartbeats = new WIFIHeartbeatManager();
+    _heartbeats->startLoop();
+
     _devReaperThread = std::thread([this]{
         reaper_runloop();
     });
@@ -200,6 +220,7 @@ WIFIDeviceManager::~WIFIDeviceManager(){
     }
     _reapDevices.kill();
     _devReaperThread.join();
+    safeDelete(_heartbeats);
     {
         for (auto rc : _resolveClients) 
             safeFreeCustom(rc, DNSServiceRefDeallocate);
@@ -217,9 +238,62 @@ void WIFIDeviceManager::device_add(std::shared_ptr<WIFIDevice> dev, bool notify)
     _mux->add_device(dev, notify);
 }
 
+void WIFIDeviceManager::device_evict(const std::string &uuid) noexcept{
+    std::vector<std::shared_ptr<WIFIDevice>> devs;
+    {
+        std::unique_lock<std::mutex> ul(_childrenLck);
+        for (auto c : _children) {
+            if (uuid != c->_serial) continue;
+            if (std::shared_ptr<WIFIDevice> dev = c->_selfref.lock()) devs.push_back(std::move(dev));
+        }
+    }
+    //these may be the last references, ~WIFIDevice takes _childrenLck
+    for (auto &dev : devs) {
+        debug("evicting WIFIDevice %s, service went away",dev->_serial);
+        dev->kill();
+    }
+}
+
+void WIFIDeviceManager::sweep_services() noexcept{
+    std::vector<WIFIServiceCache::service_ref> refresh;
+    std::vector<std::string> evict;
+    _services.sweep(refresh, evict);
+    for (auto &ref : refresh) {
+        std::string service = WIFIServiceCache::key(ref.name.c_str(), ref.type.c_str());
+        DNSServiceRef resolvClient = NULL;
+        int resolvfd = -1;
+        DNSServiceErrorType res = 0;
+        if ((res = DNSServiceResolve(&resolvClient, 0, kDNSServiceInterfaceIndexAny, ref.name.c_str(), ref.type.c_str(), ref.domain.c_str(), resolve_reply, this))
+            || (resolvfd = DNSServiceRefSockFD(resolvClient)) <= 0) {
+            error("failed to resolve '%s' again with error=%d",service.c_str(),res);
+            safeFreeCustom(resolvClient, DNSServiceRefDeallocate);
+            _services.resolveFailed(service);
+            continue;
+        }
+        _pfds.push_back({
+            .fd = resolvfd,
+            .events = POLLIN
+        });
+        _resolveClients.push_back(resolvClient);
+        _serviceKeys[resolvClient] = service;
+    }
+    for (auto &uuid : evict) {
+        device_evict(uuid);
+    }
+}
+
 bool WIFIDeviceManager::loopEvent(){
     int res = 0;
-    res = poll(_pfds.data(), (int)_pfds.size(), -1);
+    int timeout = 0;
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= _nextSweep) {
+            sweep_services();
+            _nextSweep = now + std::chrono::seconds(WIFISERVICECACHE_SWEEP_INTERVAL_SEC);
+        }
+        timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(_nextSweep - now).count();
+    }
+    res = poll(_pfds.data(), (int)_pfds.size(), timeout);
     if (res > 0){
         cleanup([&]{
             for (auto &rc : _removeClients) {
@@ -227,6 +301,7 @@ bool WIFIDeviceManager::loopEvent(){
                 if (target != _resolveClients.end()){
                     DNSServiceRef tgt = *target;
                     _resolveClients.erase(target, _resolveClients.end());
+                    _serviceKeys.erase(tgt);
                     DNSServiceRefDeallocate(tgt);
                 }
             }
@@ -12,10 +12,13 @@
 #include "../Muxer.hpp"
 #include "DeviceManager.hpp"
 #include "../Devices/WIFIDevice.hpp"
+#include "WIFIHeartbeatManager.hpp"
+#include "WIFIServiceCache.hpp"
 
 #include <libgeneral/DeliveryEvent.hpp>
 
 #include <map>
+#include <chrono>
 
 #include <poll.h>
 
@@ -100,6 +103,8 @@ private:
     tihmstar::Event _childrenEvent;
     std::thread _devReaperThread;
     tihmstar::DeliveryEvent<std::shared_ptr<WIFIDevice>> _reapDevices;
+    WIFIHeartbeatManager *_heartbeats;
+    WIFIServiceCache _services;
     
     DNSServiceRef _client;
     DNSServiceRef _clientPairing;
@@ -111,16 +116,20 @@ private:
     std::vector<struct pollfd> _pfds;
     std::map<DNSServiceRef, DNSServiceRef> _linkedClients;
     std::map<DNSServiceRef, std::vector<std::string>> _clientAddrs;
+    std::map<DNSServiceRef, std::string> _serviceKeys; //resolve client -> WIFIServiceCache key
+    std::chrono::steady_clock::time_point _nextSweep;
 
     virtual bool loopEvent() override;
     virtual void stopAction() noexcept override;
 
     void reaper_runloop();
+    void sweep_services() noexcept;
 public:
     WIFIDeviceManager(Muxer *mux);
     virtual ~WIFIDeviceManager() override;
         
     void device_add(std::shared_ptr<WIFIDevice> dev, bool notify = true);
+    void device_evict(const std::string &uuid) noexcept;
     
     friend WIFIDevice;
     friend void browse_reply(DNSServiceRef sdref, const DNSServiceFlags flags, uint32_t ifIndex, DNSServiceErrorType errorCode, const char *replyName, const char *replyType, const char *replyDomain, void *context) noexcept;
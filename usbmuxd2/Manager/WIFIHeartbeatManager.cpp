@@ -0,0 +1,253 @@
+//
+//  WIFIHeartbeatManager.cpp
+//  usbmuxd2
+//
+
+#include <libgeneral/macros.h>
+
+#ifdef HAVE_LIBIMOBILEDEVICE
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
+#include "WIFIHeartbeatManager.hpp"
+#include "../Devices/WIFIDevice.hpp"
+#include "../Muxer.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#endif //HAVE_SYS_EPOLL_H
+
+static uint64_t monotonic_ms(){
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+#pragma mark WIFIHeartbeatManager
+WIFIHeartbeatManager::WIFIHeartbeatManager()
+: _starters(NULL)
+, _wheelTick(0), _epoch(monotonic_ms())
+, _wakePipe{-1,-1}
+#ifdef HAVE_SYS_EPOLL_H
+, _epfd(-1)
+#endif //HAVE_SYS_EPOLL_H
+{
+    _starters = new WorkerPool(WIFIHEARTBEAT_STARTER_THREADS);
+    assure(!pipe(_wakePipe));
+    fcntl(_wakePipe[0], F_SETFL, fcntl(_wakePipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(_wakePipe[1], F_SETFL, fcntl(_wakePipe[1], F_GETFL) | O_NONBLOCK);
+#ifdef HAVE_SYS_EPOLL_H
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = _wakePipe[0];
+        assure((_epfd = epoll_create1(EPOLL_CLOEXEC)) != -1);
+        assure(!epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakePipe[0], &ev));
+    }
+#endif //HAVE_SYS_EPOLL_H
+}
+
+WIFIHeartbeatManager::~WIFIHeartbeatManager(){
+    //a start_session still running (lockdown handshakes take a while) uses everything below
+    safeDelete(_starters);
+    stopLoop();
+#ifdef HAVE_SYS_EPOLL_H
+    safeClose(_epfd);
+#endif //HAVE_SYS_EPOLL_H
+    safeClose(_wakePipe[0]);
+    safeClose(_wakePipe[1]);
+}
+
+#pragma mark inheritance function
+bool WIFIHeartbeatManager::loopEvent(){
+    std::vector<int> ready;
+    int cnt = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event evs[WIFIHEARTBEAT_MAX_EVENTS];
+    retassure((cnt = epoll_wait(_epfd, evs, WIFIHEARTBEAT_MAX_EVENTS, WIFIHEARTBEAT_WHEEL_TICK_MS)) != -1 || errno == EINTR, "[WIFIHeartbeatManager] epoll_wait failed errno=%d (%s)",errno,strerror(errno));
+    for (int i=0; i<cnt; i++) {
+        ready.push_back(evs[i].data.fd);
+    }
+#else
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({.fd = _wakePipe[0], .events = POLLIN});
+    {
+        std::unique_lock<std::mutex> ul(_sessionsLck);
+        for (auto &s : _sessions) {
+            pfds.push_back({.fd = s.first, .events = POLLIN});
+        }
+    }
+    retassure((cnt = poll(pfds.data(), (int)pfds.size(), WIFIHEARTBEAT_WHEEL_TICK_MS)) != -1 || errno == EINTR, "[WIFIHeartbeatManager] poll failed errno=%d (%s)",errno,strerror(errno));
+    for (auto &p : pfds) {
+        if (p.revents) ready.push_back(p.fd);
+    }
+#endif //HAVE_SYS_EPOLL_H
+
+    for (int fd : ready) {
+        if (fd == _wakePipe[0]) {
+            char buf[0x100];
+            while (read(_wakePipe[0], buf, sizeof(buf)) > 0);
+            continue;
+        }
+        handle_session(fd);
+    }
+    expire_timers();
+    return true;
+}
+
+void WIFIHeartbeatManager::stopAction() noexcept{
+    wake_loop();
+}
+
+#pragma mark private
+uint64_t WIFIHeartbeatManager::now_tick() noexcept{
+    return (monotonic_ms() - _epoch) / WIFIHEARTBEAT_WHEEL_TICK_MS;
+}
+
+void WIFIHeartbeatManager::wake_loop() noexcept{
+    char c = 0;
+    while (write(_wakePipe[1], &c, 1) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: pipe is full, the loop is going to wake up anyway
+        if (errno != EAGAIN) error("[WIFIHeartbeatManager] failed to wake loop errno=%d (%s)",errno,strerror(errno));
+        break;
+    }
+}
+
+void WIFIHeartbeatManager::arm_nolock(int fd, session &s) noexcept{
+    static_assert(WIFIHEARTBEAT_TIMEOUT_MS / WIFIHEARTBEAT_WHEEL_TICK_MS < WIFIHEARTBEAT_WHEEL_SLOTS, "timer wheel too small for heartbeat timeout");
+    //the previous entry stays in the wheel, it no longer matches s.deadline and is dropped when its slot comes up
+    s.deadline = now_tick() + (WIFIHEARTBEAT_TIMEOUT_MS + WIFIHEARTBEAT_WHEEL_TICK_MS - 1) / WIFIHEARTBEAT_WHEEL_TICK_MS;
+    _wheel[s.deadline % WIFIHEARTBEAT_WHEEL_SLOTS].push_back({fd, s.deadline});
+}
+
+void WIFIHeartbeatManager::unregister_nolock(int fd) noexcept{
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif //HAVE_SYS_EPOLL_H
+    _sessions.erase(fd);
+}
+
+void WIFIHeartbeatManager::start_session(std::shared_ptr<WIFIDevice> dev) noexcept{
+    int fd = -1;
+    try {
+        fd = dev->connect_heartbeat();
+    } catch (tihmstar::exception &e) {
+        error("Failed to start heartbeat for WIFIDevice %s with error=%d (%s)",dev->_serial,e.code(),e.what());
+        dev->_mux->heartbeat_failed(dev);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_sessionsLck);
+        if (dev->_hbDetached) return; //device went away while we were connecting
+        dev->_hbfd = fd; //remove() reads it under the same lock
+        auto &s = _sessions[fd];
+        s.dev = dev.get();
+        s.devref = dev;
+        arm_nolock(fd, s);
+#ifdef HAVE_SYS_EPOLL_H
+        {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+                error("Failed to watch heartbeat of WIFIDevice %s errno=%d (%s)",dev->_serial,errno,strerror(errno));
+                _sessions.erase(fd);
+                ul.unlock();
+                dev->kill();
+                return;
+            }
+        }
+#else
+        wake_loop(); //poll() needs to pick up the new fd
+#endif //HAVE_SYS_EPOLL_H
+    }
+    debug("[WIFIHeartbeatManager] started heartbeat for %s",dev->_serial);
+}
+
+void WIFIHeartbeatManager::handle_session(int fd) noexcept{
+    std::shared_ptr<WIFIDevice> dev;
+    bool didHandle = false;
+    bool failed = false;
+    {
+        std::unique_lock<std::mutex> ul(_sessionsLck);
+        auto it = _sessions.find(fd);
+        if (it == _sessions.end()) return; //removed in the meantime
+        if (!(dev = it->second.devref.lock())) return; //device is going away, it unregisters itself
+    }
+    //no lock held while talking to the device, remove() and starting sessions must never wait for it
+    try {
+        didHandle = dev->heartbeat_receive();
+    } catch (tihmstar::exception &e) {
+        error("[WIFIHeartbeatManager] heartbeat of %s failed with error=%d (%s)",dev->_serial,e.code(),e.what());
+        failed = true;
+    }
+    {
+        std::unique_lock<std::mutex> ul(_sessionsLck);
+        auto it = _sessions.find(fd);
+        //the fd may have been reused by another device's session while we were reading
+        if (it != _sessions.end() && it->second.dev == dev.get()) {
+            if (failed) {
+                unregister_nolock(fd);
+            } else if (didHandle) {
+                arm_nolock(fd, it->second);
+            }
+        }
+    }
+    if (failed) dev->kill();
+}
+
+void WIFIHeartbeatManager::expire_timers() noexcept{
+    std::vector<std::shared_ptr<WIFIDevice>> dead;
+    {
+        std::unique_lock<std::mutex> ul(_sessionsLck);
+        uint64_t now = now_tick();
+        //after a long stall every slot is due, no need to go around more than once
+        if (now >= _wheelTick + WIFIHEARTBEAT_WHEEL_SLOTS) _wheelTick = now - WIFIHEARTBEAT_WHEEL_SLOTS + 1;
+        for (; _wheelTick <= now; _wheelTick++) {
+            auto &slot = _wheel[_wheelTick % WIFIHEARTBEAT_WHEEL_SLOTS];
+            for (size_t i=0; i<slot.size();) {
+                timer_entry t = slot[i];
+                if (t.deadline > now) {
+                    i++;
+                    continue;
+                }
+                slot[i] = slot.back();
+                slot.pop_back();
+                auto it = _sessions.find(t.fd);
+                if (it == _sessions.end() || it->second.deadline != t.deadline) continue; //stale entry
+                error("[WIFIHeartbeatManager] heartbeat of %s timed out",it->second.dev->_serial);
+                if (auto d = it->second.devref.lock()) dead.push_back(d);
+                unregister_nolock(t.fd);
+            }
+        }
+    }
+    for (auto &d : dead) {
+        d->kill();
+    }
+}
+
+#pragma mark public
+void WIFIHeartbeatManager::add(std::shared_ptr<WIFIDevice> dev){
+    _starters->post([this, dev]{
+        start_session(dev);
+    });
+}
+
+void WIFIHeartbeatManager::remove(WIFIDevice *dev) noexcept{
+    std::unique_lock<std::mutex> ul(_sessionsLck);
+    dev->_hbDetached = true;
+    if (dev->_hbfd == -1) return;
+    auto it = _sessions.find(dev->_hbfd);
+    if (it != _sessions.end() && it->second.dev == dev) {
+        unregister_nolock(dev->_hbfd);
+    }
+}
+
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
+#endif //HAVE_LIBIMOBILEDEVICE
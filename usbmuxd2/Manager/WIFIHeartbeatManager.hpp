@@ -0,0 +1,74 @@
+//
+//  WIFIHeartbeatManager.hpp
+//  usbmuxd2
+//
+
+#ifndef WIFIHeartbeatManager_hpp
+#define WIFIHeartbeatManager_hpp
+
+#include "../WorkerPool.hpp"
+#include <libgeneral/Manager.hpp>
+#include <libimobiledevice/libimobiledevice.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <vector>
+
+#define WIFIHEARTBEAT_STARTER_THREADS 4     //concurrent (blocking) heartbeat service starts
+#define WIFIHEARTBEAT_TIMEOUT_MS 15000      //max time between two Marco messages
+#define WIFIHEARTBEAT_WHEEL_TICK_MS 500
+#define WIFIHEARTBEAT_WHEEL_SLOTS 64        //must cover WIFIHEARTBEAT_TIMEOUT_MS
+#define WIFIHEARTBEAT_MAX_EVENTS 64
+
+class WIFIDevice;
+
+/*
+    Drives the heartbeat sessions of all network devices from a single thread.
+    Service starts still block (lockdown handshake), they run on a small starter pool.
+    Established sessions are polled together and their deadlines kept in a timer wheel.
+    Reads never wait for a message to complete, partial messages are buffered per device.
+ */
+class WIFIHeartbeatManager : public tihmstar::Manager{
+    struct session{
+        WIFIDevice *dev; //valid while in _sessions, devices unregister before they go away
+        std::weak_ptr<WIFIDevice> devref;
+        uint64_t deadline; //in ticks
+    };
+    struct timer_entry{
+        int fd;
+        uint64_t deadline;
+    };
+    WorkerPool *_starters; //joined first on destruction, running starts use all members below
+    std::mutex _sessionsLck;
+    std::map<int,session> _sessions;
+    std::vector<timer_entry> _wheel[WIFIHEARTBEAT_WHEEL_SLOTS];
+    uint64_t _wheelTick; //next tick to be processed
+    uint64_t _epoch;
+    int _wakePipe[2];
+#ifdef HAVE_SYS_EPOLL_H
+    int _epfd;
+#endif //HAVE_SYS_EPOLL_H
+
+#pragma mark inheritance function
+    virtual bool loopEvent() override;
+    virtual void stopAction() noexcept override;
+
+#pragma mark private
+    uint64_t now_tick() noexcept;
+    void wake_loop() noexcept;
+    void arm_nolock(int fd, session &s) noexcept;
+    void unregister_nolock(int fd) noexcept;
+    void start_session(std::shared_ptr<WIFIDevice> dev) noexcept;
+    void handle_session(int fd) noexcept;
+    void expire_timers() noexcept;
+
+public:
+    WIFIHeartbeatManager();
+    ~WIFIHeartbeatManager();
+
+    void add(std::shared_ptr<WIFIDevice> dev);
+    void remove(WIFIDevice *dev) noexcept;
+};
+
+#endif /* WIFIHeartbeatManager_hpp */
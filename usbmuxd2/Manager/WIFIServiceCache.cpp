@@ -0,0 +1,120 @@
+//
+//  WIFIServiceCache.cpp
+//  usbmuxd2
+//
+
+#include "WIFIServiceCache.hpp"
+#include <libgeneral/macros.h>
+#include <string.h>
+
+#pragma mark WIFIServiceCache
+std::string WIFIServiceCache::key(const char *name, const char *type){
+    std::string ret{name};
+    size_t typelen = strlen(type);
+    //dns_sd reports "_apple-mobdev2._tcp.", avahi "_apple-mobdev2._tcp"
+    if (typelen && type[typelen-1] == '.') typelen--;
+    ret += ".";
+    ret.append(type, typelen);
+    return ret;
+}
+
+bool WIFIServiceCache::shouldResolve(const std::string &service, const service_ref &ref) noexcept{
+    std::unique_lock<std::mutex> ul(_entriesLck);
+    auto now = std::chrono::steady_clock::now();
+    auto it = _entries.find(service);
+    if (it == _entries.end()) {
+        entry &e = _entries[service];
+        e.instances = 1;
+        e.ref = ref;
+        e.isResolving = true;
+        e.isRefreshing = false;
+        e.resolveStarted = now;
+        return true;
+    }
+    entry &e = it->second;
+    e.instances++;
+    if (e.isResolving) {
+        if (now - e.resolveStarted < std::chrono::seconds(WIFISERVICECACHE_RESOLVE_TIMEOUT_SEC)) {
+            debug("[WIFIServiceCache] '%s' is already being resolved",service.c_str());
+            return false;
+        }
+    } else if (now < e.expires) {
+        debug("[WIFIServiceCache] '%s' resolved recently to '%s'",service.c_str(),e.uuid.c_str());
+        return false;
+    }
+    e.isResolving = true;
+    e.resolveStarted = now;
+    return true;
+}
+
+void WIFIServiceCache::resolved(const std::string &service, const std::string &uuid, uint32_t ttl) noexcept{
+    std::unique_lock<std::mutex> ul(_entriesLck);
+    auto it = _entries.find(service);
+    if (it == _entries.end()) return; //removed while we were resolving
+    entry &e = it->second;
+    e.uuid = uuid;
+    e.isResolving = false;
+    e.isRefreshing = false;
+    e.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl ? ttl : WIFISERVICECACHE_DEFAULT_TTL_SEC);
+}
+
+void WIFIServiceCache::resolveFailed(const std::string &service) noexcept{
+    std::unique_lock<std::mutex> ul(_entriesLck);
+    auto it = _entries.find(service);
+    if (it == _entries.end()) return;
+    it->second.isResolving = false;
+    it->second.expires = {}; //next announcement tries again, a failed refresh is evicted by sweep()
+}
+
+std::string WIFIServiceCache::remove(const std::string &service) noexcept{
+    std::unique_lock<std::mutex> ul(_entriesLck);
+    std::string uuid;
+    auto it = _entries.find(service);
+    if (it == _entries.end()) return {};
+    if (it->second.instances > 1) {
+        it->second.instances--;
+        return {};
+    }
+    uuid = it->second.uuid;
+    _entries.erase(it);
+    for (auto &e : _entries) {
+        if (e.second.uuid == uuid) return {}; //device is still reachable through another service
+    }
+    return uuid;
+}
+
+void WIFIServiceCache::sweep(std::vector<service_ref> &refresh, std::vector<std::string> &evict) noexcept{
+    std::unique_lock<std::mutex> ul(_entriesLck);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::string> lost;
+    for (auto &p : _entries) {
+        entry &e = p.second;
+        if (!e.uuid.size()) continue; //no device to keep alive or evict
+        if (e.isRefreshing) {
+            if (e.isResolving && now - e.resolveStarted < std::chrono::seconds(WIFISERVICECACHE_RESOLVE_TIMEOUT_SEC)) continue;
+            debug("[WIFIServiceCache] '%s' expired and could not be resolved again",p.first.c_str());
+            lost.push_back(e.uuid);
+            //keep counting announcements, the next one resolves it from scratch
+            e.uuid = {};
+            e.isResolving = false;
+            e.isRefreshing = false;
+            e.expires = {};
+        } else if (!e.isResolving && now >= e.expires) {
+            debug("[WIFIServiceCache] '%s' expired, resolving again",p.first.c_str());
+            e.isResolving = true;
+            e.isRefreshing = true;
+            e.resolveStarted = now;
+            refresh.push_back(e.ref);
+        }
+    }
+    for (auto &uuid : lost) {
+        bool isAlive = false;
+        for (auto &e : _entries) {
+            if (e.second.uuid == uuid) {
+                isAlive = true; //device is still reachable through another service
+                break;
+            }
+        }
+        if (!isAlive) evict.push_back(uuid);
+    }
+}
@@ -0,0 +1,62 @@
+//
+//  WIFIServiceCache.hpp
+//  usbmuxd2
+//
+
+#ifndef WIFIServiceCache_hpp
+#define WIFIServiceCache_hpp
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <mutex>
+#include <map>
+#include <vector>
+
+#define WIFISERVICECACHE_DEFAULT_TTL_SEC 120    //mDNS host record TTL (RFC 6762), used if the backend doesn't tell us
+#define WIFISERVICECACHE_RESOLVE_TIMEOUT_SEC 30 //an in-flight resolve older than this no longer blocks a new one
+#define WIFISERVICECACHE_SWEEP_INTERVAL_SEC 10  //how often the backend loops call sweep()
+
+/*
+    Remembers which services were resolved to which device, so an announcement
+    we have seen recently doesn't trigger another resolve.
+    The browser reports a service once per interface and protocol.
+    The entry (and the device) only goes away once every one of those reports was removed.
+    Once the TTL runs out without a removal, sweep() asks for the service to be resolved again.
+    If that fails or doesn't finish in time, the device is evicted.
+ */
+class WIFIServiceCache{
+public:
+    struct service_ref{ //what the backend needs to resolve the service again
+        std::string name;
+        std::string type;
+        std::string domain;
+        int32_t interface;
+        int32_t protocol;
+    };
+private:
+    struct entry{
+        std::string uuid;               //device the service resolved to, empty if none (yet)
+        uint32_t instances;             //announcements currently alive
+        service_ref ref;
+        bool isResolving;
+        bool isRefreshing;              //resolving again because the TTL ran out
+        std::chrono::steady_clock::time_point resolveStarted;
+        std::chrono::steady_clock::time_point expires;
+    };
+    std::map<std::string,entry> _entries;
+    std::mutex _entriesLck;
+
+public:
+    WIFIServiceCache() = default;
+
+    static std::string key(const char *name, const char *type);
+
+    bool shouldResolve(const std::string &service, const service_ref &ref = {}) noexcept; //call once for every announcement
+    void resolved(const std::string &service, const std::string &uuid, uint32_t ttl = 0) noexcept;
+    void resolveFailed(const std::string &service) noexcept;
+    std::string remove(const std::string &service) noexcept; //uuid of the device to evict, empty if it is still announced elsewhere
+    void sweep(std::vector<service_ref> &refresh, std::vector<std::string> &evict) noexcept; //services to resolve again, uuids of devices to evict
+};
+
+#endif /* WIFIServiceCache_hpp */
@@ -9,7 +9,10 @@
 #include "Devices/USBDevice.hpp"
 #include "Manager/USBDeviceManager.hpp"
 #include "Manager/ClientManager.hpp"
+#include "Manager/ForwardManager.hpp"
 #include "Client.hpp"
+#include "TCP.hpp"
+#include "BufferPool.hpp"
 #include "sysconf/preflight.hpp"
 
 #include <libgeneral/macros.h>
@@ -22,6 +25,8 @@
 #   include "Manager/WIFIDeviceManager-avahi.hpp"
 #elif HAVE_WIFI_MDNS
 #   include "Manager/WIFIDeviceManager-mDNS.hpp"
+#elif HAVE_WIFI_BUILTIN
+#   include "Manager/WIFIDeviceManager-builtin.hpp"
 #endif //HAVE_AVAHI
 
 #include <arpa/inet.h>
@@ -30,23 +35,104 @@
 #include <string.h>
 
 #define MAXID (INT_MAX/2)
-#define INVALID_ID (MAXID + 1)
 
 Muxer::Muxer(bool doPreflight, bool allowHeartlessWifi)
-: _climgr(nullptr), _usbdevmgr(nullptr), _wifidevmgr(nullptr)
+: _climgr(nullptr), _usbdevmgr(nullptr), _wifidevmgr(nullptr), _fwdmgr(nullptr)
 , _doPreflight(doPreflight), _allowHeartlessWifi(allowHeartlessWifi)
 , _newid(1)
+, _generation(0)
 {
+    /*
+        Generations continue from wall clock time, so a generation from a previous daemon instance
+        is never mistaken for one of ours
+     */
+    _generation = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     info("Starting Muxer: preflight=%s allowHeartlessWifi=%s", doPreflight ? "YES" : "NO"
                                                              , allowHeartlessWifi ? "YES" : "NO");
 }
 
 Muxer::~Muxer(){
+    safeDelete(_fwdmgr); //hands its connections to clients, so it goes first
     safeDelete(_climgr);
     safeDelete(_usbdevmgr);
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     safeDelete(_wifidevmgr);
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
+    //the managers record device removals while tearing down, so this goes last
+    for (auto &c : _changelog) {
+        safeFreeCustom(c.p_msg, plist_free);
+    }
+}
+
+#pragma mark private
+void Muxer::expire_leases_nolock(bool evictOne){
+    auto now = std::chrono::steady_clock::now();
+    while (_idLeaseLRU.size()) {
+        auto it = _idLeases.find(_idLeaseLRU.front());
+        if (!evictOne && _idLeaseLRU.size() <= MUXER_ID_LEASE_MAX && now - it->second.releasedAt < MUXER_ID_LEASE_TIME) break;
+        debug("Muxer: id lease for %s (id %d) expired",it->first.c_str(),it->second.baseid << 1);
+        _freeIDs.push_back(it->second.baseid);
+        _idLeases.erase(it);
+        _idLeaseLRU.pop_front();
+        evictOne = false;
+    }
+}
+
+int Muxer::acquire_id(const char *serial){
+    std::unique_lock<std::mutex> ul(_idLck);
+    int baseid = 0;
+    auto it = _idLeases.find(serial);
+    if (it != _idLeases.end()) {
+        //attached on the other transport or reattached within the lease window
+        if (!it->second.refs++) _idLeaseLRU.erase(it->second.lru);
+        return it->second.baseid << 1;
+    }
+    expire_leases_nolock(false);
+    if (!_freeIDs.size() && _newid > MAXID) {
+        //all ids handed out, take the one that was released the longest time ago
+        expire_leases_nolock(true);
+    }
+    if (_freeIDs.size()) {
+        baseid = _freeIDs.back();
+        _freeIDs.pop_back();
+    } else if (_newid <= MAXID) {
+        //there can be no device with ID 1 or 0
+        baseid = _newid++;
+    } else {
+        return 0;
+    }
+    _idLeases[serial] = {
+        .baseid = baseid,
+        .refs = 1,
+        .releasedAt = {},
+        .lru = _idLeaseLRU.end()
+    };
+    return baseid << 1;
+}
+
+void Muxer::release_id(const char *serial) noexcept{
+    std::unique_lock<std::mutex> ul(_idLck);
+    auto it = _idLeases.find(serial);
+    if (it == _idLeases.end() || !it->second.refs) return;
+    if (--it->second.refs) return;
+    //keep the id reserved for a while, so client caches stay valid across reconnects
+    it->second.releasedAt = std::chrono::steady_clock::now();
+    it->second.lru = _idLeaseLRU.insert(_idLeaseLRU.end(), it->first);
+    expire_leases_nolock(false);
+}
+
+void Muxer::record_device_change(plist_t p_msg) noexcept{
+    //called with _devicesGuard held for writing, so generations and the device table always agree
+    std::unique_lock<std::mutex> ul(_changelogLck);
+    if (!p_msg) return;
+    _changelog.push_back({
+        .generation = ++_generation,
+        .p_msg = p_msg
+    });
+    while (_changelog.size() > MUXER_CHANGELOG_MAX) {
+        safeFreeCustom(_changelog.front().p_msg, plist_free);
+        _changelog.pop_front();
+    }
 }
 
 #pragma mark Managers
@@ -55,14 +141,21 @@ void Muxer::spawnClientManager(){
     _climgr = new ClientManager(this);
     _climgr->startLoop();
 }
-void Muxer::spawnUSBDeviceManager(){
+void Muxer::spawnUSBDeviceManager(int eventShards){
     assure(!_usbdevmgr);
-    _usbdevmgr = new USBDeviceManager(this);
+    _usbdevmgr = new USBDeviceManager(this, eventShards);
     _usbdevmgr->startLoop();
 }
 
+void Muxer::spawnForwardManager(){
+    assure(_climgr);
+    assure(!_fwdmgr);
+    _fwdmgr = new ForwardManager(this, _climgr);
+    _fwdmgr->startLoop();
+}
+
 void Muxer::spawnWIFIDeviceManager(){
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     assure(!_wifidevmgr);
     _wifidevmgr = new WIFIDeviceManager(this);
     _wifidevmgr->startLoop();
@@ -96,6 +189,7 @@ void Muxer::delete_client(int cli_fd) noexcept{
     for (auto c : _clients) {
         if (c->_fd == cli_fd) {
             _clients.erase(c);
+            remove_listener_nolock(c);
             _clientsGuard.unlockMember();
             c->kill();
             return;
@@ -108,6 +202,7 @@ void Muxer::delete_client(std::shared_ptr<Client> cli) noexcept{
     debug("delete_client %d",cli->_fd);
     _clientsGuard.lockMember();
     if (_clients.erase(cli)) {
+        remove_listener_nolock(cli);
         _clientsGuard.unlockMember();
         cli->kill();
     }else{
@@ -115,30 +210,59 @@ void Muxer::delete_client(std::shared_ptr<Client> cli) noexcept{
     }
 }
 
+void Muxer::add_listener(std::shared_ptr<Client> cli, listen_filter filter) noexcept{
+    guardWrite(_clientsGuard);
+    if (!_clients.count(cli)) return; //client is already gone
+    remove_listener_nolock(cli); //Listen may be sent again with different filters
+    cli->_listenFilter = std::move(filter);
+    for (auto &k : listener_keys(cli->_listenFilter)) {
+        _listeners[k].insert(cli);
+    }
+}
+
+std::vector<Muxer::listener_key> Muxer::listener_keys(const listen_filter &filter) noexcept{
+    std::vector<listener_key> ret;
+    std::vector<std::string> udids{filter.udids.begin(), filter.udids.end()};
+    std::vector<int> pids;
+    if (udids.empty()) udids.push_back("");
+    if (filter.pidMin != 0 || filter.pidMax != 0xFFFF) {
+        /*
+            Only USB devices have a product id, and we only ever attach those in our observe range,
+            so a range filter expands to at most that many exact product ids
+         */
+        if (filter.connTypes && filter.connTypes != Device::MUXCONN_USB) return ret; //never matches
+        for (int pid = std::max<int>(filter.pidMin, PID_RANGE_LOW); pid <= std::min<int>(filter.pidMax, PID_RANGE_MAX); pid++) {
+            pids.push_back(pid);
+        }
+    } else {
+        pids.push_back(-1);
+    }
+    for (auto &udid : udids) {
+        for (int pid : pids) {
+            ret.push_back({udid, filter.connTypes, pid});
+        }
+    }
+    return ret;
+}
+
+void Muxer::remove_listener_nolock(std::shared_ptr<Client> cli) noexcept{
+    for (auto &k : listener_keys(cli->_listenFilter)) {
+        auto it = _listeners.find(k);
+        if (it == _listeners.end()) continue;
+        it->second.erase(cli);
+        if (it->second.empty()) _listeners.erase(it);
+    }
+}
+
 #pragma mark Devices
 void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
     debug("add_device %s",dev->_serial);
 
-    //get id of already connected device but with the other connection type
-    //discard the id-based connection type information
-    dev->_id = id_for_device(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB) & ~1;
-
-    if (!dev->_id){
-        //there can be no device with ID 1 or 0
-        //thus if id is 0 then this is the device's first connection
-        //assign it a fresh ID
-        guardRead(_devicesGuard);
-    retryID:
-        for (auto odev : _devices) {
-            if ((odev->_id >> 1) == _newid) {
-                _newid++;
-                if (_newid>MAXID) {
-                    _newid = 1;
-                    goto retryID;
-                }
-            }
-        }
-        dev->_id = (_newid << 1);
+    //the same device shares its id across connection types and keeps it across short reconnects
+    dev->_id = acquire_id(dev->_serial);
+    if (!dev->_id) {
+        error("Muxer: out of device ids, dropping device %s",dev->_serial);
+        return;
     }
 
     //fixup connection information in ID
@@ -149,13 +273,14 @@ void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
     {
         guardWrite(_devicesGuard);
         _devices.insert(dev);
+        record_device_change(getDevicePlist(dev));
     }
 
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     if (dev->_conntype == Device::MUXCONN_WIFI){
         std::shared_ptr<WIFIDevice> wifidev = std::static_pointer_cast<WIFIDevice>(dev);
         try{
-            wifidev->startLoop();
+            wifidev->start_heartbeat(); //connects asynchronously, calls heartbeat_failed() if that doesn't work out
         }catch (tihmstar::exception &e){
             error("Failed to start WIFIDevice %s with error=%d (%s)",wifidev->_serial,e.code(),e.what());
             if (!_allowHeartlessWifi){
@@ -164,7 +289,7 @@ void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
             return;
         }
     }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     
 #ifdef HAVE_LIBIMOBILEDEVICE
     if (dev->_conntype == Device::MUXCONN_USB && _doPreflight){
@@ -182,45 +307,64 @@ void Muxer::add_device(std::shared_ptr<Device> dev, bool notify) noexcept {
 void Muxer::delete_device(std::shared_ptr<Device> dev) noexcept {
     {
         guardWrite(_devicesGuard);
-        _devices.erase(dev);
+        if (!_devices.erase(dev)) return;
+        record_device_change(getDetachedPlist(dev->_id));
+    }
+    release_id(dev->_serial);
+    notify_device_remove(dev);
+}
+
+void Muxer::heartbeat_failed(std::shared_ptr<Device> dev) noexcept{
+    if (!_allowHeartlessWifi) {
+        dev->kill();
     }
-    notify_device_remove(dev->_id);
 }
 
 void Muxer::delete_device(uint8_t bus, uint8_t address) noexcept {
-    int devid = INVALID_ID;
+    std::shared_ptr<Device> deldev = nullptr;
     {
         guardWrite(_devicesGuard);
         for (auto dev : _devices){
             if (dev->_conntype == Device::MUXCONN_USB) {
                 USBDevice *usbdev = (USBDevice*)dev.get();
                 if (usbdev->usb_location() == (((uint16_t)bus << 16) | address)){
-                    devid = dev->_id;
+                    deldev = dev;
                     _devices.erase(dev);
+                    record_device_change(getDetachedPlist(dev->_id));
                     break;
                 }
             }
         }
     }
-    if (devid != INVALID_ID) notify_device_remove(devid);
+    if (deldev) {
+        release_id(deldev->_serial);
+        notify_device_remove(deldev);
+    }
 }
 
 void Muxer::delete_wifi_pairing_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
-    guardWrite(_devicesGuard);
-    for (auto dev : _devices){
-        if (dev->_conntype == Device::MUXCONN_WIFI) {
-            WIFIDevice *wifidev = (WIFIDevice*)dev.get();
-            for (auto nip : ipaddrs) {
-                if (strncmp(wifidev->_serial, "WIFIPAIR", sizeof("WIFIPAIR")-1) == 0 &&
-                    std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
-                    _devices.erase(dev);
-                    return;
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
+    std::shared_ptr<Device> deldev = nullptr;
+    {
+        guardWrite(_devicesGuard);
+        for (auto dev : _devices){
+            if (dev->_conntype == Device::MUXCONN_WIFI) {
+                WIFIDevice *wifidev = (WIFIDevice*)dev.get();
+                for (auto nip : ipaddrs) {
+                    if (strncmp(wifidev->_serial, "WIFIPAIR", sizeof("WIFIPAIR")-1) == 0 &&
+                        std::find(wifidev->_ipaddr.begin(), wifidev->_ipaddr.end(), nip) != wifidev->_ipaddr.end()) {
+                        deldev = dev;
+                        _devices.erase(dev);
+                        record_device_change(getDetachedPlist(dev->_id));
+                        goto found;
+                    }
                 }
             }
         }
     }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+found:
+    if (deldev) release_id(deldev->_serial);
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
 }
 
 bool Muxer::have_usb_device(uint8_t bus, uint8_t address) noexcept {
@@ -237,7 +381,7 @@ bool Muxer::have_usb_device(uint8_t bus, uint8_t address) noexcept {
 }
 
 bool Muxer::have_wifi_device_with_mac(std::string macaddr) noexcept{
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     guardRead(_devicesGuard);
     for (auto dev : _devices){
         if (dev->_conntype == Device::MUXCONN_WIFI) {
@@ -247,12 +391,12 @@ bool Muxer::have_wifi_device_with_mac(std::string macaddr) noexcept{
             }
         }
     }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     return false;
 }
 
 bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     guardRead(_devicesGuard);
     for (auto dev : _devices){
         if (dev->_conntype == Device::MUXCONN_WIFI) {
@@ -264,7 +408,7 @@ bool Muxer::have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept{
             }
         }
     }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     return false;
 }
 
@@ -281,6 +425,21 @@ int Muxer::id_for_device(const char *uuid, Device::mux_conn_type type) noexcept
     return ret;
 }
 
+int Muxer::id_for_serial(const char *serial) noexcept {
+    int ret = 0;
+    guardRead(_devicesGuard);
+    /*
+        _devices is ordered by pointer, so take the lowest id instead of the first entry.
+        The USB id of a device is always one below its network id, so this also prefers USB
+        if the device is reachable both ways.
+     */
+    for (auto dev : _devices){
+        if (serial && strcmp(serial,dev->_serial) != 0) continue;
+        if (!ret || dev->_id < ret) ret = dev->_id;
+    }
+    return ret;
+}
+
 size_t Muxer::devices_cnt() noexcept {
     guardRead(_devicesGuard);
     return _devices.size();
@@ -308,6 +467,24 @@ void Muxer::start_connect(int device_id, uint16_t dport, std::shared_ptr<Client>
     return;
 }
 
+std::shared_ptr<TCP> Muxer::open_stream(int device_id, uint16_t dport, std::shared_ptr<Client> cli){
+    std::shared_ptr<Device> dev;
+    {
+        guardRead(_devicesGuard);
+        for (auto d : _devices) {
+            if (d->_id == device_id) {
+                dev = d;
+                goto found_device;
+            }
+        }
+        reterror("open_stream(%d,%d,%d) failed",device_id,dport,cli->_fd);
+    found_device:;
+    }
+    //network devices hand the client socket to a forwarding connection, they can't share it
+    retassure(dev->_conntype == Device::MUXCONN_USB, "open_stream(%d,%d,%d) multiplexing is only supported for USB devices",device_id,dport,cli->_fd);
+    return ((USBDevice*)dev.get())->open_connection(dport, cli);
+}
+
 void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
     plist_t p_rsp = NULL;
     plist_t p_devarr = NULL;
@@ -322,12 +499,47 @@ void Muxer::send_deviceList(std::shared_ptr<Client> cli, uint32_t tag){
         for (auto &dev : _devices) {
             plist_array_append_item(p_devarr, getDevicePlist(dev));
         }
+        {
+            std::unique_lock<std::mutex> ul(_changelogLck);
+            plist_dict_set_item(p_rsp, "Generation", plist_new_uint(_generation));
+        }
     }
     plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
 
     cli->send_plist_pkt(tag, p_rsp);
 }
 
+void Muxer::send_deviceListSince(std::shared_ptr<Client> cli, uint32_t tag, uint64_t generation){
+    plist_t p_rsp = NULL;
+    plist_t p_changes = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+        safeFreeCustom(p_changes, plist_free);
+    });
+    {
+        std::unique_lock<std::mutex> ul(_changelogLck);
+        if (generation > _generation || (generation < _generation && (!_changelog.size() || generation + 1 < _changelog.front().generation))) {
+            //unknown generation or too old for the changelog, client needs to start over
+            ul.unlock();
+            return send_deviceList(cli, tag);
+        }
+        assure(p_rsp = plist_new_dict());
+        plist_dict_set_item(p_rsp, "Generation", plist_new_uint(_generation));
+        if (generation == _generation) {
+            plist_dict_set_item(p_rsp, "Unchanged", plist_new_bool(1));
+        } else {
+            assure(p_changes = plist_new_array());
+            for (auto &c : _changelog) {
+                if (c.generation <= generation) continue;
+                plist_array_append_item(p_changes, plist_copy(c.p_msg));
+            }
+            plist_dict_set_item(p_rsp, "Changes", p_changes); p_changes = NULL; //transfer ownership
+        }
+    }
+
+    cli->send_plist_pkt(tag, p_rsp);
+}
+
 void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
     plist_t p_rsp = NULL;
     plist_t p_cliarr = NULL;
@@ -350,76 +562,122 @@ void Muxer::send_listenerList(std::shared_ptr<Client> cli, uint32_t tag){
     cli->send_plist_pkt(tag, p_rsp);
 }
 
-#pragma mark Notification
-void Muxer::notify_device_add(std::shared_ptr<Device> dev) noexcept{
-    debug("notify_device_add(%d)",dev->_id);
+void Muxer::send_statistics(std::shared_ptr<Client> cli, uint32_t tag){
     plist_t p_rsp = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
     });
+    assure(p_rsp = plist_new_dict());
 
-    p_rsp = getDevicePlist(dev);
+    if (_usbdevmgr) {
+        plist_dict_set_item(p_rsp, "USB", _usbdevmgr->getStatisticsPlist());
+    }
+    plist_dict_set_item(p_rsp, "TCP", TCP::getStatisticsPlist());
+    plist_dict_set_item(p_rsp, "Buffers", BufferPool::shared()->getStatisticsPlist());
 
-    {
-        guardRead(_clientsGuard);
-        for (auto &c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
+    cli->send_plist_pkt(tag, p_rsp);
+}
+
+#pragma mark Forwarding
+void Muxer::add_forward(std::string udid, uint16_t localPort, uint16_t devicePort, int owner){
+    retassure(_fwdmgr, "ForwardManager is not running");
+    _fwdmgr->addForward({
+        .udid = udid,
+        .localPort = localPort,
+        .devicePort = devicePort,
+        .owner = owner
+    });
+}
+
+void Muxer::remove_forward(uint16_t localPort, int requester){
+    retassure(_fwdmgr, "ForwardManager is not running");
+    _fwdmgr->removeForward(localPort, requester);
+}
+
+void Muxer::send_forwardList(std::shared_ptr<Client> cli, uint32_t tag){
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+    assure(p_rsp = plist_new_dict());
+    plist_dict_set_item(p_rsp, "ForwardList", _fwdmgr ? _fwdmgr->getForwardsPlist() : plist_new_array());
+    cli->send_plist_pkt(tag, p_rsp);
+}
+
+#pragma mark Notification
+void Muxer::notify_listeners(std::shared_ptr<Device> dev, plist_t p_msg) noexcept{
+    std::string udids[2] = {""};
+    int conntypes[2] = {0};
+    int pids[2] = {-1};
+    int udidsCnt = 1, conntypesCnt = 1, pidsCnt = 1;
+
+    if (dev) {
+        //resolve the filterable attributes once for all listeners
+        udids[udidsCnt++] = dev->_serial;
+        conntypes[conntypesCnt++] = dev->_conntype;
+        if (dev->_conntype == Device::MUXCONN_USB) pids[pidsCnt++] = ((USBDevice*)dev.get())->getPid();
+    }
+
+    guardRead(_clientsGuard);
+    for (int u=0; u<udidsCnt; u++) {
+        for (int c=0; c<conntypesCnt; c++) {
+            for (int p=0; p<pidsCnt; p++) {
+                auto it = _listeners.find({udids[u], conntypes[c], pids[p]});
+                if (it == _listeners.end()) continue;
+                for (auto &cli : it->second) {
+                    try {
+                        cli->send_plist_pkt(0, p_msg);
+                    } catch (...) {
+                        //we don't care if this fails
+                    }
                 }
             }
         }
     }
 }
 
-void Muxer::notify_device_remove(int deviceID) noexcept{
+void Muxer::notify_device_add(std::shared_ptr<Device> dev) noexcept{
+    debug("notify_device_add(%d)",dev->_id);
+    plist_t p_rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+    });
+
+    p_rsp = getDevicePlist(dev);
+    notify_listeners(dev, p_rsp);
+}
+
+void Muxer::notify_device_remove(std::shared_ptr<Device> dev) noexcept{
     plist_t p_rsp = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
     });
     
-    p_rsp = plist_new_dict();
-    plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Detached"));
-    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
-    
-    {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
-            }
-        }
-    }
+    p_rsp = getDetachedPlist(dev->_id);
+    notify_listeners(dev, p_rsp);
 }
 
 void Muxer::notify_device_paired(int deviceID) noexcept{
+    std::shared_ptr<Device> dev = nullptr;
     plist_t p_rsp = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
     });
 
-    p_rsp = plist_new_dict();
-    plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Paired"));
-    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
-
     {
-        guardRead(_clientsGuard);
-        for (auto c : _clients){
-            if (c->_isListening) {
-                try {
-                    c->send_plist_pkt(0, p_rsp);
-                } catch (...) {
-                    //we don't care if this fails
-                }
+        guardRead(_devicesGuard);
+        for (auto &d : _devices){
+            if (d->_id == deviceID) {
+                dev = d;
+                break;
             }
         }
     }
+
+    p_rsp = plist_new_dict();
+    plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Paired"));
+    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
+    notify_listeners(dev, p_rsp); //unknown devices only reach unfiltered listeners
 }
 
 void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
@@ -432,6 +690,10 @@ void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
     {
         guardRead(_devicesGuard);
         for (auto &d : _devices){
+            if (cli->hasListenFilter()) {
+                int pid = (d->_conntype == Device::MUXCONN_USB) ? ((USBDevice*)d.get())->getPid() : -1;
+                if (!cli->listenFilterMatches(d->_serial, d->_conntype, pid)) continue;
+            }
             plist_t p_rsp = NULL;
             cleanup([&]{
                 safeFreeCustom(p_rsp, plist_free);
@@ -447,6 +709,14 @@ void Muxer::notify_alldevices(std::shared_ptr<Client> cli) noexcept {
 }
 
 #pragma mark Static
+plist_t Muxer::getDetachedPlist(int deviceID) noexcept{
+    plist_t p_rsp = NULL;
+    p_rsp = plist_new_dict();
+    plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Detached"));
+    plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
+    return p_rsp;
+}
+
 plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
     plist_t p_devp = NULL;
     plist_t p_props = NULL;
@@ -472,7 +742,7 @@ plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
         plist_dict_set_item(p_props, "LocationID", plist_new_uint(usbdev->usb_location()));
         plist_dict_set_item(p_props, "ProductID", plist_new_uint(usbdev->getPid()));
     }else if (dev->_conntype == Device::MUXCONN_WIFI){
-#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#if defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
         std::shared_ptr<WIFIDevice> wifidev = std::static_pointer_cast<WIFIDevice>(dev);
         plist_dict_set_item(p_props, "ConnectionType", plist_new_string("Network"));
         plist_dict_set_item(p_props, "EscapedFullServiceName", plist_new_string(wifidev->_serviceName.c_str()));
@@ -505,7 +775,7 @@ plist_t Muxer::getDevicePlist(std::shared_ptr<Device> dev) noexcept{
         if (wifidev->_interfaceIndex) {
             plist_dict_set_item(p_props, "InterfaceIndex", plist_new_int(wifidev->_interfaceIndex));
         }
-#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS)
+#endif //defined(HAVE_WIFI_AVAHI) || defined(HAVE_WIFI_MDNS) || defined(HAVE_WIFI_BUILTIN)
     }else{
         assert(0); //THIS SHOULD NOT HAPPEN!!!
     }
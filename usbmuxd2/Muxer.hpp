@@ -15,57 +15,126 @@
 #include <plist/plist.h>
 
 #include <set>
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <tuple>
+#include <string>
+
+#define MUXER_ID_LEASE_TIME std::chrono::minutes(10) //a device reattaching within this window gets its old id back
+#define MUXER_ID_LEASE_MAX 256 //unreferenced leases kept at most
+#define MUXER_CHANGELOG_MAX 1024 //device table changes remembered for ListDevicesSince
 
 class ClientManager;
 class USBDeviceManager;
 class WIFIDeviceManager;
+class ForwardManager;
+class TCP;
 
 class Muxer {
+public:
+    struct listen_filter{
+        std::set<std::string> udids; //empty = any device
+        int connTypes; //Device::mux_conn_type, 0 = any
+        uint16_t pidMin;
+        uint16_t pidMax;
+    };
+private:
+    struct id_lease{
+        int baseid;             //id without the connection type bit
+        uint32_t refs;          //attached transports using this id
+        std::chrono::steady_clock::time_point releasedAt;
+        std::list<std::string>::iterator lru; //position in _idLeaseLRU while unreferenced
+    };
+    struct device_change{
+        uint64_t generation;
+        plist_t p_msg; //Attached or Detached message, as sent to listeners
+    };
+    /*
+        Listeners are indexed by the exact (UDID, connection type, product id) they match,
+        with "", 0 and -1 meaning any. An event looks up the at most 8 combinations of its own values,
+        and every listener is found in exactly one of them if it matches, so no listener filter runs per event.
+     */
+    typedef std::tuple<std::string,int,int> listener_key;
     ClientManager *_climgr;
     USBDeviceManager *_usbdevmgr;
     WIFIDeviceManager *_wifidevmgr;
+    ForwardManager *_fwdmgr;
 
     bool _doPreflight;
     bool _allowHeartlessWifi;
     int _newid;
+    std::vector<int> _freeIDs;
+    std::map<std::string,id_lease> _idLeases;
+    std::list<std::string> _idLeaseLRU; //unreferenced leases, oldest first
+    std::mutex _idLck;
+    uint64_t _generation;
+    std::deque<device_change> _changelog;
+    std::mutex _changelogLck;
     std::set<std::shared_ptr<Device>> _devices;
     tihmstar::GuardAccess _devicesGuard;
     std::set<std::shared_ptr<Client>> _clients;
+    std::map<listener_key,std::set<std::shared_ptr<Client>>> _listeners; //protected by _clientsGuard
     tihmstar::GuardAccess _clientsGuard;
+private:
+    int acquire_id(const char *serial);
+    void release_id(const char *serial) noexcept;
+    void expire_leases_nolock(bool evictOne);
+    void record_device_change(plist_t p_msg) noexcept;
+    static plist_t getDetachedPlist(int deviceID) noexcept;
+    static std::vector<listener_key> listener_keys(const listen_filter &filter) noexcept;
+    void remove_listener_nolock(std::shared_ptr<Client> cli) noexcept;
+    void notify_listeners(std::shared_ptr<Device> dev, plist_t p_msg) noexcept;
+
 public:
     Muxer(bool doPreflight = true, bool allowHeartlessWifi = false);
     ~Muxer();
 
 #pragma mark Managers
     void spawnClientManager();
-    void spawnUSBDeviceManager();
+    void spawnUSBDeviceManager(int eventShards = 1);
     void spawnWIFIDeviceManager();
+    void spawnForwardManager();
     bool hasDeviceManager() noexcept;
 
 #pragma mark Clients
     void add_client(std::shared_ptr<Client> cli);
     void delete_client(int cli_fd) noexcept;
     void delete_client(std::shared_ptr<Client> cli) noexcept;
+    void add_listener(std::shared_ptr<Client> cli, listen_filter filter) noexcept;
 
 #pragma mark Devices
     void add_device(std::shared_ptr<Device> dev, bool notify = true) noexcept;
     void delete_device(std::shared_ptr<Device> dev) noexcept;
     void delete_device(uint8_t bus, uint8_t address) noexcept;
     void delete_wifi_pairing_device_with_ip(std::vector<std::string> ipaddrs) noexcept;
+    void heartbeat_failed(std::shared_ptr<Device> dev) noexcept;
     bool have_usb_device(uint8_t bus, uint8_t address) noexcept;
     bool have_wifi_device_with_mac(std::string macaddr) noexcept;
     bool have_wifi_device_with_ip(std::vector<std::string> ipaddrs) noexcept;
     int id_for_device(const char *uuid, Device::mux_conn_type type) noexcept;
+    int id_for_serial(const char *serial) noexcept;
     size_t devices_cnt() noexcept;
 
 #pragma mark Connection
     void start_connect(int device_id, uint16_t dport, std::shared_ptr<Client> cli);
+    std::shared_ptr<TCP> open_stream(int device_id, uint16_t dport, std::shared_ptr<Client> cli);
     void send_deviceList(std::shared_ptr<Client> cli, uint32_t tag);
+    void send_deviceListSince(std::shared_ptr<Client> cli, uint32_t tag, uint64_t generation);
     void send_listenerList(std::shared_ptr<Client> cli, uint32_t tag);
+    void send_statistics(std::shared_ptr<Client> cli, uint32_t tag);
+
+#pragma mark Forwarding
+    void add_forward(std::string udid, uint16_t localPort, uint16_t devicePort, int owner = -1); //owner -1 = config file
+    void remove_forward(uint16_t localPort, int requester);
+    void send_forwardList(std::shared_ptr<Client> cli, uint32_t tag);
 
 #pragma mark Notification
     void notify_device_add(std::shared_ptr<Device> dev) noexcept;
-    void notify_device_remove(int deviceID) noexcept;
+    void notify_device_remove(std::shared_ptr<Device> dev) noexcept;
     void notify_device_paired(int deviceID) noexcept;
     void notify_alldevices(std::shared_ptr<Client> cli) noexcept;
 
@@ -0,0 +1,154 @@
+//
+//  ShmChannel.cpp
+//  usbmuxd2
+//
+
+#include "ShmChannel.hpp"
+#include <libgeneral/macros.h>
+#include <atomic>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#ifdef HAVE_EVENTFD
+#   include <sys/eventfd.h>
+#endif //HAVE_EVENTFD
+
+#define MIN(a,b) ((a) > (b) ? (b) : (a))
+
+#pragma mark ShmChannel
+ShmChannel::ShmChannel(size_t ringSize)
+: _memfd(-1), _clientBell(-1), _daemonBell(-1)
+, _ringSize(SHMCHANNEL_MIN_RING_SIZE), _mapSize(0)
+, _hdr(NULL), _rx(NULL), _tx(NULL)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+    size_t dataOffset = (sizeof(struct usbmuxd_shm_header) + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+    if (ringSize > SHMCHANNEL_MAX_RING_SIZE) ringSize = SHMCHANNEL_MAX_RING_SIZE;
+    while (_ringSize < ringSize) _ringSize <<= 1;
+    _mapSize = dataOffset + 2*_ringSize;
+
+    retassure((_memfd = memfd_create("usbmuxd-shm", MFD_CLOEXEC)) != -1, "memfd_create failed with errno=%d (%s)",errno,strerror(errno));
+    retassure(!ftruncate(_memfd, _mapSize), "ftruncate failed with errno=%d (%s)",errno,strerror(errno));
+    retassure((_hdr = (struct usbmuxd_shm_header*)mmap(NULL, _mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, _memfd, 0)) != MAP_FAILED,
+              "mmap failed with errno=%d (%s)",errno,strerror(errno));
+    retassure((_clientBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1, "eventfd failed with errno=%d (%s)",errno,strerror(errno));
+    retassure((_daemonBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1, "eventfd failed with errno=%d (%s)",errno,strerror(errno));
+
+    _rx = (uint8_t*)_hdr + dataOffset;
+    _tx = _rx + _ringSize;
+    _hdr->ring_size = (uint32_t)_ringSize;
+    _hdr->data_offset = (uint32_t)dataOffset;
+    _hdr->version = USBMUXD_SHM_VERSION;
+    _hdr->magic = USBMUXD_SHM_MAGIC;
+#else
+    reterror("Compiled without shared memory support");
+#endif
+}
+
+ShmChannel::~ShmChannel(){
+    if (_hdr && _hdr != MAP_FAILED) {
+        munmap(_hdr, _mapSize); _hdr = NULL;
+    }
+    safeClose(_memfd);
+    safeClose(_clientBell);
+    safeClose(_daemonBell);
+}
+
+#pragma mark private
+void ShmChannel::ring(int bell) noexcept{
+    uint64_t one = 1;
+    while (write(bell, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: the counter is about to overflow, the other side has plenty to wake up for
+        if (errno != EAGAIN) error("[ShmChannel] failed to ring doorbell errno=%d (%s)",errno,strerror(errno));
+        break;
+    }
+}
+
+#pragma mark members
+size_t ShmChannel::ringSize(){
+    return _ringSize;
+}
+
+int ShmChannel::doorbell(){
+    return _daemonBell;
+}
+
+void ShmChannel::consume_doorbell() noexcept{
+    uint64_t cnt = 0;
+    while (read(_daemonBell, &cnt, sizeof(cnt)) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: nobody rang since we last looked
+        if (errno != EAGAIN) error("[ShmChannel] failed to read doorbell errno=%d (%s)",errno,strerror(errno));
+        break;
+    }
+}
+
+void ShmChannel::getClientFDs(int fds[3]){
+    retassure(_memfd != -1, "client fds were already handed out");
+    fds[0] = _memfd;
+    fds[1] = _clientBell;
+    fds[2] = _daemonBell;
+}
+
+void ShmChannel::releaseClientFDs() noexcept{
+    //the mapping stays valid, the client got its own copy of the memfd
+    safeClose(_memfd);
+}
+
+size_t ShmChannel::rx_write(const struct iovec *iov, int iovcnt) noexcept{
+    std::atomic_ref<uint64_t> head(_hdr->rx.head);
+    std::atomic_ref<uint64_t> tail(_hdr->rx.tail);
+    uint64_t h = head.load(std::memory_order_relaxed); //we are the only producer
+    size_t space = _ringSize - (size_t)(h - tail.load(std::memory_order_acquire));
+    size_t didWrite = 0;
+
+    for (int i=0; i<iovcnt && space; i++) {
+        const uint8_t *src = (const uint8_t*)iov[i].iov_base;
+        size_t len = MIN(iov[i].iov_len, space);
+        space -= len;
+        while (len) {
+            size_t off = (h + didWrite) & (_ringSize-1);
+            size_t cpylen = MIN(len, _ringSize - off);
+            memcpy(_rx + off, src, cpylen);
+            didWrite += cpylen;
+            src += cpylen;
+            len -= cpylen;
+        }
+    }
+    if (!didWrite) return 0;
+    head.store(h + didWrite, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //ring was empty before this write, the client may have gone to sleep on it
+    if (tail.load(std::memory_order_relaxed) == h) ring(_clientBell);
+    return didWrite;
+}
+
+size_t ShmChannel::tx_read(void *buf, size_t maxlen) noexcept{
+    std::atomic_ref<uint64_t> head(_hdr->tx.head);
+    std::atomic_ref<uint64_t> tail(_hdr->tx.tail);
+    uint64_t t = tail.load(std::memory_order_relaxed); //we are the only consumer
+    size_t avail = (size_t)(head.load(std::memory_order_acquire) - t);
+    size_t len = MIN(avail, maxlen);
+    size_t didRead = 0;
+
+    if (!len) return 0;
+    while (didRead < len) {
+        size_t off = (t + didRead) & (_ringSize-1);
+        size_t cpylen = MIN(len - didRead, _ringSize - off);
+        memcpy((uint8_t*)buf + didRead, _tx + off, cpylen);
+        didRead += cpylen;
+    }
+    tail.store(t + didRead, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //client may be waiting for space
+    if (avail >= _ringSize/2) ring(_clientBell);
+    return didRead;
+}
+
+bool ShmChannel::tx_available() noexcept{
+    std::atomic_ref<uint64_t> head(_hdr->tx.head);
+    std::atomic_ref<uint64_t> tail(_hdr->tx.tail);
+    return head.load(std::memory_order_acquire) != tail.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+//
+//  ShmChannel.hpp
+//  usbmuxd2
+//
+
+#ifndef ShmChannel_hpp
+#define ShmChannel_hpp
+
+#include "usbmuxd2-proto.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SHMCHANNEL_DEFAULT_RING_SIZE (4*1024*1024)
+#define SHMCHANNEL_MIN_RING_SIZE (256*1024) //device segments must stay well below half a ring
+#define SHMCHANNEL_MAX_RING_SIZE (64*1024*1024)
+
+/*
+    Daemon side of the shared memory data channel (see usbmuxd_shm_header).
+    The daemon produces into the rx ring and consumes from the tx ring, never blocking on either.
+ */
+class ShmChannel{
+    int _memfd;
+    int _clientBell;    //we ring it
+    int _daemonBell;    //we poll it
+    size_t _ringSize;
+    size_t _mapSize;
+    struct usbmuxd_shm_header *_hdr;
+    uint8_t *_rx;
+    uint8_t *_tx;
+
+private:
+    void ring(int bell) noexcept;
+
+public:
+    ShmChannel(size_t ringSize);
+    ~ShmChannel();
+
+#pragma mark members
+    size_t ringSize();
+    int doorbell();
+    void consume_doorbell() noexcept;
+    void getClientFDs(int fds[3]);
+    void releaseClientFDs() noexcept;
+
+    size_t rx_write(const struct iovec *iov, int iovcnt) noexcept;
+    size_t tx_read(void *buf, size_t maxlen) noexcept;
+    bool tx_available() noexcept;
+};
+
+#endif /* ShmChannel_hpp */
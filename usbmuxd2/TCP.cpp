@@ -8,30 +8,79 @@
 #include "TCP.hpp"
 #include <libgeneral/macros.h>
 #include "Client.hpp"
+#include "BufferPool.hpp"
+#include "ShmChannel.hpp"
 #include "Devices/USBDevice.hpp"
+#include "usbmuxd2-proto.h"
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_EVENTFD
+#   include <sys/eventfd.h>
+#endif //HAVE_EVENTFD
 
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
+static std::atomic<uint64_t> gTCPSendStalls{0};
+static std::atomic<uint64_t> gTCPWindowUpdates{0};
+static std::atomic<uint64_t> gTCPAcksSent{0};
+static std::atomic<uint64_t> gTCPAcksDelayed{0};
+static std::atomic<uint64_t> gTCPCoalescedWrites{0};
+static std::atomic<uint64_t> gTCPSharedMemoryConnections{0};
+static uint32_t gTCPDefaultCoalesceMs = 0;
+static TCP::AckPolicy gTCPAckPolicy = {
+    .everyBytes = 0,
+    .everySegments = 0,
+    .delayMs = 0, //ACK every segment unless configured otherwise
+};
+
+static int64_t steady_now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 #define unacked ((uint64_t)((_stx.seq >= _stx.seqAcked) ? (_stx.seq - _stx.seqAcked) : ((uint32_t)(0x100000000ULL + _stx.seq - _stx.seqAcked))))
 
 TCP::TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli)
-: _connState(CONN_CONNECTING), _stx{0,0,0,0,0,0x80000},
- _sPort(sPort), _dPort(dPort), _dev(dev), _cli(cli), _payloadBuf(NULL), _pfd{.fd = -1, .events=POLLIN}
+: _connState(CONN_CONNECTING), _stx{0,0,0,0,0,TCP::rxbufsize},
+ _sPort(sPort), _dPort(dPort), _dev(dev), _cli(cli), _sendCredits(0), _sendStalls(0), _payloadBuf(NULL), _pfd{.fd = -1, .events=POLLIN}
+, _wakeFd(-1), _wakeFdW(-1)
+, _rxBuf(NULL), _rxBufHead(0), _rxBufLen(0), _rxBacklog(false), _rxPending(0), _lastAdvertisedWin(0)
+, _drainRate(0), _drainBytes(0), _drainSampleStart{}
+, _ackSegments(0), _ackDeadline(0)
+, _coalesceMs(0), _coalesceLen(0), _coalesceDeadline(0), _coalesceMark(0), _deliveredSegments(0)
+, _muxStream(0), _muxClient{}, _muxCredit(0), _muxCreditReturn(0), _muxCloseRequested(false)
+, _shm(NULL)
 {
     debug("[TCP] (%d) creating connection for sport=%u",cli->_fd,_sPort);
-    assure(_payloadBuf = (char*)malloc(TCP::bufsize));
+#ifdef HAVE_EVENTFD
+    //one fd per tunnel instead of two, idle tunnels add up
+    assure((_wakeFd = _wakeFdW = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1);
+#else
+    {
+        int wakePipe[2] = {-1,-1};
+        assure(!pipe(wakePipe));
+        _wakeFd = wakePipe[0];
+        _wakeFdW = wakePipe[1];
+    }
+    fcntl(_wakeFd, F_SETFL, fcntl(_wakeFd, F_GETFL) | O_NONBLOCK);
+    fcntl(_wakeFdW, F_SETFL, fcntl(_wakeFdW, F_GETFL) | O_NONBLOCK);
+#endif //HAVE_EVENTFD
     
     _stx.seqAcked = _stx.seq = (uint32_t)random();
 }
 
 TCP::~TCP(){
-    debug("destroying TCP %p",this);
+    debug("destroying TCP %p (sport=%u send stalls=%llu)",this,_sPort,(unsigned long long)_sendStalls.load());
     stopLoop();
-    safeFree(_payloadBuf);
+    BufferPool::shared()->release(_payloadBuf, TCP::bufsize);
+    BufferPool::shared()->release(_rxBuf, TCP::rxbufsize);
+    safeDelete(_shm);
     safeClose(_pfd.fd);
+    if (_wakeFdW == _wakeFd) _wakeFdW = -1;
+    safeClose(_wakeFd);
+    safeClose(_wakeFdW);
 }
 
 bool TCP::loopEvent(){
@@ -43,32 +92,116 @@ bool TCP::loopEvent(){
     uint32_t lseq = 0;
     char *bufstart = NULL;
     size_t maxRCV = 0;
+    bool isIdle = false;
+    int timeout = -1;
     
     {
         std::unique_lock<std::mutex> ul(_lockStx);
-        lseqAck = ((uint64_t)_stx.seqAcked + TCP::bufsize)%TCP::bufsize;
-        lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
+        isIdle = !unacked && !_coalesceLen;
+    }
+    timeout = delayed_ack_timeout();
+    if (_coalesceLen) {
+        int64_t remaining = (_coalesceDeadline - steady_now_ns() + 999999) / 1000000;
+        if (remaining < 0) remaining = 0;
+        if (timeout == -1 || remaining < timeout) timeout = (int)remaining;
+    }
+    if (isIdle && _payloadBuf && (timeout == -1 || timeout > TCP::idleReleaseMs)) {
+        //wake up to hand the send buffer back if the client stays silent
+        timeout = TCP::idleReleaseMs;
     }
-    bufstart = _payloadBuf+lseq;
-    maxRCV = (lseq >= lseqAck) ? (TCP::bufsize - lseq) : lseqAck-lseq;
     
     retassure(_pfd.fd != -1, "[TCP CLIENT] bad pollfd");
-    retassure((err = poll(&_pfd,1,-1)) != -1, "[TCP CLIENT] poll failed");
+    {
+        struct pollfd pfds[3] = {
+            {
+                .fd = _pfd.fd,
+                .events = (short)(POLLIN | ((_rxBacklog.load() && !_shm) ? POLLOUT : 0))
+            },
+            {
+                .fd = _wakeFd,
+                .events = POLLIN
+            },
+            {
+                .fd = _shm ? _shm->doorbell() : -1,
+                .events = POLLIN
+            }
+        };
+        retassure((err = poll(pfds,_shm ? 3 : 2,timeout)) != -1 || errno == EINTR, "[TCP CLIENT] poll failed");
+        _pfd.revents = (err > 0) ? pfds[0].revents : 0;
+        if (pfds[1].revents & POLLIN) {
+            uint64_t wakebuf[8]; //an eventfd needs at least 8 bytes
+            while (read(_wakeFd, wakebuf, sizeof(wakebuf)) > 0);
+        }
+        if (_shm) {
+            if (pfds[2].revents & POLLIN) _shm->consume_doorbell();
+            if (_pfd.revents & POLLIN) {
+                //nothing but the lifetime is tracked by the socket in this mode
+                char sockbuf[0x40];
+                if (recv(_pfd.fd, sockbuf, sizeof(sockbuf), MSG_DONTWAIT) == 0) _pfd.revents |= POLLHUP;
+            }
+            _pfd.revents &= ~(POLLIN | POLLOUT);
+            if (_rxBacklog.load()) _pfd.revents |= POLLOUT;
+            if (_shm->tx_available()) _pfd.revents |= POLLIN;
+        }
+    }
+    flush_delayed_ack();
+    if (_coalesceLen) send_coalesced(false);
+    if (err == 0 && isIdle && _payloadBuf) {
+        //everything was acked, nothing left to keep for this connection
+        std::unique_lock<std::mutex> ul(_lockStx);
+        if (!unacked && !_coalesceLen) {
+            BufferPool::shared()->release(_payloadBuf, TCP::bufsize);
+            _payloadBuf = NULL;
+        }
+    }
+
+    if (_pfd.revents & POLLOUT){
+        bool drainOk = false;
+        {
+            std::unique_lock<std::mutex> ul(_lockClientSend);
+            drainOk = drain_client_buffer_nolock();
+        }
+        if (!drainOk) {
+            kill(__LINE__);
+            reterror("[TCP CLIENT] failed to send buffered payload to client %d with error=%d (%s)",_pfd.fd,errno,strerror(errno));
+        }
+        send_window_update();
+    }
+
     if (_pfd.revents & POLLHUP){
         remoteDidClose = true;
         debug("[TCP CLIENT] Remote connection closed");
     }
     
-    if ((_pfd.revents & (~(POLLIN | POLLHUP))) != 0){
+    if ((_pfd.revents & (~(POLLIN | POLLOUT | POLLHUP))) != 0){
       kill(__LINE__);
       reterror("[TCP CLIENT] (fd=%d) unexpected poll revent=0x%x",_pfd.fd,_pfd.revents);
-    }else if (!(_pfd.revents & POLLIN)){
-      warning("[TCP CLIENT] poll returned, but no data to read");
+    }else if (!(_pfd.revents & (POLLIN | POLLHUP))){
       return true;
     }
     
+    if (!_payloadBuf) {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        _payloadBuf = (char*)BufferPool::shared()->acquire(TCP::bufsize);
+    }
+
     do{
-        if ((cnt = recv(_pfd.fd, bufstart, maxRCV, MSG_DONTWAIT))<0){
+        {
+            std::unique_lock<std::mutex> ul(_lockStx);
+            lseqAck = ((uint64_t)_stx.seqAcked + TCP::bufsize)%TCP::bufsize;
+            lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
+        }
+        maxRCV = (lseq >= lseqAck) ? (TCP::bufsize - lseq) : lseqAck-lseq;
+        if (maxRCV <= _coalesceLen) {
+            //no room behind the held back writes, send them out first
+            send_coalesced(true);
+            continue;
+        }
+        //held back writes are still sitting at the start of the unsent region, append to them
+        bufstart = _payloadBuf + lseq + _coalesceLen;
+        maxRCV -= _coalesceLen;
+
+        if ((cnt = client_recv(bufstart, maxRCV))<0){
             kill(__LINE__);
             reterror("[TCP CLIENT] recv failed on client %d with error=%d (%s)",_pfd.fd,errno,strerror(errno));
         }
@@ -77,24 +210,76 @@ bool TCP::loopEvent(){
         
         debug("[TCP CLIENT] got packet of size %zd",cnt);
 
-        while (cnt>0) {
-            ssize_t doSend = MIN(cnt,TCP::TCP_MTU);
-            size_t didSend = send_data(bufstart,doSend);
-            bufstart += didSend;
-            cnt -= didSend;
-        }
+        _coalesceLen += cnt;
+        send_coalesced(remoteDidClose);
     }while (remoteDidClose);
     
     if (remoteDidClose) {
+        send_coalesced(true);
         send_fin();
         return false;
     }
-    
+
+    if (_shm && _shm->tx_available()) {
+        //the doorbell only rings when the ring was empty, come back for the rest
+        signal_wakefd();
+    }
     return true;
 }
 
+bool TCP::coalesce_hold(size_t len){
+    int outq = 0;
+    if (!_coalesceMs || !len || len >= TCP::TCP_MTU) return false;
+    {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        //nothing in flight, so there is nothing to piggyback on either
+        if (!unacked) return false;
+    }
+    if (_coalesceDeadline && steady_now_ns() >= _coalesceDeadline) return false;
+    if (_deliveredSegments.load() != _coalesceMark && !_rxBacklog.load()) {
+        /*
+            If the client read everything the device sent since our last flush,
+            it is most likely blocked waiting for the next response now, don't make it wait on us
+         */
+#ifdef SO_NWRITE
+        socklen_t outqlen = sizeof(outq);
+        if (getsockopt(_pfd.fd, SOL_SOCKET, SO_NWRITE, &outq, &outqlen)) outq = 0;
+#else
+        if (ioctl(_pfd.fd, TIOCOUTQ, &outq)) outq = 0;
+#endif
+        if (!outq) return false;
+    }
+    return true;
+}
+
+void TCP::send_coalesced(bool force){
+    uint32_t lseq = 0;
+    char *pending = NULL;
+    if (!_coalesceLen) return;
+    {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
+    }
+    pending = _payloadBuf + lseq;
+    while (_coalesceLen >= TCP::TCP_MTU || (_coalesceLen && (force || !coalesce_hold(_coalesceLen)))) {
+        size_t didSend = send_data(pending, MIN(_coalesceLen.load(), (size_t)TCP::TCP_MTU));
+        pending += didSend;
+        _coalesceLen -= didSend;
+    }
+    if (_coalesceLen) {
+        if (!_coalesceDeadline) {
+            _coalesceDeadline = steady_now_ns() + _coalesceMs * 1000000LL;
+            gTCPCoalescedWrites++;
+        }
+    } else {
+        _coalesceDeadline = 0;
+        _coalesceMark = _deliveredSegments.load();
+    }
+}
+
 void TCP::stopAction() noexcept{
     if (_pfd.fd != -1) shutdown(_pfd.fd, SHUT_RDWR);
+    signal_wakefd();
 }
 
 void TCP::send_tcp(std::uint8_t flags) {
@@ -108,19 +293,51 @@ void TCP::send_tcp(std::uint8_t flags) {
 
     tcp_header.th_flags = flags;
     tcp_header.th_off = sizeof(tcp_header) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+    tcp_header.th_win = advertise_window_nolock();
 
     debug("[TCP OUT] tcp header packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x len=%u",
           _sPort, _dPort, _stx.seq, _stx.ack, flags, 0);
     // Update TCP states
-    _stx.acked = _stx.ack;
+    ack_sent_nolock();
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
-void TCP::send_ack_nolock(){
+uint32_t TCP::compute_window_nolock(){
+    uint64_t pending = _rxPending.load();
+    uint64_t win = (pending < TCP::rxbufsize) ? TCP::rxbufsize - pending : 0;
+    if (pending && _drainRate) {
+        /*
+            The client is the bottleneck, don't let the device queue up more than
+            rxTargetLatencyMs worth of data (measured at the client's drain rate)
+         */
+        uint64_t latencyWin = _drainRate * TCP::rxTargetLatencyMs / 1000;
+        if (latencyWin < 2*TCP::TCP_MTU) latencyWin = 2*TCP::TCP_MTU;
+        if (win > latencyWin) win = latencyWin;
+    }
+    return (uint32_t)(win & ~0xffULL);
+}
+
+uint16_t TCP::advertise_window_nolock(){
+    _lastAdvertisedWin = _stx.win = compute_window_nolock();
+    return htons(static_cast<std::uint16_t>(_stx.win >> 8));
+}
+
+void TCP::send_window_update(){
+    std::unique_lock<std::mutex> ul(_lockStx);
+    if (_connState != CONN_CONNECTED) return;
+    if (compute_window_nolock() >= _lastAdvertisedWin + TCP::TCP_MTU) {
+        /*
+            Space freed up since we last told the device, let it know without waiting for the next segment
+         */
+        gTCPWindowUpdates++;
+        send_ack_nolock(true);
+    }
+}
+
+void TCP::send_ack_nolock(bool force){
     bool doSend = false;
     tcphdr tcp_header{};
-    if ((doSend = (_stx.acked != _stx.ack))) {
+    if ((doSend = (_stx.acked != _stx.ack || force))) {
         debug("Sending tcp ack packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x",
               _sPort, _dPort, _stx.seq, _stx.ack, TH_ACK);
 
@@ -130,16 +347,68 @@ void TCP::send_ack_nolock(){
         tcp_header.th_ack = htonl(_stx.ack);
         tcp_header.th_flags = TH_ACK;
         tcp_header.th_off = sizeof(tcphdr) / 4;
-        tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+        tcp_header.th_win = advertise_window_nolock();
 
         // Update TCP states
-        _stx.acked = _stx.ack;
+        ack_sent_nolock();
+        gTCPAcksSent++;
     }
     if (doSend) {
         _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
     }
 }
 
+void TCP::ack_sent_nolock(){
+    _stx.acked = _stx.ack;
+    _ackSegments = 0;
+    _ackDeadline = 0;
+}
+
+void TCP::schedule_ack_nolock(){
+    AckPolicy policy = gTCPAckPolicy;
+    uint32_t unackedBytes = _stx.ack - _stx.acked;
+    bool ackNow = false;
+
+    _ackSegments++;
+    if (!policy.delayMs) {
+        ackNow = true;
+    } else if (policy.everySegments && _ackSegments >= policy.everySegments) {
+        ackNow = true;
+    } else if (policy.everyBytes && unackedBytes >= policy.everyBytes) {
+        ackNow = true;
+    } else if (unackedBytes + 2*TCP::TCP_MTU >= _lastAdvertisedWin) {
+        /*
+            The device is about to run out of window, holding the ACK back would stall it
+         */
+        ackNow = true;
+    }
+
+    if (ackNow) {
+        send_ack_nolock();
+    } else if (!_ackDeadline) {
+        _ackDeadline = steady_now_ns() + policy.delayMs * 1000000LL;
+        gTCPAcksDelayed++;
+        //make the TCP loop pick up the new timeout
+        wake_loop();
+    }
+}
+
+int TCP::delayed_ack_timeout(){
+    int64_t deadline = _ackDeadline.load();
+    int64_t now = 0;
+    if (!deadline) return -1;
+    now = steady_now_ns();
+    if (deadline <= now) return 0;
+    return (int)((deadline - now + 999999) / 1000000);
+}
+
+void TCP::flush_delayed_ack(){
+    if (!_ackDeadline.load() || delayed_ack_timeout()) return;
+    std::unique_lock<std::mutex> ul(_lockStx);
+    if (_connState != CONN_CONNECTED) return;
+    send_ack_nolock();
+}
+
 void TCP::send_rst_nolock(){
     tcphdr tcp_header{};
     debug("Sending tcp rst packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x",
@@ -151,7 +420,7 @@ void TCP::send_rst_nolock(){
     tcp_header.th_ack = htonl(_stx.ack);
     tcp_header.th_flags = TH_RST;
     tcp_header.th_off = sizeof(tcphdr) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+    tcp_header.th_win = advertise_window_nolock();
 
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
@@ -171,7 +440,7 @@ void TCP::send_fin(){
     tcp_header.th_ack = htonl(_stx.ack);
     tcp_header.th_flags = TH_RST;
     tcp_header.th_off = sizeof(tcphdr) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+    tcp_header.th_win = advertise_window_nolock();
 
     debug("Sending tcp fin packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x",
           _sPort, _dPort, _stx.seq, _stx.ack, tcp_header.th_flags);
@@ -179,65 +448,70 @@ void TCP::send_fin(){
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
+void TCP::publish_credits_nolock(){
+    _sendCredits.store((int64_t)_stx.inWin - (int64_t)unacked, std::memory_order_release);
+    _canSendEvent.notifyAll();
+}
+
+void TCP::wait_for_credits(){
+    while (_sendCredits.load(std::memory_order_acquire) <= 0) {
+        /*
+            We have to wait for an ACK, no smaller payload is possible.
+            Park until handle_input publishes new credits, re-checking after registering for the event,
+            so a publish in between can't get lost.
+         */
+        uint64_t wevent = _canSendEvent.getNextEvent();
+        if (_sendCredits.load(std::memory_order_acquire) > 0) break;
+        ++_sendStalls;
+        ++gTCPSendStalls;
+        debug("[%llu] we have to wait for ACK before sending more data!",(unsigned long long)_sendStalls.load());
+        _canSendEvent.waitForEvent(wevent);
+        assure(_connState == CONN_CONNECTED);
+    }
+}
+
 size_t TCP::send_data(void *buf, size_t buflen){
     size_t len = buflen;
     if (!len) return 0;
-    tcphdr tcp_header{};
     int64_t rembytes = 0;
-    int sendfails = 0;
 
-    constexpr const int Fastpath_Retry_CNT = 1;
-    
-retry:
-    for (int i=0; i<Fastpath_Retry_CNT; i++) {
+    while (true) {
+        _dev->tx_wait_for_space(_sPort);
+        wait_for_credits();
         _lockStx.lock();
-        if (unacked + len > _stx.inWin) {
-            _lockStx.unlock();
-            sched_yield();
-        }else{
-            goto cnt_label; //fast path
-        }
+        //credits are only a hint, the authoritative state is _stx
+        if ((rembytes = (int64_t)_stx.inWin - unacked) > 0) break;
+        publish_credits_nolock();
+        _lockStx.unlock();
     }
-    _lockStx.lock();
-    //slow path
-    rembytes = (int64_t)_stx.inWin - unacked;
-    if (rembytes<=0) {
-        //at this point we *have to* wait for an ACK
-        //no smaller payload is possible
-        ++sendfails;
-        debug("[%d] we have to wait for ACK before sending more data!",sendfails);
-        
-        // **** Put this thread to sleep until we can send more data **** //
-        uint64_t wevent = _canSendEvent.getNextEvent();
-        _lockStx.unlock(); //unlocking _lockStx inbetween _canSendEvent locks, makes sure we never lock if we could send data!
-
-        _canSendEvent.waitForEvent(wevent);//this lock will always be "blocking", unless we can send more data
-        assure(_connState == CONN_CONNECTED);
-
-        goto retry;
-    }
-    len = rembytes > buflen ? buflen : rembytes;
-cnt_label:
+    if (len > rembytes) len = rembytes;
     if (len > TCP_MTU) len = TCP_MTU;
     
+    send_segment_nolock(buf, len);
+    _lockStx.unlock();
+    return len;
+}
+
+void TCP::send_segment_nolock(const void *buf, size_t len){
+    tcphdr tcp_header{};
+
     tcp_header.th_sport = htons(_sPort);
     tcp_header.th_dport = htons(_dPort);
     tcp_header.th_seq = htonl(_stx.seq);
     tcp_header.th_ack = htonl(_stx.ack);
     tcp_header.th_flags = TH_ACK;
     tcp_header.th_off = sizeof(tcphdr) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+    tcp_header.th_win = advertise_window_nolock();
 
     // Update TCP states
-    _stx.acked = _stx.ack;
+    ack_sent_nolock();
     _stx.seq += len;
+    _sendCredits.fetch_sub(len, std::memory_order_release);
     debug("Sending tcp payload packet: sport=%u dport=%u seq=%u seqAcked=%u ack=%u flags=0x%x len=%zu rwindow=%u[%u] unacked=%llu",
           htons(tcp_header.th_sport), htons(tcp_header.th_dport), htonl(tcp_header.th_seq), _stx.seqAcked, htonl(tcp_header.th_ack),
           TH_ACK, len, _stx.inWin, _stx.inWin >> 8, unacked);
 
     _dev->send_packet(USBDevice::MUX_PROTO_TCP, buf, len, &tcp_header);
-    _lockStx.unlock();
-    return len;
 }
 
 void TCP::flush_data_nolock(){
@@ -253,7 +527,7 @@ void TCP::flush_data_nolock(){
     buflen = (lseq >= lseqAck) ? lseq-lseqAck : (TCP::bufsize - lseqAck);
     
     if (buflen > TCP_MTU) buflen = TCP_MTU;
-    if (!buflen) return;
+    if (!buflen || !_payloadBuf) return;
 
     tcp_header.th_sport = htons(_sPort);
     tcp_header.th_dport = htons(_dPort);
@@ -261,7 +535,7 @@ void TCP::flush_data_nolock(){
     tcp_header.th_ack = htonl(_stx.ack);
     tcp_header.th_flags = TH_ACK;
     tcp_header.th_off = sizeof(tcphdr) / 4;
-    tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
+    tcp_header.th_win = advertise_window_nolock();
 
     debug("Flushing tcp packet: sport=%u dport=%u seq=%u seqAcked=%u ack=%u flags=0x%x len=%zu rwindow=%u[%u]",
           htons(tcp_header.th_sport), htons(tcp_header.th_dport), htonl(tcp_header.th_seq), _stx.seqAcked, htonl(tcp_header.th_ack),
@@ -287,21 +561,24 @@ void TCP::kill(int reason) noexcept{
 }
 
 void TCP::deconstruct() noexcept{
+    mux_conn_state prevState = CONN_DYING;
     {
         std::unique_lock<std::mutex> ul(_lockStx);
+        prevState = _connState;
         _connState = CONN_DYING;
         _connStateDidChange.notifyAll();
         _canSendEvent.notifyAll();
     }
-    {
-        std::unique_lock<std::mutex> ul(_lockClientSend);
-        _canClientSendEvent.notifyAll();
+    if (_muxStream) {
+        std::shared_ptr<Client> cli = _muxClient.lock();
+        if (cli) cli->send_stream_closed(_muxStream, prevState == CONN_CONNECTED);
     }
 }
 
-void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len){
+void TCP::handle_input(tcphdr* tcp_header, const struct iovec *payload, int payload_cnt, uint32_t payload_len){
     uint32_t rSeq = 0;
     uint32_t rAck = 0;
+    bool didConnect = false;
     {
         std::unique_lock<std::mutex> ul(_lockStx);
         debug("[TCP IN] sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u] len=%u",
@@ -318,10 +595,12 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
                 _stx.ack = rSeq+1; //just copy this on first packet without parsing
                 _stx.inWin = ntohs(tcp_header->th_win) << 8;
                 _stx.pktForwarded = _stx.ack;
-                
+                publish_credits_nolock();
+
                 send_ack_nolock();
                 _connState = CONN_CONNECTED;
                 _connStateDidChange.notifyAll();
+                didConnect = true;
             } else {
                 retassure(tcp_header->th_flags & TH_RST, "Received unexpected data while connecting");
                 _connState = CONN_REFUSED;
@@ -331,14 +610,15 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
             }
         } else if (_connState == CONN_CONNECTED) {
             if (tcp_header->th_flags == TH_ACK) {
-                while (_stx.ack != rSeq) {
-                    uint64_t wevent = _canSendEvent.getNextEvent();
-                    ul.unlock();
-                    _canSendEvent.waitForEvent(wevent);
-                    if (_connState != CONN_CONNECTED) return;
-                    ul.lock();
+                if (_stx.ack != rSeq) {
+                    /*
+                        Device input is handled strictly in order, so there is nothing to wait for here
+                     */
+                    warning("Dropping out of order segment sport=%u dport=%u seq=%u expected=%u len=%u",_sPort,_dPort,rSeq,_stx.ack,payload_len);
+                    return;
                 }
-                
+
+
                 //update ACK on sent packets
                 bool isDuplicatePacket = false;
                 if (!(rAck >= _stx.seqAcked || (rAck <= _stx.seq && _stx.seq < _stx.seqAcked) || (rAck > _stx.seq && rAck <= static_cast<uint32_t>(_stx.seqAcked + unacked)))) {
@@ -356,16 +636,25 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
                         _stx.inWin = rInWin;
                     }
                     _stx.ack += payload_len;
+                    if (_muxStream && (uint32_t)(rAck - _stx.seqAcked) <= unacked) {
+                        //acked bytes left the send ring, the client may refill that space
+                        _muxCreditReturn += rAck - _stx.seqAcked;
+                    }
                     _stx.seqAcked = rAck;
+                    _rxPending += payload_len;
+                    if (_coalesceLen && !unacked && !_muxStream) {
+                        //everything in flight got acked, held back writes can go out now
+                        signal_wakefd();
+                    }
 
                     if (payload_len && !_canSendEvent.members()){
                         /*
                             We can avoid sending ACK here if we're gonna send data in next packet anyways
                          */
-                        send_ack_nolock();
+                        schedule_ack_nolock();
                     }
 
-                    _canSendEvent.notifyAll();
+                    publish_credits_nolock();
                 }
             } else if (tcp_header->th_flags == TH_RST){
                 info("Connection reset by device, flags: %u sport=%u dport=%u", tcp_header->th_flags,_sPort,_dPort);
@@ -389,26 +678,181 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
         }
     }
     
+    if (_muxStream) {
+        if (didConnect) {
+            std::shared_ptr<Client> cli = _muxClient.lock();
+            if (cli) cli->send_stream_opened(_muxStream, TCP::bufsize);
+        }
+        stream_push();
+    }
+
     if (payload_len) {
-        std::unique_lock<std::mutex> ul(_lockClientSend);
-        while (rSeq != _stx.pktForwarded) {
-            uint64_t wevent = _canClientSendEvent.getNextEvent();
-            ul.unlock();
-            _canClientSendEvent.waitForEvent(wevent);
-            if (_connState != CONN_CONNECTED) return;
-            ul.lock();
+        deliver_payload(payload, payload_cnt, payload_len);
+    }
+}
+
+void TCP::deliver_payload(const struct iovec *payload, int payload_cnt, uint32_t payload_len){
+    std::unique_lock<std::mutex> ul(_lockClientSend);
+    ssize_t didSend = 0;
+    size_t skip = 0;
+    if (_connState != CONN_CONNECTED) return;
+    _deliveredSegments++;
+
+    if (_rxBufLen && !drain_client_buffer_nolock()) goto client_error;
+
+    if (!_rxBufLen) {
+        //forward to client without buffering, straight from the USB transfer buffers
+        if ((didSend = client_sendmsg_nolock(payload, payload_cnt)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) goto client_error;
+            didSend = 0;
         }
-        if (_connState != CONN_CONNECTED) return;
-        //forward to client without buffering
-        ssize_t didSend = send(_pfd.fd, payload, payload_len, 0);
-        if(didSend != payload_len){
-            //client died, but don't throw, since it wasn't the devices fault!
-            //terminate TCP instead
-            error("Failed to send payload to client with didSend=%zd payload_len=%u errno=%d (%s)",didSend,payload_len,errno,strerror(errno));
-            kill(__LINE__);
+        _rxPending -= (uint32_t)didSend;
+    }
+    _stx.pktForwarded += payload_len;
+    if (didSend == payload_len) return;
+
+    //client is lagging behind, keep the rest until it's ready
+    if (!_rxBuf) {
+        _rxBuf = (char*)BufferPool::shared()->acquire(TCP::rxbufsize);
+        _rxBufHead = 0;
+    }
+    if (!_rxBufLen) {
+        //client starts lagging, only measure its drain rate while there is a backlog
+        _drainSampleStart = std::chrono::steady_clock::now();
+        _drainBytes = 0;
+    }
+    if (_rxBufLen + payload_len - didSend > TCP::rxbufsize) {
+        error("Device exceeded advertised window on sport=%u (buffered=%zu incoming=%zu)",_sPort,_rxBufLen,(size_t)(payload_len - didSend));
+        kill(__LINE__);
+        return;
+    }
+    skip = didSend;
+    for (int i=0; i<payload_cnt; i++) {
+        const uint8_t *src = (const uint8_t *)payload[i].iov_base;
+        size_t len = payload[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        src += skip;
+        len -= skip;
+        skip = 0;
+        while (len) {
+            size_t tail = (_rxBufHead + _rxBufLen) % TCP::rxbufsize;
+            size_t cpylen = MIN(len, TCP::rxbufsize - tail);
+            memcpy(_rxBuf + tail, src, cpylen);
+            _rxBufLen += cpylen;
+            src += cpylen;
+            len -= cpylen;
         }
-        _stx.pktForwarded += payload_len;
-        _canClientSendEvent.notifyAll();
+    }
+    //make the TCP loop wait for POLLOUT (multiplexed streams drain on the client's WINDOW frames instead)
+    _rxBacklog = true;
+    if (!_muxStream) signal_wakefd();
+    return;
+
+client_error:
+    //client died, but don't throw, since it wasn't the devices fault!
+    //terminate TCP instead
+    error("Failed to send payload to client with didSend=%zd payload_len=%u errno=%d (%s)",didSend,payload_len,errno,strerror(errno));
+    kill(__LINE__);
+}
+
+bool TCP::drain_client_buffer_nolock(){
+    while (_rxBufLen) {
+        struct iovec iov[2] = {};
+        ssize_t didSend = 0;
+        size_t firstlen = MIN(_rxBufLen, TCP::rxbufsize - _rxBufHead);
+
+        iov[0].iov_base = _rxBuf + _rxBufHead;
+        iov[0].iov_len = firstlen;
+        iov[1].iov_base = _rxBuf;
+        iov[1].iov_len = _rxBufLen - firstlen;
+        if ((didSend = client_sendmsg_nolock(iov, iov[1].iov_len ? 2 : 1)) < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        _rxBufHead = (_rxBufHead + didSend) % TCP::rxbufsize;
+        _rxBufLen -= didSend;
+        _rxPending -= (uint32_t)didSend;
+        account_drained_nolock(didSend);
+    }
+    _rxBacklog = false;
+    if (_rxBuf) {
+        //backlog is gone, the buffer is only needed again if the client falls behind once more
+        BufferPool::shared()->release(_rxBuf, TCP::rxbufsize);
+        _rxBuf = NULL;
+    }
+    return true;
+}
+
+ssize_t TCP::client_sendmsg_nolock(const struct iovec *iov, int iovcnt){
+    std::shared_ptr<Client> cli = nullptr;
+    size_t len = 0;
+    if (_shm) {
+        if (!(len = _shm->rx_write(iov, iovcnt))) {
+            //ring is full, the client rings our doorbell once it made room
+            errno = EAGAIN;
+            return -1;
+        }
+        return len;
+    }
+    if (!_muxStream) {
+        struct msghdr msg = {};
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        return sendmsg(_pfd.fd, &msg, MSG_DONTWAIT);
+    }
+
+    if (!(cli = _muxClient.lock())) {
+        errno = EPIPE;
+        return -1;
+    }
+    for (int i=0; i<iovcnt; i++) len += iov[i].iov_len;
+    if (_muxCredit <= 0) {
+        //client didn't open its window yet, behave like a full socket
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > (uint64_t)_muxCredit) len = (size_t)_muxCredit;
+    cli->send_frame(MUX_FRAME_DATA, _muxStream, iov, iovcnt, len);
+    _muxCredit -= len;
+    return len;
+}
+
+ssize_t TCP::client_recv(void *buf, size_t len){
+    if (_shm) return _shm->tx_read(buf, len);
+    return recv(_pfd.fd, buf, len, MSG_DONTWAIT);
+}
+
+void TCP::signal_wakefd() noexcept{
+    uint64_t one = 1; //a pipe takes any byte, an eventfd wants a counter
+    while (write(_wakeFdW, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) continue;
+        //EAGAIN: the pipe or counter is full, so the loop is going to wake up anyway
+        if (errno != EAGAIN) error("[TCP] failed to wake loop of sport=%u errno=%d (%s)",_sPort,errno,strerror(errno));
+        break;
+    }
+}
+
+void TCP::wake_loop(){
+    if (_muxStream) {
+        std::shared_ptr<Client> cli = _muxClient.lock();
+        if (cli) cli->wake_mux();
+    } else {
+        signal_wakefd();
+    }
+}
+
+void TCP::account_drained_nolock(size_t len){
+    auto now = std::chrono::steady_clock::now();
+    uint64_t elapsed = 0;
+    _drainBytes += len;
+    elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - _drainSampleStart).count();
+    if (elapsed >= TCP::drainSampleUs) {
+        uint64_t sample = _drainBytes * 1000000 / elapsed;
+        _drainRate = _drainRate ? (_drainRate * 7 + sample) / 8 : sample;
+        _drainBytes = 0;
+        _drainSampleStart = now;
     }
 }
 
@@ -426,12 +870,141 @@ void TCP::connect(){
         retassure(_connState == CONN_CONNECTED, "Failed to establish TCP connection clifd=%d _connState=%d",_pfd.fd,_connState);
     }
     debug("TCP Connected to device");
-    _cli->send_result(_cli->_connectTag, RESULT_OK);
+    if (_cli->_connectShmRingSize) {
+        try {
+            _shm = new ShmChannel(_cli->_connectShmRingSize);
+        } catch (tihmstar::exception &e) {
+            warning("Failed to set up shared memory for clifd=%d, using the socket instead (%s)",_cli->_fd,e.what());
+        }
+    }
+    if (_shm) {
+        int fds[3] = {};
+        _shm->getClientFDs(fds);
+        _cli->send_shm_result(_cli->_connectTag, _shm->ringSize(), fds, 3);
+        _shm->releaseClientFDs();
+        gTCPSharedMemoryConnections++;
+    } else if (!_cli->_isForwarded) {
+        _cli->send_result(_cli->_connectTag, RESULT_OK);
+    }
 
+    //there is no socket buffer to look at in shared memory mode, don't hold back writes
+    _coalesceMs = _shm ? 0 : ((_cli->_connectCoalesceMs >= 0) ? (uint32_t)_cli->_connectCoalesceMs : gTCPDefaultCoalesceMs);
     _pfd.fd = _cli->_fd; _cli->_fd = -1; //disown client, we take care of this fd now
     startLoop();
 }
 
+#pragma mark multiplexed stream
+void TCP::connect_stream(uint32_t streamID, uint32_t clientWindow){
+    retassure(streamID, "stream id 0 is reserved");
+    debug("Starting TCP stream %u of client %d port=%d",streamID,_cli->_fd,_dPort);
+    _muxStream = streamID;
+    _muxClient = _cli;
+    _muxCredit = clientWindow;
+    _cli = nullptr; //the client owns us, don't keep it alive
+    /*
+        Don't wait for the handshake, the session keeps serving its other streams meanwhile.
+        The client learns about the outcome through an OPEN (or CLOSE) frame.
+     */
+    send_tcp(TH_SYN);
+}
+
+void TCP::stream_input(const void *buf, size_t len){
+    const char *src = (const char *)buf;
+    {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        retassure(_connState == CONN_CONNECTED, "[TCP STREAM] data for stream %u before it was opened",_muxStream);
+        retassure(!_muxCloseRequested, "[TCP STREAM] data for stream %u after it was closed",_muxStream);
+        retassure(unacked + _coalesceLen + len <= TCP::bufsize, "[TCP STREAM] stream %u exceeded its window (unacked=%llu pending=%zu len=%zu)",
+                  _muxStream, unacked, _coalesceLen.load(), len);
+        if (!_payloadBuf) _payloadBuf = (char*)BufferPool::shared()->acquire(TCP::bufsize);
+        while (len) {
+            size_t lend = ((uint64_t)_stx.seq + _coalesceLen)%TCP::bufsize;
+            size_t cpylen = MIN(len, TCP::bufsize - lend);
+            memcpy(_payloadBuf + lend, src, cpylen);
+            _coalesceLen += cpylen;
+            src += cpylen;
+            len -= cpylen;
+        }
+    }
+    stream_push();
+}
+
+void TCP::stream_push(){
+    std::shared_ptr<Client> cli = nullptr;
+    uint32_t creditReturn = 0;
+    bool doClose = false;
+    {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        if (_connState != CONN_CONNECTED) return;
+        //never blocks, whatever the device window doesn't take is sent once it ACKs
+        while (_coalesceLen) {
+            int64_t rembytes = (int64_t)_stx.inWin - unacked;
+            uint32_t lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
+            size_t len = _coalesceLen;
+            if (rembytes <= 0) break;
+            if (len > rembytes) len = rembytes;
+            if (len > TCP_MTU) len = TCP_MTU;
+            if (len > TCP::bufsize - lseq) len = TCP::bufsize - lseq;
+            send_segment_nolock(_payloadBuf + lseq, len);
+            _coalesceLen -= len;
+        }
+        if (_muxCreditReturn >= TCP::bufsize/4 || (_muxCreditReturn && !unacked)) {
+            creditReturn = _muxCreditReturn;
+            _muxCreditReturn = 0;
+        }
+        if (!_coalesceLen && !unacked && _payloadBuf) {
+            BufferPool::shared()->release(_payloadBuf, TCP::bufsize);
+            _payloadBuf = NULL;
+        }
+        if (_muxCloseRequested && !_coalesceLen) {
+            _muxCloseRequested = false;
+            doClose = true;
+        }
+    }
+    if (creditReturn && (cli = _muxClient.lock())) {
+        uint32_t increment = creditReturn;
+        struct iovec iov = {.iov_base = &increment, .iov_len = sizeof(increment)};
+        cli->send_frame(MUX_FRAME_WINDOW, _muxStream, &iov, 1, sizeof(increment));
+    }
+    if (doClose) {
+        send_fin();
+        kill(__LINE__);
+    }
+}
+
+void TCP::stream_window(uint32_t increment){
+    bool drainOk = false;
+    {
+        std::unique_lock<std::mutex> ul(_lockClientSend);
+        if (_connState != CONN_CONNECTED) return;
+        _muxCredit += increment;
+        drainOk = drain_client_buffer_nolock();
+    }
+    if (!drainOk) {
+        kill(__LINE__);
+        reterror("[TCP STREAM] failed to forward buffered payload to stream %u",_muxStream);
+    }
+    send_window_update();
+}
+
+void TCP::stream_close(){
+    {
+        std::unique_lock<std::mutex> ul(_lockStx);
+        if (_connState != CONN_CONNECTED) {
+            kill(__LINE__);
+            return;
+        }
+        _muxCloseRequested = true;
+    }
+    //held data still goes out first
+    stream_push();
+}
+
+int TCP::stream_tick(){
+    flush_delayed_ack();
+    return delayed_ack_timeout();
+}
+
 #pragma mark static
 void TCP::send_RST(USBDevice *dev, tcphdr *hdr){
     tcphdr tcp_header{};
@@ -447,3 +1020,23 @@ void TCP::send_RST(USBDevice *dev, tcphdr *hdr){
     debug("[OOL TCP OUT RST] tcp header packet: sport=%u dport=%u", htons(tcp_header.th_sport), htons(tcp_header.th_dport));
     dev->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
+
+void TCP::setAckPolicy(AckPolicy policy){
+    gTCPAckPolicy = policy;
+}
+
+void TCP::setDefaultCoalesceMs(uint32_t ms){
+    gTCPDefaultCoalesceMs = ms;
+}
+
+plist_t TCP::getStatisticsPlist(){
+    plist_t p_ret = NULL;
+    assure(p_ret = plist_new_dict());
+    plist_dict_set_item(p_ret, "SendStalls", plist_new_uint(gTCPSendStalls));
+    plist_dict_set_item(p_ret, "WindowUpdates", plist_new_uint(gTCPWindowUpdates));
+    plist_dict_set_item(p_ret, "AcksSent", plist_new_uint(gTCPAcksSent));
+    plist_dict_set_item(p_ret, "AcksDelayed", plist_new_uint(gTCPAcksDelayed));
+    plist_dict_set_item(p_ret, "CoalescedWrites", plist_new_uint(gTCPCoalescedWrites));
+    plist_dict_set_item(p_ret, "SharedMemoryConnections", plist_new_uint(gTCPSharedMemoryConnections));
+    return p_ret;
+}
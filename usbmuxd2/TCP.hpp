@@ -14,9 +14,13 @@
 #include "Manager/USBDeviceManager.hpp"
 #include <libgeneral/Manager.hpp>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <poll.h>
+#include <sys/uio.h>
 
 class Client;
+class ShmChannel;
 class TCP : public tihmstar::Manager {
     enum mux_conn_state {
         CONN_CONNECTING,        // SYN
@@ -35,28 +39,98 @@ class TCP : public tihmstar::Manager {
     std::shared_ptr<Client> _cli;
     std::mutex _lockStx;
     std::mutex _lockClientSend;
+    std::atomic<int64_t> _sendCredits; //remote window minus unacked bytes, published by handle_input
+    std::atomic<uint64_t> _sendStalls;
     tihmstar::Event _canSendEvent;
     tihmstar::Event _connStateDidChange;
-    tihmstar::Event _canClientSendEvent;
 
-    char *_payloadBuf;
+    char *_payloadBuf;       //from BufferPool, only held while the client is sending
     struct pollfd _pfd;
+    int _wakeFd; //eventfd, or the read end of a pipe without it
+    int _wakeFdW; //write end, same as _wakeFd for an eventfd
+
+    /*
+        Device payload the client couldn't take right away (guarded by _lockClientSend).
+        The window we advertise to the device is derived from this and the client's drain rate.
+     */
+    char *_rxBuf;            //from BufferPool, only held while there is a backlog
+    size_t _rxBufHead;
+    size_t _rxBufLen;
+    std::atomic<bool> _rxBacklog;
+    std::atomic<uint32_t> _rxPending; //acked to the device, but not yet delivered to the client
+    uint32_t _lastAdvertisedWin;
+    uint64_t _drainRate; //bytes/s
+    uint64_t _drainBytes;
+    std::chrono::steady_clock::time_point _drainSampleStart;
+
+    //delayed ACK state (guarded by _lockStx)
+    uint32_t _ackSegments;
+    std::atomic<int64_t> _ackDeadline; //steady_clock ns, 0 if no ACK is pending
+
+    //small write coalescing (loop thread only, except where noted)
+    uint32_t _coalesceMs;               //0 = off
+    std::atomic<size_t> _coalesceLen;   //client bytes held back at _stx.seq, read by handle_input
+    int64_t _coalesceDeadline;          //steady_clock ns
+    uint32_t _coalesceMark;
+    std::atomic<uint32_t> _deliveredSegments; //device segments forwarded to the client
+
+    /*
+        Multiplexed stream state. Such a connection shares the client socket with other streams,
+        it has no loop of its own and is driven by the client's frames instead.
+        Client bytes not yet sent to the device are kept at _stx.seq, just like coalesced writes.
+     */
+    uint32_t _muxStream;                //0 = connection owns the client socket
+    std::weak_ptr<Client> _muxClient;
+    int64_t _muxCredit;                 //bytes the client still accepts (guarded by _lockClientSend)
+    uint32_t _muxCreditReturn;          //ring space freed by the device, not yet granted to the client (guarded by _lockStx)
+    bool _muxCloseRequested;            //guarded by _lockStx
+
+    ShmChannel *_shm;                   //payload goes through shared memory, the socket only tracks lifetime
 
 #pragma mark private
     bool loopEvent() override;
     void stopAction() noexcept override;
     void send_tcp(uint8_t flags);
-    void send_ack_nolock();
+    uint32_t compute_window_nolock();
+    uint16_t advertise_window_nolock();
+    void send_ack_nolock(bool force = false);
+    void ack_sent_nolock();
+    void schedule_ack_nolock();
+    void flush_delayed_ack();
+    int delayed_ack_timeout();
+    void send_window_update();
     void send_rst_nolock();
     void send_rst();
     void send_fin();
+    void publish_credits_nolock();
+    void wait_for_credits();
     size_t send_data(void *buf, size_t len);
+    void send_segment_nolock(const void *buf, size_t len);
+    ssize_t client_sendmsg_nolock(const struct iovec *iov, int iovcnt);
+    ssize_t client_recv(void *buf, size_t len);
+    void signal_wakefd() noexcept;
+    void wake_loop();
+    void stream_push();
+    void deliver_payload(const struct iovec *payload, int payload_cnt, uint32_t payload_len);
+    bool drain_client_buffer_nolock();
+    void account_drained_nolock(size_t len);
+    bool coalesce_hold(size_t len);
+    void send_coalesced(bool force);
     void flush_data_nolock();
     void flush_data();
 
     
 public:
+    struct AckPolicy{
+        uint32_t everyBytes;    //ACK once this many bytes are unacknowledged (0 = off)
+        uint32_t everySegments; //ACK every N data segments (0 = off)
+        uint32_t delayMs;       //otherwise ACK after this delay (0 = ACK immediately)
+    };
     static constexpr int bufsize = 0x80000;
+    static constexpr int rxbufsize = 0x80000;
+    static constexpr int rxTargetLatencyMs = 50;   //how much client backlog we allow the device to build up
+    static constexpr int drainSampleUs = 20000;
+    static constexpr int idleReleaseMs = 1000;     //return buffers of idle connections to the pool after this
     static constexpr int TCP_MTU = (USB_MTU-sizeof(tcphdr)-sizeof(USBDevice::mux_header))&0xff00;
 
     TCP(uint16_t sPort, uint16_t dPort, std::shared_ptr<USBDevice> dev, std::shared_ptr<Client> cli);
@@ -67,10 +141,20 @@ public:
     void deconstruct() noexcept;
 
 #pragma mark members
-    void handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len);
+    void handle_input(tcphdr* tcp_header, const struct iovec *payload, int payload_cnt, uint32_t payload_len);
     void connect();
 
+#pragma mark multiplexed stream
+    void connect_stream(uint32_t streamID, uint32_t clientWindow);
+    void stream_input(const void *buf, size_t len);
+    void stream_window(uint32_t increment);
+    void stream_close();
+    int stream_tick();
+
 #pragma mark static
     static void send_RST(USBDevice *dev, tcphdr *hdr);
+    static plist_t getStatisticsPlist();
+    static void setAckPolicy(AckPolicy policy);
+    static void setDefaultCoalesceMs(uint32_t ms);
 };
 #endif /* TCP_hpp */
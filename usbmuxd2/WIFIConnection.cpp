@@ -0,0 +1,191 @@
+//
+//  WIFIConnection.cpp
+//  usbmuxd2
+//
+
+#include "WIFIConnection.hpp"
+#include <libgeneral/macros.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#pragma mark WIFIConnection
+WIFIConnection::WIFIConnection(int clientfd, int devicefd)
+: _cfd(clientfd), _dfd(devicefd)
+, _c2d{}, _d2c{}
+, _clientGone(false), _isDone(false)
+{
+    _c2d.pipe[0] = _c2d.pipe[1] = -1;
+    _d2c.pipe[0] = _d2c.pipe[1] = -1;
+    fcntl(_cfd, F_SETFL, fcntl(_cfd, F_GETFL) | O_NONBLOCK);
+    fcntl(_dfd, F_SETFL, fcntl(_dfd, F_GETFL) | O_NONBLOCK);
+    try {
+        setup_dir(_c2d, _cfd, _dfd);
+        setup_dir(_d2c, _dfd, _cfd);
+    } catch (...) {
+        free_dir(_c2d);
+        free_dir(_d2c);
+        throw;
+    }
+}
+
+WIFIConnection::~WIFIConnection(){
+    debug("destroying WIFIConnection %p (client->device=%llu device->client=%llu)",this,(unsigned long long)_c2d.bytes,(unsigned long long)_d2c.bytes);
+    stopLoop();
+    free_dir(_c2d);
+    free_dir(_d2c);
+    safeClose(_cfd);
+    safeClose(_dfd);
+}
+
+#pragma mark inheritance function
+bool WIFIConnection::loopEvent(){
+    struct pollfd pfds[2] = {
+        {
+            .fd = _cfd,
+            .events = 0
+        },
+        {
+            .fd = _dfd,
+            .events = 0
+        }
+    };
+    int err = 0;
+
+    if (!_clientGone) {
+        if (!_c2d.eof && _c2d.pending < _c2d.capacity) pfds[0].events |= POLLIN;
+        if (_d2c.pending) pfds[0].events |= POLLOUT;
+        if (!_d2c.eof && _d2c.pending < _d2c.capacity) pfds[1].events |= POLLIN;
+    }
+    if (_c2d.pending) pfds[1].events |= POLLOUT;
+    //POLLHUP is reported even without requested events, a side we don't wait on must not wake us up
+    for (auto &p : pfds) if (!p.events) p.fd = -1;
+
+    retassure((err = poll(pfds,2,-1)) != -1 || errno == EINTR, "[WIFIConnection] poll failed");
+    if (err <= 0) return true;
+
+    if (pfds[0].revents & POLLERR || pfds[1].revents & POLLERR) {
+        debug("[WIFIConnection] socket error, closing");
+        return false;
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP)) if (!pump_in(_c2d)) return false;
+    if ((pfds[0].revents & POLLHUP) && _c2d.eof && !_clientGone) {
+        //the client closed its socket completely, nobody is left to read what the device sends
+        debug("[WIFIConnection] client hung up");
+        _clientGone = true;
+    }
+    if (!_clientGone && pfds[1].revents & (POLLIN | POLLHUP)) if (!pump_in(_d2c)) return false;
+    //try right away, most of the time the other side can take it without another poll round
+    if (_c2d.pending) if (!pump_out(_c2d)) return false;
+    if (!_clientGone && _d2c.pending) if (!pump_out(_d2c)) return false;
+
+    if (_clientGone && !_c2d.pending) {
+        //everything the client sent reached the device
+        debug("[WIFIConnection] client hung up, closing");
+        shutdown(_dfd, SHUT_WR);
+        return false;
+    }
+
+    for (forward_dir *d : {&_c2d, &_d2c}) {
+        if (d->eof && !d->pending && !d->didShutdown) {
+            //pass the half close on
+            shutdown(d->to, SHUT_WR);
+            d->didShutdown = true;
+        }
+    }
+    return !(_c2d.didShutdown && _d2c.didShutdown);
+}
+
+void WIFIConnection::stopAction() noexcept{
+    std::unique_lock<std::mutex> ul(_fdLck);
+    if (_cfd != -1) shutdown(_cfd, SHUT_RDWR);
+    if (_dfd != -1) shutdown(_dfd, SHUT_RDWR);
+}
+
+void WIFIConnection::afterLoop() noexcept{
+    //the device keeps this object until it gets around to sweep it, don't hold on to any fds till then
+    {
+        std::unique_lock<std::mutex> ul(_fdLck);
+        free_dir(_c2d);
+        free_dir(_d2c);
+        safeClose(_cfd);
+        safeClose(_dfd);
+    }
+    _isDone = true;
+}
+
+#pragma mark private
+void WIFIConnection::setup_dir(forward_dir &d, int from, int to){
+    d.from = from;
+    d.to = to;
+#ifdef HAVE_SPLICE
+    int pipesize = 0;
+    retassure(!pipe2(d.pipe, O_NONBLOCK | O_CLOEXEC), "pipe2 failed with errno=%d (%s)",errno,strerror(errno));
+    fcntl(d.pipe[1], F_SETPIPE_SZ, WIFICONNECTION_PIPE_SIZE);
+    if ((pipesize = fcntl(d.pipe[1], F_GETPIPE_SZ)) <= 0) pipesize = 0x10000;
+    d.capacity = pipesize;
+#else
+    assure(d.buf = (char*)malloc(WIFICONNECTION_BUF_SIZE));
+    d.capacity = WIFICONNECTION_BUF_SIZE;
+#endif //HAVE_SPLICE
+}
+
+void WIFIConnection::free_dir(forward_dir &d) noexcept{
+    safeClose(d.pipe[0]);
+    safeClose(d.pipe[1]);
+    safeFree(d.buf);
+}
+
+bool WIFIConnection::pump_in(forward_dir &d){
+    ssize_t got = 0;
+    //a zero length splice() or read() returns 0 as well, which would look like eof
+    if (d.eof || d.pending == d.capacity) return true;
+#ifdef HAVE_SPLICE
+    got = splice(d.from, NULL, d.pipe[1], NULL, d.capacity - d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    if (d.bufOff && !d.pending) d.bufOff = 0;
+    if (d.bufOff + d.pending == d.capacity) {
+        memmove(d.buf, d.buf + d.bufOff, d.pending);
+        d.bufOff = 0;
+    }
+    got = read(d.from, d.buf + d.bufOff + d.pending, d.capacity - d.bufOff - d.pending);
+#endif //HAVE_SPLICE
+    if (got < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+        debug("[WIFIConnection] failed to read from fd=%d errno=%d (%s)",d.from,errno,strerror(errno));
+        return false;
+    }
+    if (got == 0) {
+        d.eof = true;
+        return true;
+    }
+    d.pending += got;
+    return true;
+}
+
+bool WIFIConnection::pump_out(forward_dir &d){
+    ssize_t didSend = 0;
+#ifdef HAVE_SPLICE
+    didSend = splice(d.pipe[0], NULL, d.to, NULL, d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    didSend = write(d.to, d.buf + d.bufOff, d.pending);
+#endif //HAVE_SPLICE
+    if (didSend < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+        debug("[WIFIConnection] failed to write to fd=%d errno=%d (%s)",d.to,errno,strerror(errno));
+        return false;
+    }
+    d.pending -= didSend;
+    d.bufOff += didSend;
+    d.bytes += didSend;
+    return true;
+}
+
+#pragma mark public
+bool WIFIConnection::isDone() noexcept{
+    return _isDone;
+}
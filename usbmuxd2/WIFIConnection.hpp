@@ -0,0 +1,61 @@
+//
+//  WIFIConnection.hpp
+//  usbmuxd2
+//
+
+#ifndef WIFIConnection_hpp
+#define WIFIConnection_hpp
+
+#include <libgeneral/Manager.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+
+#define WIFICONNECTION_PIPE_SIZE (1024*1024) //requested pipe capacity per direction
+#define WIFICONNECTION_BUF_SIZE 0x10000      //copy buffer per direction, only without splice()
+
+/*
+    Forwards between a client socket and a TCP socket to a network device.
+    With splice() payload moves through a pipe and never enters user space.
+ */
+class WIFIConnection : public tihmstar::Manager{
+    struct forward_dir{
+        int from;
+        int to;
+        int pipe[2];        //splice() only
+        char *buf;          //copy fallback only
+        size_t bufOff;
+        size_t pending;     //bytes taken from 'from', not yet written to 'to'
+        size_t capacity;
+        bool eof;
+        bool didShutdown;
+        uint64_t bytes;
+    };
+    int _cfd;
+    int _dfd;
+    forward_dir _c2d;
+    forward_dir _d2c;
+    bool _clientGone;  //client closed both directions, only flushing what it sent is left
+    std::mutex _fdLck; //fds are closed as soon as the loop ends, not just on destruction
+    std::atomic<bool> _isDone;
+
+#pragma mark inheritance function
+    virtual bool loopEvent() override;
+    virtual void stopAction() noexcept override;
+    virtual void afterLoop() noexcept override;
+
+#pragma mark private
+    void setup_dir(forward_dir &d, int from, int to);
+    void free_dir(forward_dir &d) noexcept;
+    bool pump_in(forward_dir &d);
+    bool pump_out(forward_dir &d);
+
+public:
+    WIFIConnection(int clientfd, int devicefd); //takes ownership of both fds
+    ~WIFIConnection();
+
+    bool isDone() noexcept;
+};
+
+#endif /* WIFIConnection_hpp */
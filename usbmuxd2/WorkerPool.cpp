@@ -0,0 +1,115 @@
+//
+//  WorkerPool.cpp
+//  usbmuxd2
+//
+
+#include "WorkerPool.hpp"
+#include <libgeneral/macros.h>
+
+#pragma mark WorkerPool
+WorkerPool::WorkerPool(size_t threads){
+    if (!threads) threads = std::thread::hardware_concurrency();
+    if (threads < WORKERPOOL_MIN_THREADS) threads = WORKERPOOL_MIN_THREADS;
+    debug("Starting WorkerPool with %zu threads",threads);
+    for (size_t i=0; i<threads; i++) {
+        _workers.push_back(std::thread([this]{
+            worker_runloop();
+        }));
+    }
+}
+
+WorkerPool::~WorkerPool(){
+    _tasks.kill();
+    for (auto &w : _workers) {
+        w.join();
+    }
+}
+
+#pragma mark private
+void WorkerPool::worker_runloop() noexcept{
+    while (true) {
+        std::function<void()> task;
+        try {
+            task = _tasks.wait();
+        } catch (...) {
+            break;
+        }
+        try {
+            task();
+        } catch (tihmstar::exception &e) {
+            error("WorkerPool task failed with error=%d (%s)",e.code(),e.what());
+        } catch (std::exception &e) {
+            error("WorkerPool task failed with exception (%s)",e.what());
+        } catch (...) {
+            error("WorkerPool task failed with unknown exception");
+        }
+    }
+}
+
+#pragma mark members
+size_t WorkerPool::size(){
+    return _workers.size();
+}
+
+void WorkerPool::post(std::function<void()> task){
+    _tasks.post(task);
+}
+
+#pragma mark SerialQueue
+SerialQueue::SerialQueue(WorkerPool *pool)
+: _pool(pool), _isScheduled(false)
+{
+    //
+}
+
+#pragma mark private
+void SerialQueue::drain() noexcept{
+    for (int i=0; i<SERIALQUEUE_MAX_BATCH; i++) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> ul(_tasksLck);
+            if (!_tasks.size()) {
+                _isScheduled = false;
+                return;
+            }
+            task = _tasks.front();
+            _tasks.pop_front();
+        }
+        try {
+            task();
+        } catch (tihmstar::exception &e) {
+            error("SerialQueue task failed with error=%d (%s)",e.code(),e.what());
+        } catch (std::exception &e) {
+            error("SerialQueue task failed with exception (%s)",e.what());
+        } catch (...) {
+            error("SerialQueue task failed with unknown exception");
+        }
+    }
+    {
+        std::unique_lock<std::mutex> ul(_tasksLck);
+        if (!_tasks.size()) {
+            _isScheduled = false;
+            return;
+        }
+    }
+    //more work left, get back in line behind the other queues
+    std::shared_ptr<SerialQueue> selfref = shared_from_this();
+    _pool->post([selfref]{
+        selfref->drain();
+    });
+}
+
+#pragma mark members
+void SerialQueue::post(std::function<void()> task){
+    std::shared_ptr<SerialQueue> selfref;
+    {
+        std::unique_lock<std::mutex> ul(_tasksLck);
+        _tasks.push_back(task);
+        if (_isScheduled) return;
+        _isScheduled = true;
+    }
+    selfref = shared_from_this();
+    _pool->post([selfref]{
+        selfref->drain();
+    });
+}
@@ -0,0 +1,57 @@
+//
+//  WorkerPool.hpp
+//  usbmuxd2
+//
+
+#ifndef WorkerPool_hpp
+#define WorkerPool_hpp
+
+#include <libgeneral/DeliveryEvent.hpp>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#define WORKERPOOL_MIN_THREADS 4
+#define SERIALQUEUE_MAX_BATCH 16
+
+class WorkerPool{
+    std::vector<std::thread> _workers;
+    tihmstar::DeliveryEvent<std::function<void()>> _tasks;
+
+private:
+    void worker_runloop() noexcept;
+
+public:
+    WorkerPool(size_t threads = 0);
+    ~WorkerPool();
+
+#pragma mark members
+    size_t size();
+    void post(std::function<void()> task);
+};
+
+/*
+    Tasks posted to a SerialQueue run one after another in posting order,
+    on whichever worker of the pool is free at that time.
+    After SERIALQUEUE_MAX_BATCH tasks the queue yields its worker, so a busy queue can't starve the others.
+ */
+class SerialQueue : public std::enable_shared_from_this<SerialQueue>{
+    WorkerPool *_pool; //not owned
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _tasksLck;
+    bool _isScheduled;
+
+private:
+    void drain() noexcept;
+
+public:
+    SerialQueue(WorkerPool *pool);
+
+#pragma mark members
+    void post(std::function<void()> task);
+};
+
+#endif /* WorkerPool_hpp */
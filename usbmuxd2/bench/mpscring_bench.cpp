@@ -0,0 +1,157 @@
+//
+//  mpscring_bench.cpp
+//  usbmuxd2
+//
+
+/*
+    Compares handing items from several producers to a single consumer
+    through MPSCRing (the RX completion path) and through tihmstar::DeliveryEvent.
+    The ring side is drained the way USBDevice::rx_drain does it: one drain task at a time
+    on a WorkerPool, guarded by a scheduled flag, giving up its worker when the ring runs dry.
+
+    usage: mpscring_bench [producers] [items per producer]
+ */
+
+#include "../MPSCRing.hpp"
+#include "../WorkerPool.hpp"
+#include "../Devices/USBDevice.hpp"
+#include <libgeneral/DeliveryEvent.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start){
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void report(const char *name, uint64_t items, double secs, uint64_t sum, uint64_t expected){
+    printf("%-14s %10llu items %8.3f s %12.0f items/s%s\n",name,(unsigned long long)items,secs,items/secs,
+           sum == expected ? "" : " (CHECKSUM MISMATCH)");
+}
+
+struct bench_rx{
+    MPSCRing<uint64_t, USB_RX_RING_SIZE> ring;
+    std::atomic<bool> scheduled;
+    WorkerPool *pool; //not owned
+    uint64_t total;
+    uint64_t got;
+    uint64_t sum;
+    uint64_t dry; //ring found empty, the drain tries to give up its worker
+    uint64_t reposted;
+    tihmstar::DeliveryEvent<bool> done;
+
+    bench_rx(WorkerPool *pool_, uint64_t total_)
+    : scheduled(false), pool(pool_), total(total_), got(0), sum(0), dry(0), reposted(0) {}
+
+    //USBDeviceManager's rx callback
+    void push(uint64_t v){
+        //all transfers queued, the next one only gets resubmitted once the drain caught up
+        while (!ring.try_push(v)) std::this_thread::yield();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!scheduled.exchange(true)) {
+            pool->post([this]{
+                drain();
+            });
+        }
+    }
+
+    //USBDevice::rx_drain
+    void drain() noexcept{
+        uint64_t v = 0;
+        for (int i=0; i<USB_RX_DRAIN_BATCH; i++) {
+            if (!ring.try_pop_spin(v)) {
+                dry++; //counted before the flag is cleared, afterwards another drain may already be running
+                scheduled.store(false);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ring.empty() || scheduled.exchange(true)) return;
+                continue;
+            }
+            sum += v;
+            if (++got == total) {
+                done.post(true);
+                return;
+            }
+        }
+        reposted++;
+        pool->post([this]{
+            drain();
+        });
+    }
+};
+
+static void bench_ring(int producers, uint64_t perProducer, uint64_t expected){
+    WorkerPool *pool = new WorkerPool();
+    bench_rx *rx = new bench_rx(pool, producers * perProducer);
+    std::vector<std::thread> threads;
+    auto start = bench_clock::now();
+
+    for (int p=0; p<producers; p++) {
+        threads.emplace_back([rx, perProducer]{
+            for (uint64_t i=1; i<=perProducer; i++) {
+                rx->push(i);
+            }
+        });
+    }
+
+    rx->done.wait();
+    double secs = seconds_since(start);
+
+    for (auto &t : threads) t.join();
+    delete pool; //joins the workers, a late drain task may still be touching the counters until then
+    report("MPSCRing", rx->total, secs, rx->sum, expected);
+    printf("%-14s %10llu times the ring ran dry, %llu times the drain yielded its worker\n","",
+           (unsigned long long)rx->dry,(unsigned long long)rx->reposted);
+    rx->done.kill();
+    delete rx;
+}
+
+static void bench_delivery_event(int producers, uint64_t perProducer, uint64_t expected){
+    tihmstar::DeliveryEvent<uint64_t> *ev = new tihmstar::DeliveryEvent<uint64_t>();
+    std::vector<std::thread> threads;
+    uint64_t total = producers * perProducer;
+    uint64_t sum = 0;
+    auto start = bench_clock::now();
+
+    for (int p=0; p<producers; p++) {
+        threads.emplace_back([ev, perProducer]{
+            for (uint64_t i=1; i<=perProducer; i++) {
+                ev->post(i);
+            }
+        });
+    }
+
+    for (uint64_t got=0; got<total; got++) {
+        sum += ev->wait();
+    }
+    report("DeliveryEvent", total, seconds_since(start), sum, expected);
+
+    for (auto &t : threads) t.join();
+    ev->kill();
+    delete ev;
+}
+
+int main(int argc, const char * argv[]) {
+    int producers = 3; //NUM_RX_LOOPS
+    uint64_t perProducer = 1000000;
+    uint64_t expected = 0;
+
+    if (argc > 1) producers = atoi(argv[1]);
+    if (argc > 2) perProducer = strtoull(argv[2], NULL, 0);
+    if (producers < 1 || !perProducer) {
+        printf("usage: %s [producers] [items per producer]\n",argv[0]);
+        return 1;
+    }
+    expected = producers * (perProducer * (perProducer+1) / 2);
+
+    printf("%d producer(s), %llu items each\n",producers,(unsigned long long)perProducer);
+    bench_ring(producers, perProducer, expected);
+    bench_delivery_event(producers, perProducer, expected);
+    return 0;
+}
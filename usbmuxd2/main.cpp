@@ -7,7 +7,9 @@
 //
 
 #include "Muxer.hpp"
+#include "TCP.hpp"
 #include "sysconf/sysconf.hpp"
+#include "sysconf/preflight.hpp"
 
 #include <libgeneral/macros.h>
 
@@ -184,6 +186,10 @@ static void usage(){
     printf("      --allow-heartless-wifi\tAllow WIFI devices without heartbeat to be listed (needed for WIFI pairing)\n");
     printf("      --no-usb\t\t\tDo not start USBDeviceManager\n");
     printf("      --no-wifi\t\t\tDo not start WIFIDeviceManager\n");
+    printf("      --usb-event-shards=N\tHandle libusb events on N threads (devices are sharded by bus/port)\n");
+    printf("      --usb-tx-aggregation\tPack multiple mux packets into one USB transfer\n");
+    printf("      --usb-tx-inflight=N\tAllow N pending USB transfers per device (default: by link speed)\n");
+    printf("      --tcp-ack-delay=MS\tDelay ACKs to the device by up to MS milliseconds (0 = ACK every segment)\n");
     printf("\n");
 }
 
@@ -207,6 +213,10 @@ static void parse_opts(int argc, const char **argv){
         {"debug",                   no_argument,        NULL,  0 },
         {"no-usb",                  optional_argument,  NULL,  0 },
         {"no-wifi",                 optional_argument,  NULL,  0 },
+        {"usb-event-shards",        required_argument,  NULL,  0 },
+        {"usb-tx-aggregation",      optional_argument,  NULL,  0 },
+        {"usb-tx-inflight",         required_argument,  NULL,  0 },
+        {"tcp-ack-delay",           required_argument,  NULL,  0 },
         {NULL,                      0,                  NULL,  0 }
     };
     int optindex = 0;
@@ -235,6 +245,14 @@ static void parse_opts(int argc, const char **argv){
                 }else if (curopt == "no-wifi") {
                     info("Manually disabling WIFIDeviceManager");
                     gConfig->enableWifiDeviceManager = (!optarg) ? false : atoi(optarg);
+                }else if (curopt == "usb-event-shards") {
+                    gConfig->usbEventShards = atoi(optarg);
+                }else if (curopt == "usb-tx-aggregation") {
+                    gConfig->usbTxAggregation = (!optarg) ? true : atoi(optarg);
+                }else if (curopt == "usb-tx-inflight") {
+                    gConfig->usbTxMaxInflight = atoi(optarg);
+                }else if (curopt == "tcp-ack-delay") {
+                    gConfig->tcpAckDelayMs = atoi(optarg);
                 }
             }
                 break;
@@ -387,7 +405,22 @@ int main(int argc, const char * argv[]) {
     if (!gConfig->doPreflight){
         info("Preflight disabled by config or commandline!");
     }
+#ifdef HAVE_LIBIMOBILEDEVICE
+    preflight_set_cache_ttl(gConfig->preflightCacheTTL);
+#endif
     
+    TCP::setAckPolicy({
+        .everyBytes = (uint32_t)gConfig->tcpAckEveryBytes,
+        .everySegments = (uint32_t)gConfig->tcpAckEverySegments,
+        .delayMs = (uint32_t)gConfig->tcpAckDelayMs,
+    });
+    TCP::setDefaultCoalesceMs((uint32_t)gConfig->tcpCoalesceMs);
+    USBDevice::setTxPolicy({
+        .aggregate = gConfig->usbTxAggregation,
+        .maxInflight = (uint32_t)gConfig->usbTxMaxInflight,
+        .maxQueuedPerFlow = (uint32_t)gConfig->usbTxFlowQueueBytes,
+    });
+
     //starting
     mux = new Muxer(gConfig->doPreflight, gConfig->allowHeartlessWifi);
 
@@ -400,6 +433,21 @@ int main(int argc, const char * argv[]) {
         cassure(0);
     }
 
+    try{
+        //before dropping privileges, forwards may use privileged ports
+        mux->spawnForwardManager();
+        for (auto &f : gConfig->portForwards) {
+            try {
+                mux->add_forward(f.udid, f.localPort, f.devicePort);
+            } catch (tihmstar::exception &e) {
+                fatal("failed to forward local port %u with error=%d (%s)",f.localPort,e.code(),e.what());
+            }
+        }
+        info("Inited ForwardManager");
+    }catch (tihmstar::exception &e){
+        fatal("failed to spawnForwardManager with error=%d (%s)",e.code(),e.what());
+    }
+
     // drop elevated privileges
     if (gConfig->dropUser.size() && (getuid() == 0 || geteuid() == 0)) {
         struct passwd *pw = NULL; // don't free this
@@ -430,7 +478,7 @@ int main(int argc, const char * argv[]) {
 
     if (gConfig->enableUSBDeviceManager){
         try{
-            mux->spawnUSBDeviceManager();
+            mux->spawnUSBDeviceManager(gConfig->usbEventShards);
             info("Inited USBDeviceManager");
         }catch (tihmstar::exception &e){
             fatal("failed to spawnUSBDeviceManager with error=%d (%s)",e.code(),e.what());
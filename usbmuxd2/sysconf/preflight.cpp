@@ -16,6 +16,9 @@
 #include <future>
 #include <plist/plist.h>
 #include <system_error>
+#include <chrono>
+#include <map>
+#include <mutex>
 
 
 #ifdef HAVE_LIBIMOBILEDEVICE
@@ -37,6 +40,79 @@ struct np_cb_data{
     np_client_t np;
 };
 
+/*
+    Successful preflights are remembered per UDID together with a hash of the pair record they were done with.
+    A device re-attaching within the cache ttl with an unchanged pair record doesn't need another lockdown session,
+    we only ask lockdownd whether it still trusts us.
+ */
+static std::chrono::seconds gPreflightCacheTTL{PREFLIGHT_CACHE_TTL_DEFAULT};
+
+struct preflight_cache_entry{
+    uint64_t recordHash;
+    std::chrono::steady_clock::time_point validUntil;
+};
+
+static std::map<std::string,preflight_cache_entry> gPreflightCache;
+static std::mutex gPreflightCacheLck;
+
+static uint64_t pair_record_hash(plist_t p_pairingRecord){
+    char *recordbin = NULL;
+    cleanup([&]{
+        safeFree(recordbin);
+    });
+    uint32_t recordbin_len = 0;
+    uint64_t hash = 0xcbf29ce484222325; //FNV-1a
+
+    plist_to_bin(p_pairingRecord, &recordbin, &recordbin_len);
+    retassure(recordbin, "Failed to serialize pairing record");
+    for (uint32_t i=0; i<recordbin_len; i++) {
+        hash ^= (uint8_t)recordbin[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool preflight_cache_lookup(const char *serial, uint64_t recordHash){
+    std::unique_lock<std::mutex> ul(gPreflightCacheLck);
+    auto e = gPreflightCache.find(serial);
+    if (e == gPreflightCache.end()) return false;
+    if (e->second.recordHash != recordHash || e->second.validUntil < std::chrono::steady_clock::now()){
+        gPreflightCache.erase(e);
+        return false;
+    }
+    return true;
+}
+
+static void preflight_cache_insert(const char *serial, uint64_t recordHash){
+    std::unique_lock<std::mutex> ul(gPreflightCacheLck);
+    if (gPreflightCacheTTL.count() <= 0) return;
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = gPreflightCache.begin(); it != gPreflightCache.end();) {
+        if (it->second.validUntil < now) it = gPreflightCache.erase(it);
+        else ++it;
+    }
+    gPreflightCache[serial] = {
+        .recordHash = recordHash,
+        .validUntil = now + gPreflightCacheTTL
+    };
+}
+
+static void preflight_cache_remove(const char *serial){
+    std::unique_lock<std::mutex> ul(gPreflightCacheLck);
+    gPreflightCache.erase(serial);
+}
+
+static bool lockdownd_host_is_trusted(lockdownd_client_t lockdown){
+    plist_t p_trusted = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_trusted, plist_free);
+    });
+    //older devices don't know this key, treat that as trusted and let the cache decide
+    if (lockdownd_get_value(lockdown, NULL, "TrustedHostAttached", &p_trusted) || !p_trusted) return true;
+    if (plist_get_node_type(p_trusted) != PLIST_BOOLEAN) return true;
+    return plist_bool_val_is_true(p_trusted);
+}
+
 static void lockdownd_set_untrusted_host_buid(lockdownd_client_t lockdown){
     std::string system_buid = sysconf_get_system_buid();
     debug("%s: Setting UntrustedHostBUID to %s", __func__, system_buid.c_str());
@@ -79,6 +155,12 @@ error:
     }
 }
 
+void preflight_set_cache_ttl(int seconds){
+    std::unique_lock<std::mutex> ul(gPreflightCacheLck);
+    gPreflightCacheTTL = std::chrono::seconds(seconds);
+    if (seconds <= 0) gPreflightCache.clear();
+}
+
 void preflight_device(const char *serial, int id){
     int version_major = 0;
     lockdownd_error_t lret = LOCKDOWN_E_SUCCESS;
@@ -93,6 +175,7 @@ void preflight_device(const char *serial, int id){
     np_client_t np = NULL;
     np_cb_data *cb_data = NULL;
     np_error_t npret = NP_E_SUCCESS;
+    uint64_t recordHash = 0;
     cleanup([&]{
         if (pProdVers) {
             plist_free(pProdVers);
@@ -123,6 +206,15 @@ void preflight_device(const char *serial, int id){
 
     info("preflighting device %s",serial);
 
+    try {
+        p_pairingRecord = sysconf_get_device_record(serial);
+        recordHash = pair_record_hash(p_pairingRecord);
+    } catch (tihmstar::exception &e) {
+        info("No pairing record loaded for device %s",serial);
+        safeFreeCustom(p_pairingRecord, plist_free);
+        preflight_cache_remove(serial);
+    }
+
     retassure(!(iret = idevice_new_with_options(&dev,serial,IDEVICE_LOOKUP_USBMUX)), "failed to create device with iret=%d",iret);
 
     retassure(!(lret = lockdownd_client_new(dev, &lockdown, "usbmuxd2")),"%s: ERROR: Could not connect to lockdownd on device %s, lockdown error %d", __func__, serial, lret);
@@ -135,11 +227,15 @@ void preflight_device(const char *serial, int id){
         return;
     }
 
-    try {
-        p_pairingRecord = sysconf_get_device_record(serial);
-    } catch (tihmstar::exception &e) {
-        info("No pairing record loaded for device %s",serial);
-        goto pairing_required;
+    if (!p_pairingRecord) goto pairing_required;
+
+    if (preflight_cache_lookup(serial, recordHash)) {
+        if (lockdownd_host_is_trusted(lockdown)) {
+            info("%s: Skipping session on device %s, pair record was validated recently", __func__, serial);
+            return;
+        }
+        info("%s: Device %s no longer trusts this host, dropping cached preflight", __func__, serial);
+        preflight_cache_remove(serial);
     }
 
     {
@@ -153,12 +249,14 @@ void preflight_device(const char *serial, int id){
         retassure((plist_get_string_val(p_hostid, &hostid_str),hostid_str), "Failed to get str ptr from HostID");
 
         if (!(lret = lockdownd_start_session(lockdown, hostid_str, NULL, NULL))){
+            preflight_cache_insert(serial, recordHash);
             info("%s: Finished preflight on device %s", __func__, serial);
             return;
         }
     }
 
     error("%s: StartSession failed on device %s, lockdown error %d", __func__, serial, lret);
+    preflight_cache_remove(serial);
 
     if (lret == LOCKDOWN_E_SSL_ERROR) {
         error("%s: The stored pair record for device %s is invalid. Removing.", __func__, serial);
@@ -8,6 +8,9 @@
 #ifndef preflight_hpp
 #define preflight_hpp
 
+#define PREFLIGHT_CACHE_TTL_DEFAULT (30*60) //seconds
+
+void preflight_set_cache_ttl(int seconds); //0 disables caching
 void preflight_device(const char *serial, int id);
 
 #endif /* preflight_hpp */
@@ -6,6 +6,7 @@
 //
 
 #include "sysconf.hpp"
+#include "preflight.hpp"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgeneral/macros.h>
@@ -348,12 +349,61 @@ bool sysconf_try_getconfig_bool(std::string key, bool defaultValue){
     }
 }
 
+static int sysconf_try_getconfig_int(std::string key, int defaultValue){
+    plist_t p_intVal = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_intVal, plist_free);
+    });
+    try {
+        uint64_t val = 0;
+        p_intVal = sysconf_get_value(key);
+        assure(plist_get_node_type(p_intVal) == PLIST_UINT);
+        plist_get_uint_val(p_intVal, &val);
+        return (int)val;
+    } catch (tihmstar::exception &e) {
+        warning("Failed to get %s! setting it to default val",key.c_str());
+        p_intVal = plist_new_uint(defaultValue);
+        sysconf_set_value(key, p_intVal);
+        return defaultValue;
+    }
+}
+
+static plist_t sysconf_try_getconfig_array(std::string key){
+    plist_t p_arrVal = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_arrVal, plist_free);
+    });
+    try {
+        p_arrVal = sysconf_get_value(key);
+        assure(plist_get_node_type(p_arrVal) == PLIST_ARRAY);
+        {
+            plist_t ret = p_arrVal; p_arrVal = NULL;
+            return ret;
+        }
+    } catch (tihmstar::exception &e) {
+        warning("Failed to get %s! setting it to default val",key.c_str());
+        safeFreeCustom(p_arrVal, plist_free);
+        p_arrVal = plist_new_array();
+        sysconf_set_value(key, p_arrVal);
+        return plist_new_array();
+    }
+}
+
 Config::Config() :
 //config
 doPreflight(false),
+preflightCacheTTL(PREFLIGHT_CACHE_TTL_DEFAULT),
 allowHeartlessWifi(false),
 enableWifiDeviceManager(false),
 enableUSBDeviceManager(false),
+usbEventShards(1),
+usbTxAggregation(false),
+usbTxMaxInflight(0),
+usbTxFlowQueueBytes(0),
+tcpAckEveryBytes(0),
+tcpAckEverySegments(0),
+tcpAckDelayMs(0),
+tcpCoalesceMs(0),
 //commandline
 enableExit(false),
 daemonize(false),
@@ -366,7 +416,51 @@ debugLevel(0)
 void Config::load(){
     //config
     doPreflight = sysconf_try_getconfig_bool("doPreflight",true);
+    preflightCacheTTL = sysconf_try_getconfig_int("preflightCacheTTL",PREFLIGHT_CACHE_TTL_DEFAULT);
     enableWifiDeviceManager = sysconf_try_getconfig_bool("enableWifiDeviceManager",true);
     enableUSBDeviceManager = sysconf_try_getconfig_bool("enableUSBDeviceManager",true);
+    usbEventShards = sysconf_try_getconfig_int("usbEventShards",1);
+    usbTxAggregation = sysconf_try_getconfig_bool("usbTxAggregation",false);
+    usbTxMaxInflight = sysconf_try_getconfig_int("usbTxMaxInflight",0);
+    usbTxFlowQueueBytes = sysconf_try_getconfig_int("usbTxFlowQueueBytes",0);
+    tcpAckEveryBytes = sysconf_try_getconfig_int("tcpAckEveryBytes",0);
+    tcpAckEverySegments = sysconf_try_getconfig_int("tcpAckEverySegments",0);
+    tcpAckDelayMs = sysconf_try_getconfig_int("tcpAckDelayMs",0);
+    tcpCoalesceMs = sysconf_try_getconfig_int("tcpCoalesceMs",0);
+    {
+        //array of dicts with LocalPort, DevicePort and optionally UDID
+        plist_t p_forwards = NULL;
+        cleanup([&]{
+            safeFreeCustom(p_forwards, plist_free);
+        });
+        p_forwards = sysconf_try_getconfig_array("portForwards");
+        portForwards.clear();
+        for (uint32_t i = 0; i < plist_array_get_size(p_forwards); i++) {
+            plist_t p_fwd = plist_array_get_item(p_forwards, i);
+            plist_t p_val = NULL;
+            uint64_t localPort = 0;
+            uint64_t devicePort = 0;
+            portForward fwd{};
+            if (plist_get_node_type(p_fwd) != PLIST_DICT) continue;
+            if ((p_val = plist_dict_get_item(p_fwd, "LocalPort")) && plist_get_node_type(p_val) == PLIST_UINT) {
+                plist_get_uint_val(p_val, &localPort);
+            }
+            if ((p_val = plist_dict_get_item(p_fwd, "DevicePort")) && plist_get_node_type(p_val) == PLIST_UINT) {
+                plist_get_uint_val(p_val, &devicePort);
+            }
+            if (!localPort || localPort > 0xffff || !devicePort || devicePort > 0xffff) {
+                warning("Ignoring invalid entry %u in portForwards",i);
+                continue;
+            }
+            if ((p_val = plist_dict_get_item(p_fwd, "UDID")) && plist_get_node_type(p_val) == PLIST_STRING) {
+                const char *str = NULL;
+                uint64_t str_len = 0;
+                if ((str = plist_get_string_ptr(p_val, &str_len))) fwd.udid = std::string(str,str_len);
+            }
+            fwd.localPort = (uint16_t)localPort;
+            fwd.devicePort = (uint16_t)devicePort;
+            portForwards.push_back(fwd);
+        }
+    }
     info("Loaded config");
 }
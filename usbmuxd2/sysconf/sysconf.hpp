@@ -10,6 +10,7 @@
 
 #include <plist/plist.h>
 #include <iostream>
+#include <vector>
 
 plist_t sysconf_get_device_record(const char *udid);
 void sysconf_set_device_record(const char *udid, const plist_t record);
@@ -22,11 +23,26 @@ void sysconf_fix_permissions(int uid, int gid);
 
 class Config{
 public:
+    struct portForward{
+        std::string udid; //empty = first available device
+        uint16_t localPort;
+        uint16_t devicePort;
+    };
     //config
     bool doPreflight;
+    int preflightCacheTTL; //seconds
     bool allowHeartlessWifi;
     bool enableWifiDeviceManager;
     bool enableUSBDeviceManager;
+    int usbEventShards;
+    bool usbTxAggregation;
+    int usbTxMaxInflight;
+    int usbTxFlowQueueBytes;
+    int tcpAckEveryBytes;
+    int tcpAckEverySegments;
+    int tcpAckDelayMs;
+    int tcpCoalesceMs;
+    std::vector<portForward> portForwards;
 
     //commandline
     bool enableExit;
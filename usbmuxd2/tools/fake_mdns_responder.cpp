@@ -0,0 +1,339 @@
+//
+//  fake_mdns_responder.cpp
+//  usbmuxd2
+//
+
+/*
+    Answers the unicast mDNS queries of the built-in browser (WIFIDeviceManager-builtin)
+    with a single made up service, so discovery and removal can be checked without a device.
+
+    Run usbmuxd with USBMUXD_MDNS_ADDR=127.0.0.1 USBMUXD_MDNS_PORT=<port> next to it.
+    PTR, SRV and A queries are answered from the port we listen on, which is what the browser expects.
+    Services of type _remotepairing-manual-pairing._tcp become devices without a pairing record,
+    for _apple-mobdev2._tcp the mac address in the instance name has to match one.
+
+    - -g or SIGUSR1 sends a goodbye (PTR with TTL 0) to the last querier, the device should go away at once
+    - -s stops answering after that many seconds, the device should go away once the TTL ran out
+
+    usage: fake_mdns_responder [-p port] [-t ttl] [-g seconds] [-s seconds] [-T type] instance host ipv4
+ */
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define DNS_TYPE_A      1
+#define DNS_TYPE_PTR    12
+#define DNS_TYPE_SRV    33
+#define DNS_CLASS_IN    1
+#define DNS_CLASS_FLUSH 0x8000
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_AA     0x0400
+#define DNS_HEADER_SIZE 12
+
+#define FAKE_MDNS_DEFAULT_PORT 5354 //not 5353, so a real responder on this host doesn't get in the way
+#define FAKE_MDNS_DEFAULT_TTL 120
+#define FAKE_MDNS_SERVICE_PORT 62078 //lockdownd
+
+typedef std::chrono::steady_clock fake_clock;
+
+static volatile sig_atomic_t gWantGoodbye = 0;
+static volatile sig_atomic_t gWantExit = 0;
+
+struct fake_service{
+    std::vector<std::string> type;      //e.g. {"_apple-mobdev2","_tcp","local"}
+    std::vector<std::string> instance;  //instance label followed by type
+    std::vector<std::string> host;
+    struct in_addr addr;
+    uint32_t ttl;
+};
+
+#pragma mark helpers
+static std::vector<std::string> split_name(const std::string &name){
+    std::vector<std::string> ret;
+    size_t pos = 0;
+    while (pos < name.size()) {
+        size_t dot = name.find('.', pos);
+        if (dot == std::string::npos) dot = name.size();
+        if (dot > pos) ret.push_back(name.substr(pos, dot-pos));
+        pos = dot+1;
+    }
+    return ret;
+}
+
+static bool same_name(const std::vector<std::string> &a, const std::vector<std::string> &b){
+    if (a.size() != b.size()) return false;
+    for (size_t i=0; i<a.size(); i++) {
+        if (strcasecmp(a[i].c_str(), b[i].c_str())) return false;
+    }
+    return true;
+}
+
+static void put16(std::vector<uint8_t> &pkt, uint16_t v){
+    pkt.push_back(v >> 8);
+    pkt.push_back(v & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &pkt, uint32_t v){
+    put16(pkt, v >> 16);
+    put16(pkt, v & 0xffff);
+}
+
+static void put_name(std::vector<uint8_t> &pkt, const std::vector<std::string> &labels){
+    //no compression, answers are tiny
+    for (auto &l : labels) {
+        pkt.push_back((uint8_t)l.size());
+        pkt.insert(pkt.end(), l.begin(), l.end());
+    }
+    pkt.push_back(0);
+}
+
+static bool read_name(const uint8_t *pkt, size_t len, size_t &off, std::vector<std::string> &labels){
+    size_t pos = off;
+    bool didJump = false;
+    int hops = 0;
+    labels.clear();
+    while (true) {
+        uint8_t l = 0;
+        if (pos >= len) return false;
+        l = pkt[pos];
+        if ((l & 0xC0) == 0xC0) {
+            if (pos+1 >= len || ++hops > 16) return false;
+            if (!didJump) off = pos+2;
+            didJump = true;
+            pos = ((l & 0x3F) << 8) | pkt[pos+1];
+            continue;
+        }
+        if (l & 0xC0) return false;
+        pos++;
+        if (!l) break;
+        if (pos+l > len) return false;
+        labels.emplace_back((const char*)&pkt[pos], l);
+        pos += l;
+    }
+    if (!didJump) off = pos;
+    return true;
+}
+
+static void begin_rr(std::vector<uint8_t> &pkt, const std::vector<std::string> &owner, uint16_t type, uint16_t cls, uint32_t ttl, size_t &rdlenPos){
+    put_name(pkt, owner);
+    put16(pkt, type);
+    put16(pkt, cls);
+    put32(pkt, ttl);
+    rdlenPos = pkt.size();
+    put16(pkt, 0);
+}
+
+static void end_rr(std::vector<uint8_t> &pkt, size_t rdlenPos){
+    size_t rdlen = pkt.size() - rdlenPos - 2;
+    pkt[rdlenPos] = rdlen >> 8;
+    pkt[rdlenPos+1] = rdlen & 0xff;
+}
+
+static void put_ptr(std::vector<uint8_t> &pkt, const fake_service &svc, uint32_t ttl){
+    size_t rdlenPos = 0;
+    begin_rr(pkt, svc.type, DNS_TYPE_PTR, DNS_CLASS_IN, ttl, rdlenPos);
+    put_name(pkt, svc.instance);
+    end_rr(pkt, rdlenPos);
+}
+
+static void put_srv(std::vector<uint8_t> &pkt, const fake_service &svc){
+    size_t rdlenPos = 0;
+    begin_rr(pkt, svc.instance, DNS_TYPE_SRV, DNS_CLASS_IN | DNS_CLASS_FLUSH, svc.ttl, rdlenPos);
+    put16(pkt, 0); //priority
+    put16(pkt, 0); //weight
+    put16(pkt, FAKE_MDNS_SERVICE_PORT);
+    put_name(pkt, svc.host);
+    end_rr(pkt, rdlenPos);
+}
+
+static void put_a(std::vector<uint8_t> &pkt, const fake_service &svc){
+    size_t rdlenPos = 0;
+    begin_rr(pkt, svc.host, DNS_TYPE_A, DNS_CLASS_IN | DNS_CLASS_FLUSH, svc.ttl, rdlenPos);
+    pkt.insert(pkt.end(), (const uint8_t*)&svc.addr, (const uint8_t*)&svc.addr + sizeof(svc.addr));
+    end_rr(pkt, rdlenPos);
+}
+
+static void finish_response(std::vector<uint8_t> &pkt, uint16_t ancount, uint16_t arcount){
+    pkt[2] = (DNS_FLAG_QR | DNS_FLAG_AA) >> 8;
+    pkt[6] = ancount >> 8; pkt[7] = ancount & 0xff;
+    pkt[10] = arcount >> 8; pkt[11] = arcount & 0xff;
+}
+
+#pragma mark responder
+static void send_response(int fd, const struct sockaddr_in &dst, const std::vector<uint8_t> &pkt){
+    if (sendto(fd, pkt.data(), pkt.size(), 0, (const struct sockaddr*)&dst, sizeof(dst)) == -1) {
+        printf("failed to send response errno=%d (%s)\n",errno,strerror(errno));
+    }
+}
+
+static void send_goodbye(int fd, const struct sockaddr_in &dst, const fake_service &svc){
+    std::vector<uint8_t> pkt(DNS_HEADER_SIZE);
+    put_ptr(pkt, svc, 0);
+    finish_response(pkt, 1, 0);
+    send_response(fd, dst, pkt);
+    printf("sent goodbye to %s:%d\n",inet_ntoa(dst.sin_addr),ntohs(dst.sin_port));
+}
+
+static void handle_query(int fd, const uint8_t *buf, size_t len, const struct sockaddr_in &src, const fake_service &svc){
+    std::vector<uint8_t> pkt(DNS_HEADER_SIZE);
+    std::vector<std::string> labels;
+    size_t off = DNS_HEADER_SIZE;
+    uint16_t ancount = 0;
+    uint16_t arcount = 0;
+    bool wantPtr = false;
+    bool wantSrv = false;
+    bool wantA = false;
+
+    if (len < DNS_HEADER_SIZE || (buf[2] & (DNS_FLAG_QR >> 8))) return; //responses, including our own
+    for (uint16_t i=0, qdcount = (buf[4] << 8) | buf[5]; i<qdcount; i++) {
+        uint16_t qtype = 0;
+        if (!read_name(buf, len, off, labels) || off+4 > len) return;
+        qtype = (buf[off] << 8) | buf[off+1];
+        off += 4;
+        if (qtype == DNS_TYPE_PTR && same_name(labels, svc.type)) wantPtr = true;
+        else if (qtype == DNS_TYPE_SRV && same_name(labels, svc.instance)) wantSrv = true;
+        else if (qtype == DNS_TYPE_A && same_name(labels, svc.host)) wantA = true;
+    }
+    //known answers are ignored, the browser copes with hearing the same answer again
+    if (wantPtr) {
+        put_ptr(pkt, svc, svc.ttl);
+        ancount++;
+    }
+    if (wantSrv) {
+        put_srv(pkt, svc);
+        ancount++;
+    }
+    if (wantA) {
+        put_a(pkt, svc);
+        ancount++;
+    }
+    if (!ancount) return;
+    //save the browser a round trip, like a real responder would
+    if (!wantSrv) {
+        put_srv(pkt, svc);
+        arcount++;
+    }
+    if (!wantA) {
+        put_a(pkt, svc);
+        arcount++;
+    }
+    finish_response(pkt, ancount, arcount);
+    printf("answering %s%s%squery from %s:%d\n",wantPtr ? "PTR " : "",wantSrv ? "SRV " : "",wantA ? "A " : "",
+           inet_ntoa(src.sin_addr),ntohs(src.sin_port));
+    send_response(fd, src, pkt);
+}
+
+static void sig_handler(int sig){
+    if (sig == SIGUSR1) gWantGoodbye = 1;
+    else gWantExit = 1;
+}
+
+static void usage(const char *prog){
+    printf("usage: %s [-p port] [-t ttl] [-g seconds] [-s seconds] [-T type] instance host ipv4\n",prog);
+    printf("  -p port     port to answer on (default %d), pass it as USBMUXD_MDNS_PORT\n",FAKE_MDNS_DEFAULT_PORT);
+    printf("  -t ttl      record TTL in seconds (default %d)\n",FAKE_MDNS_DEFAULT_TTL);
+    printf("  -g seconds  send a goodbye after that many seconds, then keep quiet\n");
+    printf("  -s seconds  stop answering after that many seconds, without a goodbye\n");
+    printf("  -T type     service type (default _remotepairing-manual-pairing._tcp)\n");
+    printf("SIGUSR1 sends a goodbye right away.\n");
+}
+
+int main(int argc, char * const argv[]) {
+    int fd = -1;
+    int opt = 0;
+    uint16_t port = FAKE_MDNS_DEFAULT_PORT;
+    int goodbyeAfter = -1;
+    int silentAfter = -1;
+    const char *type = "_remotepairing-manual-pairing._tcp";
+    struct sockaddr_in local = {};
+    struct sockaddr_in lastQuerier = {};
+    fake_service svc = {};
+    bool isSilent = false;
+    auto start = fake_clock::now();
+
+    svc.ttl = FAKE_MDNS_DEFAULT_TTL;
+    while ((opt = getopt(argc, argv, "p:t:g:s:T:h")) != -1) {
+        switch (opt) {
+            case 'p': port = (uint16_t)atoi(optarg); break;
+            case 't': svc.ttl = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'g': goodbyeAfter = atoi(optarg); break;
+            case 's': silentAfter = atoi(optarg); break;
+            case 'T': type = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 3 || inet_pton(AF_INET, argv[optind+2], &svc.addr) != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    svc.type = split_name(type);
+    svc.type.push_back("local");
+    svc.instance = svc.type;
+    svc.instance.insert(svc.instance.begin(), argv[optind]);
+    svc.host = split_name(argv[optind+1]);
+    if (!svc.host.size() || strcasecmp(svc.host.back().c_str(), "local")) svc.host.push_back("local");
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        printf("socket failed errno=%d (%s)\n",errno,strerror(errno));
+        return 2;
+    }
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local))) {
+        printf("failed to bind port %d errno=%d (%s)\n",port,errno,strerror(errno));
+        close(fd);
+        return 2;
+    }
+    signal(SIGUSR1, sig_handler);
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    printf("answering for '%s' -> %s (%s) on port %d, ttl %u\n",argv[optind],argv[optind+1],argv[optind+2],port,svc.ttl);
+
+    while (!gWantExit) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int elapsed = (int)std::chrono::duration_cast<std::chrono::seconds>(fake_clock::now() - start).count();
+
+        if (!isSilent && silentAfter >= 0 && elapsed >= silentAfter) {
+            printf("no longer answering\n");
+            isSilent = true;
+        }
+        if (!isSilent && goodbyeAfter >= 0 && elapsed >= goodbyeAfter) gWantGoodbye = 1;
+        if (gWantGoodbye) {
+            gWantGoodbye = 0;
+            if (lastQuerier.sin_port) {
+                send_goodbye(fd, lastQuerier, svc);
+            } else {
+                printf("nobody asked yet, no one to say goodbye to\n");
+            }
+            isSilent = true;
+        }
+
+        if (poll(&pfd, 1, 1000) <= 0) continue;
+        {
+            uint8_t buf[9000];
+            struct sockaddr_in src = {};
+            socklen_t srclen = sizeof(src);
+            ssize_t got = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&src, &srclen);
+            if (got <= 0) continue;
+            lastQuerier = src;
+            if (!isSilent) handle_query(fd, buf, (size_t)got, src, svc);
+        }
+    }
+    close(fd);
+    return 0;
+}
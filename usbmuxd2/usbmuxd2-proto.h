@@ -49,6 +49,68 @@ extern "C"{
         uint16_t reserved;   // set to zero
     } __attribute__((__packed__));
     
+    /*
+        Multiplexed sessions: after a successful "Multiplex" plist request,
+        the socket only carries frames, each one belonging to a logical stream picked by the client.
+     */
+    enum usbmuxd_mux_frametype {
+        MUX_FRAME_OPEN = 1,     // client: usbmuxd_mux_open, daemon: usbmuxd_mux_open_result
+        MUX_FRAME_DATA = 2,     // stream payload, limited by the receivers window
+        MUX_FRAME_WINDOW = 3,   // uint32_t bytes the sender may send additionally
+        MUX_FRAME_CLOSE = 4,    // no payload, the stream is gone after this
+    };
+    
+    struct usbmuxd_mux_frame {
+        uint32_t length;    // length of payload, excluding header
+        uint16_t type;      // usbmuxd_mux_frametype
+        uint16_t reserved;  // set to zero
+        uint32_t stream;    // stream id, chosen by the client on OPEN
+    } __attribute__((__packed__));
+    
+    struct usbmuxd_mux_open {
+        uint32_t device_id;
+        uint16_t port;      // TCP port number (network byte order)
+        uint16_t reserved;  // set to zero
+        uint32_t window;    // bytes the daemon may send before the first WINDOW frame
+    } __attribute__((__packed__));
+    
+    struct usbmuxd_mux_open_result {
+        uint32_t result;    // usbmuxd_result
+        uint32_t window;    // bytes the client may send before the first WINDOW frame
+    } __attribute__((__packed__));
+    
+    /*
+        Shared memory data channel: a Connect plist with "SharedMemory" may be answered with
+        "SharedMemoryRingSize" in its result, which then carries three fds (SCM_RIGHTS):
+        the memfd holding usbmuxd_shm_header followed by the rx and the tx ring (ring_size bytes each),
+        the client doorbell (written by the daemon) and the daemon doorbell (written by the client), both eventfds.
+        After that the socket only signals the lifetime of the connection.
+     
+        Both rings are single producer / single consumer, head and tail count bytes ever written/read.
+        A producer rings the other side's doorbell when the ring was empty before it wrote,
+        a consumer does so when the ring was at least half full before it read.
+        So only sleep on your doorbell while a ring you read from is empty or a ring you write to is more than half full.
+     */
+#define USBMUXD_SHM_MAGIC 0x72786d75 /* 'umxr' */
+#define USBMUXD_SHM_VERSION 1
+    
+    struct usbmuxd_shm_ring {
+        uint64_t head;      // written by the producer
+        uint8_t pad0[56];
+        uint64_t tail;      // written by the consumer
+        uint8_t pad1[56];
+    } __attribute__((__aligned__(64)));
+    
+    struct usbmuxd_shm_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t ring_size;     // power of two
+        uint32_t data_offset;   // offset of the rx ring in the memfd, the tx ring follows it
+        uint8_t pad[48];
+        struct usbmuxd_shm_ring rx; // device -> client
+        struct usbmuxd_shm_ring tx; // client -> device
+    } __attribute__((__aligned__(64)));
+    
 #ifdef __cplusplus
 };
 #endif